@@ -7,7 +7,28 @@
 #include <stdio.h>
 #include <time.h>
 #include <stdlib.h>
-#include <immintrin.h> // AVX instruction set (x86)
+#if defined(__x86_64__) || defined(__i386__)
+#define X86
+#include <immintrin.h> // SSE, AVX and AVX-512 instruction sets (x86)
+#elif defined(__aarch64__)
+#include <arm_neon.h> // NEON instruction set (ARM)
+#include <sys/auxv.h> // HWCAP, the instruction sets of the CPU
+#endif
+#include <pthread.h> // Threads of version7 (link with -pthread)
+#include <stdatomic.h> // Work stealing
+#include <string.h>
+#include <stdint.h> // Narrow element types
+#include <float.h> // Rounding error of the floating point types
+#include <unistd.h> // Number of cores
+#include <math.h> // Standard deviation (link with -lm)
+#include <errno.h>
+#ifdef __linux__
+#include <linux/perf_event.h> // Hardware counters
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define TARGET(isa) __attribute__((target(isa))) // Compile a function for an instruction set the CPU may lack
 
 /*
 	This program performs experimental evaluations of different methods used to multiply two large (10^6 cells) matrices.
@@ -17,8 +38,8 @@
 	and it can also verify the correctness of the output of each multiplication by using the function:
 		compare_matrices.
 
-	The two multiplied matrices are N x N square matrices.
-	The value of N is sufficient to create a large matrix that doesn't fit in the cache memory of any modern computer.
+	The two multiplied matrices are N x N square matrices, unless other sizes are given on the command line
+	(-size MxKxN multiplies a M x K matrix with a K x N matrix), of ints unless -type chooses another element type. The default value of N is sufficient to create a large matrix that doesn't fit in the cache memory of any modern computer.
 	Setting N to a large value guarantees that the whole matrix is not loaded in the cache memory.
 	Thus, many loads and stores are done from/to the main memory to/from the cache memory.
 	If N = 1000, then the size of every matrix is 1000 * 1000 = 10^6 integers or about 4 MB (32 bits/4 bytes per integer).
@@ -28,48 +49,149 @@
 */
 
 
-#define N 1000
+#define N 1000 		// Default size of the matrices (-size)
+#define ALIGN 64 	// Rows start on a cache line
 
-// Compare the matrices, and return 1 if they are equal, 0 otherwise
-int compare_matrices(int mat1[N][N], int mat2[N][N]) {
-	int i, j;
-	for (i = 0; i < N; ++i) for (j = 0; j < N; ++j)
-		if (mat1[i][j] != mat2[i][j])
-			return 0;
-	return 1;
+/*
+	Matrices are allocated at runtime, row by row (row-major order). Rows are padded to whole
+	cache lines, so every row starts on a line, and by one more line when a row would be a
+	multiple of 4 KB: a column would fall into a handful of cache sets otherwise.
+	Cells are ints unless another element type is chosen (-type, see struct element): CELLT
+	reaches a cell of any type, CELL one of an int matrix.
+*/
+struct matrix {
+	int rows, cols;
+	int ld; 	// Cells from one row to the next (leading dimension)
+	int size; 	// Bytes per cell
+	void* cells;
+};
+#define CELLT(T, m, i, j) (((T*) (m).cells)[(size_t) (i) * (m).ld + (j)])
+#define CELL(m, i, j) CELLT(int, m, i, j)
+#define CELLP(m, i, j) ((char*) (m).cells + ((size_t) (i) * (m).ld + (j)) * (m).size)
+
+int leading_dimension(int cols, int size) {
+	int line = ALIGN / size, ld = (cols + line - 1) / line * line;
+	return (size_t) ld * size % 4096 == 0 ? ld + line : ld;
+}
+
+void alloc_matrix(struct matrix* m, int rows, int cols, int size) {
+	m->rows = rows;
+	m->cols = cols;
+	m->size = size;
+	m->ld = leading_dimension(cols, size);
+	m->cells = aligned_alloc(ALIGN, (size_t) rows * m->ld * size);
+}
+
+void free_matrix(struct matrix* m) {
+	free(m->cells);
+	m->cells = NULL;
+}
+
+void clear_matrix(struct matrix* m) {
+	memset(m->cells, 0, (size_t) m->rows * m->ld * m->size);
+}
+
+/*
+	Element types. The cells of mat1 and mat2 are TA and TB, those of result TC, which is an
+	int for the 8 and 16 bit types: their products are summed up in 32 bits, as quantized neural
+	networks do. The 8 bit type multiplies unsigned cells of mat1 with signed cells of mat2, the
+	way VNNI does (vpdpbusd). Every type has
+		init: the cells random integer values in the range [0..9], the same for every type,
+		reference: the loops of version1, to check the result against,
+		compare: 1 if the matrices are equal within the rounding error of a sum of depth products, 0 otherwise.
+	With cells that aren't negative, |reference| is also the sum of the magnitudes of the products,
+	so EPS * depth * |reference| bounds the rounding error. Integers are exact (EPS 0).
+*/
+#define ELEMENT(name, TA, TB, TC, EPS) \
+void init_##name(struct matrix mat1, struct matrix mat2) { \
+	int i, j; \
+	for (i = 0; i < mat1.rows; ++i) for (j = 0; j < mat1.cols; ++j) \
+		CELLT(TA, mat1, i, j) = rand() % 10; \
+	for (i = 0; i < mat2.rows; ++i) for (j = 0; j < mat2.cols; ++j) \
+		CELLT(TB, mat2, i, j) = rand() % 10; \
+} \
+void reference_##name(struct matrix mat1, struct matrix mat2, struct matrix result) { \
+	int i, j, k; \
+	for (i = 0; i < result.rows; ++i) \
+		for (j = 0; j < result.cols; ++j) { \
+			TC c = 0; \
+			for (k = 0; k < mat1.cols; ++k) \
+				c += (TC) CELLT(TA, mat1, i, k) * CELLT(TB, mat2, k, j); \
+			CELLT(TC, result, i, j) += c; \
+		} \
+} \
+int compare_##name(struct matrix mat1, struct matrix mat2, int depth) { \
+	int i, j; \
+	for (i = 0; i < mat1.rows; ++i) for (j = 0; j < mat1.cols; ++j) { \
+		double x = CELLT(TC, mat1, i, j), y = CELLT(TC, mat2, i, j); \
+		double bound = EPS * depth * (y < 0 ? -y : y); \
+		if (x - y > bound || y - x > bound) \
+			return 0; \
+	} \
+	return 1; \
+}
+ELEMENT(int32, int, int, int, 0)
+ELEMENT(float, float, float, float, FLT_EPSILON)
+ELEMENT(double, double, double, double, DBL_EPSILON)
+ELEMENT(int16, int16_t, int16_t, int, 0)
+ELEMENT(int8, uint8_t, int8_t, int, 0)
+
+enum { INT32, FLOAT, DOUBLE, INT16, INT8, TYPES };
+
+struct element {
+	const char* name;
+	int sizes[3]; 	// Bytes per cell of mat1, mat2 and result
+	void (*init)(struct matrix mat1, struct matrix mat2);
+	void (*reference)(struct matrix mat1, struct matrix mat2, struct matrix result);
+	int (*compare)(struct matrix mat1, struct matrix mat2, int depth);
+};
+
+#define ELEMENT_FUNCTIONS(name) init_##name, reference_##name, compare_##name
+struct element elements[TYPES] = {
+	{ "int32", 	{ sizeof(int), sizeof(int), sizeof(int) }, 			ELEMENT_FUNCTIONS(int32) },
+	{ "float", 	{ sizeof(float), sizeof(float), sizeof(float) }, 	ELEMENT_FUNCTIONS(float) },
+	{ "double", { sizeof(double), sizeof(double), sizeof(double) }, ELEMENT_FUNCTIONS(double) },
+	{ "int16", 	{ sizeof(int16_t), sizeof(int16_t), sizeof(int) }, 	ELEMENT_FUNCTIONS(int16) },
+	{ "int8", 	{ sizeof(uint8_t), sizeof(int8_t), sizeof(int) }, 	ELEMENT_FUNCTIONS(int8) },
+};
+int type = INT32; 	// Element type of the matrices (-type), versions 1 to 5 only multiply int32
+
+// Compare the matrices (of the element type), and return 1 if they are equal, 0 otherwise
+int compare_matrices(struct matrix mat1, struct matrix mat2, int depth) {
+	return elements[type].compare(mat1, mat2, depth);
 }
 
 // Algorithm 1: row-major order (4.285620 s, 0.502490 s)
-void version1(int mat1[N][N], int mat2[N][N], int result[N][N]) {
+void version1(struct matrix mat1, struct matrix mat2, struct matrix result) {
 	int i, j, k;
-	for (i = 0; i < N; ++i) {
-		for (j = 0; j < N; ++j) {
+	for (i = 0; i < result.rows; ++i) {
+		for (j = 0; j < result.cols; ++j) {
 			// Compute the value for result[i][j]. Initialize it to 0, then
 			// run through row i of mat1 and column j of mat2 in parallel and
 			// multiply their elements pairwise and sum up the products.
 
-			for (k = 0; k < N; ++k)
-				result[i][j] += mat1[i][k] * mat2[k][j];
+			for (k = 0; k < mat1.cols; ++k)
+				CELL(result, i, j) += CELL(mat1, i, k) * CELL(mat2, k, j);
 		}
 	}
 }
 
 // Algorithm 2: column-major order (3.236650 s, 0.502120 s)
-void version2(int mat1[N][N], int mat2[N][N], int result[N][N]) {
+void version2(struct matrix mat1, struct matrix mat2, struct matrix result) {
 	int i, j, k;
-	for (j = 0; j < N; ++j)
-		for (i = 0; i < N; ++i)
-			for (k = 0; k < N; ++k)
-				result[i][j] += mat1[i][k] * mat2[k][j];
+	for (j = 0; j < result.cols; ++j)
+		for (i = 0; i < result.rows; ++i)
+			for (k = 0; k < mat1.cols; ++k)
+				CELL(result, i, j) += CELL(mat1, i, k) * CELL(mat2, k, j);
 }
 
 // Algorithm 3: cell priority (2.256460 s, 0.502110 s)
-void version3(int mat1[N][N], int mat2[N][N], int result[N][N]) {
+void version3(struct matrix mat1, struct matrix mat2, struct matrix result) {
 	int i, j, k;
-	for (i = 0; i < N; ++i)
-		for (j = 0; j < N; ++j)
-			for (k = 0; k < N; ++k)
-				result[i][k] += mat1[i][j] * mat2[j][k];
+	for (i = 0; i < result.rows; ++i)
+		for (j = 0; j < mat1.cols; ++j)
+			for (k = 0; k < result.cols; ++k)
+				CELL(result, i, k) += CELL(mat1, i, j) * CELL(mat2, j, k);
 }
 
 // Algorithm 4: I'm a genius (1.919360 s, 0.332810)
@@ -78,13 +200,13 @@ void version3(int mat1[N][N], int mat2[N][N], int result[N][N]) {
 	This results in an algorithm where all 3 matrices are iterated on row first.
 	This should be faster if arrays are stored in row-major order.
 */
-void version4(int mat1[N][N], int mat2[N][N], int result[N][N]) {
+void version4(struct matrix mat1, struct matrix mat2, struct matrix result) {
 	int i, j, k, c; // c for cell
-	for (i = 0; i < N; ++i)
-		for (j = 0; j < N; ++j) {
-			c = mat1[i][j];
-			for (k = 0; k < N; ++k)
-				result[i][k] += c * mat2[j][k];
+	for (i = 0; i < result.rows; ++i)
+		for (j = 0; j < mat1.cols; ++j) {
+			c = CELL(mat1, i, j);
+			for (k = 0; k < result.cols; ++k)
+				CELL(result, i, k) += c * CELL(mat2, j, k);
 		}
 }
 
@@ -102,97 +224,1107 @@ void version4(int mat1[N][N], int mat2[N][N], int result[N][N]) {
 	I converted my own algorithm, because it's the closest to row first you can get, AND it had the fastest speed.
 	On my desktop computer, the combination of my own algorithm and AVX instructions yielded results that were 
 	close to 5 times faster than the original algorithm, on which the others are based.
+
+	Rows that aren't a multiple of 8 long end in a partial vector. Its lanes are masked, so
+	the loads and stores never touch a cell beyond the row.
+	Only this function is compiled for AVX2, and it's skipped on CPUs without it (see has_avx2).
 */
-void version5(int mat1[N][N], int mat2[N][N], int result[N][N]) {
-	int i, j, k;
+#ifdef X86
+TARGET("avx2") void version5(struct matrix mat1, struct matrix mat2, struct matrix result) {
+	int i, j, k, cols = result.cols, full = cols - cols % VECTORIZE;
 	__m256i vA, vB, vR;
+	__m256i vTail = _mm256_cmpgt_epi32(_mm256_set1_epi32(cols % VECTORIZE), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
 
-	for (i = 0; i < N; ++i)
-		for (k = 0; k < N; ++k) {
+	for (i = 0; i < result.rows; ++i)
+		for (k = 0; k < mat1.cols; ++k) {
 			// (1) vA: local cell to use for multiplications (only 1 int), row first, like version4.
 			// (2) for loop: vectorize 8 values (256/32 = 8)
-			vA = _mm256_set1_epi32(mat1[i][k]);
-			for (j = 0; j < N; j += VECTORIZE) {
+			// (3) the partial vector at the end of the row, if any.
+			int* b = &CELL(mat2, k, 0);
+			int* r = &CELL(result, i, 0);
+			vA = _mm256_set1_epi32(CELL(mat1, i, k));
+			for (j = 0; j < full; j += VECTORIZE) {
 				// (1) load 8 ints from mat2, row first
 				// (2) load 8 ints from result, row first
 				// (3) (8 consecutive ints of result) += (cell * (8 consecutive ints from mat2))
 				// (4) store the 8 updated ints to result, from index j+0 to j+7.
-				vB = _mm256_loadu_si256(&mat2[k][j]);
-				vR = _mm256_loadu_si256(&result[i][j]);
+				vB = _mm256_loadu_si256((__m256i*) &b[j]);
+				vR = _mm256_loadu_si256((__m256i*) &r[j]);
+				vR = _mm256_add_epi32(vR, _mm256_mullo_epi32(vA, vB));
+				_mm256_storeu_si256((__m256i*) &r[j], vR);
+			}
+			if (j < cols) {
+				vB = _mm256_maskload_epi32(&b[j], vTail);
+				vR = _mm256_maskload_epi32(&r[j], vTail);
 				vR = _mm256_add_epi32(vR, _mm256_mullo_epi32(vA, vB));
-				_mm256_storeu_si256(&result[i][j], vR);
+				_mm256_maskstore_epi32(&r[j], vTail, vR);
+			}
+		}
+}
+#else
+void version5(struct matrix mat1, struct matrix mat2, struct matrix result) {
+	// Never called, AVX2 is x86 only.
+}
+#endif
+
+// Algorithm 6: cache blocking and register tiling (0.361687 s, 0.080189 s)
+#define MR 6 	// Rows of result held in registers by the micro-kernel
+#define KC 256 	// Depth of a block: one panel of mat2 (16 KB for ints with AVX2) stays in L1
+#define MC 96 	// Rows of mat1 per block: MR high panels of it (96 KB) stay in L2
+#define NC 1024 // Columns of mat2 per block: its KC deep panels (1 MB) stay in L3
+#define WORD 8 	// Bytes of the widest word of a panel (a double)
+/*
+	version5 streams a whole row of mat2 and result through the cache for every single cell of mat1,
+	and loads and stores each run of 8 result cells N times. This version works on blocks instead:
+	a KC x NC block of mat2 and a MC x KC block of mat1 are copied (packed) into panels that are read
+	strictly in order, so every cache line fetched is used completely before it leaves the cache.
+
+	The micro-kernel computes a MR x NR tile of result in 12 vector registers (NR is 2 vectors), over
+	the whole depth of the block. Per step of k it loads 2 vectors of the mat2 panel and broadcasts 6
+	words of the mat1 panel, for 12 multiply-adds, and the tile is only read from and written to result
+	once per block. Panels are zero padded, so tiles at the edges (sizes needn't be multiples of MR and NR)
+	run the same loop, and only the cells inside result are added back.
+
+	A word of a panel is one cell of the element type, or for the 8 and 16 bit types a group of 4 or 2
+	cells of consecutive k, which vpdpbusd, vpdpwssd and pmaddwd multiply pairwise and sum up into an
+	int lane. Kernels without such instructions get the narrow cells widened (to pairs of int16, or
+	to ints) when packing, and multiply them like any other int.
+*/
+_Alignas(ALIGN) char pack1[MC * KC * WORD], pack2[KC * NC * WORD];
+
+/*
+	The packing of each kind of panel, from cells S1 (S2) of mat1 (mat2) to panels of D1 (D2), G cells
+	of k per word. kc is counted in cells, the panels are (kc + G - 1) / G words deep.
+*/
+#define PACK(name, S1, D1, S2, D2, G) \
+void pack1_##name(void* panel, struct matrix mat1, int i0, int k0, int mc, int kc) { \
+	/* MR rows at a time, column by column: the order the micro-kernel broadcasts them in. */ \
+	D1* pack1 = panel; \
+	int i, w, r, s, kw = (kc + G - 1) / G; \
+	for (i = 0; i < mc; i += MR) \
+		for (w = 0; w < kw; ++w) \
+			for (r = 0; r < MR; ++r) \
+				for (s = 0; s < G; ++s) \
+					pack1[(i * kw + w * MR + r) * G + s] = \
+						i + r < mc && w * G + s < kc ? CELLT(S1, mat1, i0 + i + r, k0 + w * G + s) : 0; \
+} \
+void pack2_##name(void* panel, struct matrix mat2, int k0, int j0, int kc, int nc, int nr) { \
+	/* nr columns at a time, row by row: the order the micro-kernel loads them in. */ \
+	D2* pack2 = panel; \
+	int j, w, c, s, kw = (kc + G - 1) / G; \
+	for (j = 0; j < nc; j += nr) \
+		for (w = 0; w < kw; ++w) \
+			for (c = 0; c < nr; ++c) \
+				for (s = 0; s < G; ++s) \
+					pack2[(j * kw + w * nr + c) * G + s] = \
+						j + c < nc && w * G + s < kc ? CELLT(S2, mat2, k0 + w * G + s, j0 + j + c) : 0; \
+}
+PACK(int32, int, int, int, int, 1)
+PACK(float, float, float, float, float, 1)
+PACK(double, double, double, double, double, 1)
+PACK(int16_pairs, int16_t, int16_t, int16_t, int16_t, 2)
+PACK(int16_ints, int16_t, int, int16_t, int, 1)
+PACK(int8_quads, uint8_t, uint8_t, int8_t, int8_t, 4)
+PACK(int8_pairs, uint8_t, int16_t, int8_t, int16_t, 2)
+PACK(int8_ints, uint8_t, int, int8_t, int, 1)
+
+/*
+	The micro-kernel is written once, for words T, vectors VEC of LANES words and the operations
+	ZERO, LOAD, STORE, SPLAT (one word in every lane), MADD (r += x * y, lane by lane or a group
+	per lane) and ADD. Every instruction set and element type below instantiates MICRO_KERNEL,
+	each compiled for its instruction set alone (TARGET), so the program runs on any CPU and only
+	calls the kernels the CPU has (see pick_isa).
+*/
+#define MADD_ROW(r, SPLAT, MADD) \
+	vA = SPLAT(a[r]); \
+	vR##r##0 = MADD(vR##r##0, vA, vB0); \
+	vR##r##1 = MADD(vR##r##1, vA, vB1);
+#define ADD_ROW(r, LANES, LOAD, STORE, ADD) \
+	STORE(&c[r * ldc], ADD(LOAD(&c[r * ldc]), vR##r##0)); \
+	STORE(&c[r * ldc + LANES], ADD(LOAD(&c[r * ldc + LANES]), vR##r##1));
+#define STORE_ROW(r, LANES, STORE) \
+	STORE(&tile[r * 2 * LANES], vR##r##0); \
+	STORE(&tile[r * 2 * LANES + LANES], vR##r##1);
+#define MICRO_KERNEL(name, T, VEC, LANES, ZERO, LOAD, STORE, SPLAT, MADD, ADD) \
+void name(int kw, const void* pack1, const void* pack2, void* cells, int ldc, int rows, int cols) { \
+	const T* a = pack1; \
+	const T* b = pack2; \
+	T* c = cells; \
+	VEC vA, vB0, vB1; \
+	VEC vR00 = ZERO(), vR01 = vR00, vR10 = vR00, vR11 = vR00, vR20 = vR00, vR21 = vR00, \
+		vR30 = vR00, vR31 = vR00, vR40 = vR00, vR41 = vR00, vR50 = vR00, vR51 = vR00; \
+	T tile[MR * 2 * LANES]; \
+	int k, r, j; \
+	/* (1) 2 vectors of one row of the mat2 panel */ \
+	/* (2) (6 rows of the tile) += (one word of mat1 per row * the 2 vectors) */ \
+	for (k = 0; k < kw; ++k) { \
+		vB0 = LOAD(&b[0]); \
+		vB1 = LOAD(&b[LANES]); \
+		MADD_ROW(0, SPLAT, MADD) MADD_ROW(1, SPLAT, MADD) MADD_ROW(2, SPLAT, MADD) \
+		MADD_ROW(3, SPLAT, MADD) MADD_ROW(4, SPLAT, MADD) MADD_ROW(5, SPLAT, MADD) \
+		a += MR; \
+		b += 2 * LANES; \
+	} \
+	/* A full tile goes straight into result, an edge tile through memory. */ \
+	if (rows == MR && cols == 2 * LANES) { \
+		ADD_ROW(0, LANES, LOAD, STORE, ADD) ADD_ROW(1, LANES, LOAD, STORE, ADD) ADD_ROW(2, LANES, LOAD, STORE, ADD) \
+		ADD_ROW(3, LANES, LOAD, STORE, ADD) ADD_ROW(4, LANES, LOAD, STORE, ADD) ADD_ROW(5, LANES, LOAD, STORE, ADD) \
+		return; \
+	} \
+	STORE_ROW(0, LANES, STORE) STORE_ROW(1, LANES, STORE) STORE_ROW(2, LANES, STORE) \
+	STORE_ROW(3, LANES, STORE) STORE_ROW(4, LANES, STORE) STORE_ROW(5, LANES, STORE) \
+	for (r = 0; r < rows; ++r) \
+		for (j = 0; j < cols; ++j) \
+			c[r * ldc + j] += tile[r * 2 * LANES + j]; \
+}
+
+#ifdef X86
+#define LOAD_128(p) _mm_loadu_si128((const __m128i*) (p))
+#define STORE_128(p, v) _mm_storeu_si128((__m128i*) (p), v)
+#define LOAD_256(p) _mm256_loadu_si256((const __m256i*) (p))
+#define STORE_256(p, v) _mm256_storeu_si256((__m256i*) (p), v)
+#define MULADD_128(r, x, y) _mm_add_epi32(r, _mm_mullo_epi32(x, y))
+#define MULADD_256(r, x, y) _mm256_add_epi32(r, _mm256_mullo_epi32(x, y))
+#define MULADD_512(r, x, y) _mm512_add_epi32(r, _mm512_mullo_epi32(x, y))
+#define PAIRS_128(r, x, y) _mm_add_epi32(r, _mm_madd_epi16(x, y))
+#define PAIRS_256(r, x, y) _mm256_add_epi32(r, _mm256_madd_epi16(x, y))
+#define PAIRS_512(r, x, y) _mm512_add_epi32(r, _mm512_madd_epi16(x, y))
+#define MULADD_PS128(r, x, y) _mm_add_ps(r, _mm_mul_ps(x, y))
+#define MULADD_PD128(r, x, y) _mm_add_pd(r, _mm_mul_pd(x, y))
+#define FMA_PS256(r, x, y) _mm256_fmadd_ps(x, y, r)
+#define FMA_PD256(r, x, y) _mm256_fmadd_pd(x, y, r)
+#define FMA_PS512(r, x, y) _mm512_fmadd_ps(x, y, r)
+#define FMA_PD512(r, x, y) _mm512_fmadd_pd(x, y, r)
+
+// AVX-512: a 6 x 2 vector tile in 12 of the 32 zmm registers. VNNI sums 2 int16 or 4 int8 products per lane.
+TARGET("avx512f") MICRO_KERNEL(micro_avx512_int32, int, __m512i, 16,
+	_mm512_setzero_si512, _mm512_loadu_si512, _mm512_storeu_si512, _mm512_set1_epi32, MULADD_512, _mm512_add_epi32)
+TARGET("avx512f") MICRO_KERNEL(micro_avx512_float, float, __m512, 16,
+	_mm512_setzero_ps, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_set1_ps, FMA_PS512, _mm512_add_ps)
+TARGET("avx512f") MICRO_KERNEL(micro_avx512_double, double, __m512d, 8,
+	_mm512_setzero_pd, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_set1_pd, FMA_PD512, _mm512_add_pd)
+TARGET("avx512bw") MICRO_KERNEL(micro_avx512_pairs, int, __m512i, 16,
+	_mm512_setzero_si512, _mm512_loadu_si512, _mm512_storeu_si512, _mm512_set1_epi32, PAIRS_512, _mm512_add_epi32)
+TARGET("avx512vnni") MICRO_KERNEL(micro_avx512vnni_pairs, int, __m512i, 16,
+	_mm512_setzero_si512, _mm512_loadu_si512, _mm512_storeu_si512, _mm512_set1_epi32, _mm512_dpwssd_epi32, _mm512_add_epi32)
+TARGET("avx512vnni") MICRO_KERNEL(micro_avx512vnni_quads, int, __m512i, 16,
+	_mm512_setzero_si512, _mm512_loadu_si512, _mm512_storeu_si512, _mm512_set1_epi32, _mm512_dpbusd_epi32, _mm512_add_epi32)
+
+// AVX2 (and FMA for floats): a 6 x 2 vector tile in 12 of the 16 ymm registers. AVX-VNNI is VNNI on ymm registers.
+TARGET("avx2") MICRO_KERNEL(micro_avx2_int32, int, __m256i, 8,
+	_mm256_setzero_si256, LOAD_256, STORE_256, _mm256_set1_epi32, MULADD_256, _mm256_add_epi32)
+TARGET("avx2,fma") MICRO_KERNEL(micro_avx2_float, float, __m256, 8,
+	_mm256_setzero_ps, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, FMA_PS256, _mm256_add_ps)
+TARGET("avx2,fma") MICRO_KERNEL(micro_avx2_double, double, __m256d, 4,
+	_mm256_setzero_pd, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd, FMA_PD256, _mm256_add_pd)
+TARGET("avx2") MICRO_KERNEL(micro_avx2_pairs, int, __m256i, 8,
+	_mm256_setzero_si256, LOAD_256, STORE_256, _mm256_set1_epi32, PAIRS_256, _mm256_add_epi32)
+TARGET("avxvnni") MICRO_KERNEL(micro_avxvnni_pairs, int, __m256i, 8,
+	_mm256_setzero_si256, LOAD_256, STORE_256, _mm256_set1_epi32, _mm256_dpwssd_avx_epi32, _mm256_add_epi32)
+TARGET("avxvnni") MICRO_KERNEL(micro_avxvnni_quads, int, __m256i, 8,
+	_mm256_setzero_si256, LOAD_256, STORE_256, _mm256_set1_epi32, _mm256_dpbusd_avx_epi32, _mm256_add_epi32)
+
+// SSE4.1 (the first SSE with a 32 bit multiply, the rest is SSE2): a 6 x 2 vector tile in 12 of the 16 xmm registers.
+TARGET("sse4.1") MICRO_KERNEL(micro_sse41_int32, int, __m128i, 4,
+	_mm_setzero_si128, LOAD_128, STORE_128, _mm_set1_epi32, MULADD_128, _mm_add_epi32)
+TARGET("sse4.1") MICRO_KERNEL(micro_sse41_float, float, __m128, 4,
+	_mm_setzero_ps, _mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps, MULADD_PS128, _mm_add_ps)
+TARGET("sse4.1") MICRO_KERNEL(micro_sse41_double, double, __m128d, 2,
+	_mm_setzero_pd, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, MULADD_PD128, _mm_add_pd)
+TARGET("sse4.1") MICRO_KERNEL(micro_sse41_pairs, int, __m128i, 4,
+	_mm_setzero_si128, LOAD_128, STORE_128, _mm_set1_epi32, PAIRS_128, _mm_add_epi32)
+#endif
+
+#ifdef __aarch64__
+#define ZERO_S32() vdupq_n_s32(0)
+#define ZERO_F32() vdupq_n_f32(0)
+#define ZERO_F64() vdupq_n_f64(0)
+
+// NEON (part of every AArch64 CPU): a 6 x 2 vector tile in 12 of the 32 q registers.
+MICRO_KERNEL(micro_neon_int32, int, int32x4_t, 4, ZERO_S32, vld1q_s32, vst1q_s32, vdupq_n_s32, vmlaq_s32, vaddq_s32)
+MICRO_KERNEL(micro_neon_float, float, float32x4_t, 4, ZERO_F32, vld1q_f32, vst1q_f32, vdupq_n_f32, vfmaq_f32, vaddq_f32)
+MICRO_KERNEL(micro_neon_double, double, float64x2_t, 2, ZERO_F64, vld1q_f64, vst1q_f64, vdupq_n_f64, vfmaq_f64, vaddq_f64)
+#endif
+
+#define ZERO_SCALAR() 0
+#define LOAD_SCALAR(p) (*(p))
+#define STORE_SCALAR(p, v) (*(p) = (v))
+#define SPLAT_SCALAR(x) (x)
+#define MADD_SCALAR(r, x, y) ((r) + (x) * (y))
+#define ADD_SCALAR(x, y) ((x) + (y))
+
+// No vector instructions: a 6 x 2 tile in 12 registers, on any CPU.
+MICRO_KERNEL(micro_scalar_int32, int, int, 1, ZERO_SCALAR, LOAD_SCALAR, STORE_SCALAR, SPLAT_SCALAR, MADD_SCALAR, ADD_SCALAR)
+MICRO_KERNEL(micro_scalar_float, float, float, 1, ZERO_SCALAR, LOAD_SCALAR, STORE_SCALAR, SPLAT_SCALAR, MADD_SCALAR, ADD_SCALAR)
+MICRO_KERNEL(micro_scalar_double, double, double, 1, ZERO_SCALAR, LOAD_SCALAR, STORE_SCALAR, SPLAT_SCALAR, MADD_SCALAR, ADD_SCALAR)
+
+/*
+	The kernels of each element type, widest first. The CPU is probed once at startup (CPUID on x86,
+	which also tells whether the OS saves the wide registers, HWCAP on ARM), and the first kernel of
+	the element type the CPU runs is used by version6 and version7, unless another one is chosen
+	with -isa name. A kernel is its micro-kernel and the packing of the panels it reads.
+*/
+struct isa_kernel {
+	const char* name;
+	int type; 	// Element type (see struct element)
+	int nr; 	// Columns of the tile: 2 vectors
+	int group; 	// Cells of k per word of the panels
+	int word; 	// Bytes per word
+	int (*supported)(void);
+	void (*pack1)(void* panel, struct matrix mat1, int i0, int k0, int mc, int kc);
+	void (*pack2)(void* panel, struct matrix mat2, int k0, int j0, int kc, int nc, int nr);
+	void (*micro)(int kw, const void* pack1, const void* pack2, void* cells, int ldc, int rows, int cols);
+};
+
+#ifdef X86
+int has_avx512(void) { return __builtin_cpu_supports("avx512f"); }
+int has_avx512bw(void) { return __builtin_cpu_supports("avx512bw"); }
+int has_avx512vnni(void) { return __builtin_cpu_supports("avx512vnni"); }
+int has_avxvnni(void) { return __builtin_cpu_supports("avxvnni"); }
+int has_avx2(void) { return __builtin_cpu_supports("avx2"); }
+int has_avx2_fma(void) { return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"); }
+int has_sse41(void) { return __builtin_cpu_supports("sse4.1"); }
+#else
+int has_avx2(void) { return 0; }
+#endif
+#ifdef __aarch64__
+int has_neon(void) { return (getauxval(AT_HWCAP) & HWCAP_ASIMD) != 0; }
+#endif
+int has_scalar(void) { return 1; }
+
+#define PACKS(name) pack1_##name, pack2_##name
+struct isa_kernel isa_kernels[] = {
+#ifdef X86
+	{ "avx512", 	INT32, 	32, 1, 4, has_avx512, 		PACKS(int32), 		micro_avx512_int32 },
+	{ "avx2", 		INT32, 	16, 1, 4, has_avx2, 		PACKS(int32), 		micro_avx2_int32 },
+	{ "sse4.1", 	INT32, 	8, 	1, 4, has_sse41, 		PACKS(int32), 		micro_sse41_int32 },
+	{ "avx512", 	FLOAT, 	32, 1, 4, has_avx512, 		PACKS(float), 		micro_avx512_float },
+	{ "avx2", 		FLOAT, 	16, 1, 4, has_avx2_fma, 	PACKS(float), 		micro_avx2_float },
+	{ "sse4.1", 	FLOAT, 	8, 	1, 4, has_sse41, 		PACKS(float), 		micro_sse41_float },
+	{ "avx512", 	DOUBLE, 16, 1, 8, has_avx512, 		PACKS(double), 		micro_avx512_double },
+	{ "avx2", 		DOUBLE, 8, 	1, 8, has_avx2_fma, 	PACKS(double), 		micro_avx2_double },
+	{ "sse4.1", 	DOUBLE, 4, 	1, 8, has_sse41, 		PACKS(double), 		micro_sse41_double },
+	{ "avx512vnni", INT16, 	32, 2, 4, has_avx512vnni, 	PACKS(int16_pairs), micro_avx512vnni_pairs },
+	{ "avx512", 	INT16, 	32, 2, 4, has_avx512bw, 	PACKS(int16_pairs), micro_avx512_pairs },
+	{ "avxvnni", 	INT16, 	16, 2, 4, has_avxvnni, 		PACKS(int16_pairs), micro_avxvnni_pairs },
+	{ "avx2", 		INT16, 	16, 2, 4, has_avx2, 		PACKS(int16_pairs), micro_avx2_pairs },
+	{ "sse4.1", 	INT16, 	8, 	2, 4, has_sse41, 		PACKS(int16_pairs), micro_sse41_pairs },
+	{ "avx512vnni", INT8, 	32, 4, 4, has_avx512vnni, 	PACKS(int8_quads), 	micro_avx512vnni_quads },
+	{ "avx512", 	INT8, 	32, 2, 4, has_avx512bw, 	PACKS(int8_pairs), 	micro_avx512_pairs },
+	{ "avxvnni", 	INT8, 	16, 4, 4, has_avxvnni, 		PACKS(int8_quads), 	micro_avxvnni_quads },
+	{ "avx2", 		INT8, 	16, 2, 4, has_avx2, 		PACKS(int8_pairs), 	micro_avx2_pairs },
+	{ "sse4.1", 	INT8, 	8, 	2, 4, has_sse41, 		PACKS(int8_pairs), 	micro_sse41_pairs },
+#endif
+#ifdef __aarch64__
+	{ "neon", 		INT32, 	8, 	1, 4, has_neon, 		PACKS(int32), 		micro_neon_int32 },
+	{ "neon", 		FLOAT, 	8, 	1, 4, has_neon, 		PACKS(float), 		micro_neon_float },
+	{ "neon", 		DOUBLE, 4, 	1, 8, has_neon, 		PACKS(double), 		micro_neon_double },
+	{ "neon", 		INT16, 	8, 	1, 4, has_neon, 		PACKS(int16_ints), 	micro_neon_int32 },
+	{ "neon", 		INT8, 	8, 	1, 4, has_neon, 		PACKS(int8_ints), 	micro_neon_int32 },
+#endif
+	{ "scalar", 	INT32, 	2, 	1, 4, has_scalar, 		PACKS(int32), 		micro_scalar_int32 },
+	{ "scalar", 	FLOAT, 	2, 	1, 4, has_scalar, 		PACKS(float), 		micro_scalar_float },
+	{ "scalar", 	DOUBLE, 2, 	1, 8, has_scalar, 		PACKS(double), 		micro_scalar_double },
+	{ "scalar", 	INT16, 	2, 	1, 4, has_scalar, 		PACKS(int16_ints), 	micro_scalar_int32 },
+	{ "scalar", 	INT8, 	2, 	1, 4, has_scalar, 		PACKS(int8_ints), 	micro_scalar_int32 },
+};
+#define ISA_KERNELS ((int) (sizeof(isa_kernels) / sizeof(*isa_kernels)))
+const struct isa_kernel* isa; 	// Kernel of version6 and version7
+
+// The widest kernel of the element type the CPU runs (name NULL), or the one named if the CPU runs it. NULL if it doesn't.
+const struct isa_kernel* pick_isa(const char* name, int type) {
+	int i;
+	for (i = 0; i < ISA_KERNELS; ++i)
+		if (isa_kernels[i].type == type && (!name || !strcmp(name, isa_kernels[i].name)) && isa_kernels[i].supported())
+			return &isa_kernels[i];
+	return NULL;
+}
+
+void block6(struct matrix mat1, struct matrix mat2, struct matrix result, int i0, int j0, int mc, int nc, char* pack1, char* pack2) {
+	int i, k, ir, jr, depth = mat1.cols, nr = isa->nr, group = isa->group;
+	size_t word = isa->word;
+	void (*micro)(int kw, const void* pack1, const void* pack2, void* cells, int ldc, int rows, int cols) = isa->micro;
+
+	// (1) block of depth (mat2 packed), (2) block of mat1 rows (mat1 packed)
+	// (3) panels of mat2 and mat1 (L1 and registers), one tile of result each
+	for (k = 0; k < depth; k += KC) {
+		int kc = depth - k < KC ? depth - k : KC, kw = (kc + group - 1) / group;
+		isa->pack2(pack2, mat2, k, j0, kc, nc, nr);
+		for (i = 0; i < mc; i += MC) {
+			int mb = mc - i < MC ? mc - i : MC;
+			isa->pack1(pack1, mat1, i0 + i, k, mb, kc);
+			for (jr = 0; jr < nc; jr += nr)
+				for (ir = 0; ir < mb; ir += MR)
+					micro(kw, &pack1[ir * kw * word], &pack2[jr * kw * word], CELLP(result, i0 + i + ir, j0 + jr), result.ld,
+						mb - ir < MR ? mb - ir : MR, nc - jr < nr ? nc - jr : nr);
+		}
+	}
+}
+
+void version6(struct matrix mat1, struct matrix mat2, struct matrix result) {
+	// Blocks of mat2 columns (L3), all rows of result at a time.
+	int j, cols = result.cols;
+	for (j = 0; j < cols; j += NC)
+		block6(mat1, mat2, result, 0, j, result.rows, cols - j < NC ? cols - j : NC, pack1, pack2);
+}
+
+// Algorithm 7: version6 on every core, tiles shared out by work stealing
+#define TM MC 		// Rows of a tile of result: one block of mat1
+#define TN 256 		// Columns of a tile of result: a KC x TN block of mat2 (256 KB) per core
+#define MAX_THREADS 256
+/*
+	Each core computes whole tiles of result with the blocking of version6, so cores never
+	write the same cache line. Tiles are dealt out in row-major order, an equal range to each
+	thread up front. A thread takes its tiles from the front of its own range, and when that
+	is empty it steals the back half of the range of another thread. Both ends of a range
+	are kept in one atomic word, so taking and stealing are a single compare-and-swap each.
+	A thread is done when every range is empty, the tiles still running belong to someone.
+
+	With first touch (-numa), mat_a and mat_r are written for the first time by the thread
+	that starts out with their rows, so on a NUMA system their pages are placed on its node.
+	mat_b is read by every core, its rows are spread over all threads.
+*/
+struct worker7 {
+	_Alignas(64) atomic_ullong range; 	// Tiles left: first (upper 32 bits) and last + 1 (lower 32 bits)
+	pthread_t thread;
+	int id;
+};
+
+struct worker7 workers7[MAX_THREADS];
+struct matrix job1, job2, job3; 	// Matrices of the running multiplication
+int tiles_m, tiles_n, tiles; 		// Tiles down and across result, all tiles
+int threads = 1; 			// Threads of version7 (-threads, all cores by default)
+int first_touch = 0; 			// Place the matrices on the nodes of their threads (-numa)
+
+unsigned long long make_range(unsigned long long first, unsigned long long last) {
+	return first << 32 | last;
+}
+
+int take_tile(struct worker7* w) {
+	// (1) the front tile of the own range, -1 when it's empty.
+	unsigned long long range = atomic_load(&w->range);
+	while ((range >> 32) < (range & 0xFFFFFFFF))
+		if (atomic_compare_exchange_weak(&w->range, &range, make_range((range >> 32) + 1, range & 0xFFFFFFFF)))
+			return (int) (range >> 32);
+	return -1;
+}
+
+int steal_tiles(struct worker7* thief) {
+	// (1) visit the others, starting with the next thread.
+	// (2) take the back half of the first range that isn't empty, it becomes the own range.
+	// (3) return 0 when every range is empty.
+	int n;
+	for (n = 1; n < threads; ++n) {
+		struct worker7* victim = &workers7[(thief->id + n) % threads];
+		unsigned long long range = atomic_load(&victim->range);
+		while ((range >> 32) < (range & 0xFFFFFFFF)) {
+			unsigned long long first = range >> 32, last = range & 0xFFFFFFFF;
+			unsigned long long split = last - (last - first + 1) / 2;
+			if (atomic_compare_exchange_weak(&victim->range, &range, make_range(first, split))) {
+				atomic_store(&thief->range, make_range(split, last));
+				return 1;
 			}
 		}
+	}
+	return 0;
+}
+
+void* run_worker7(void* args) {
+	struct worker7* w = args;
+	char* pack1 = aligned_alloc(ALIGN, MC * KC * WORD);
+	char* pack2 = aligned_alloc(ALIGN, KC * TN * WORD);
+	int tile;
+
+	// (1) row and column of the tile, in row-major order of tiles.
+	// (2) the tile, with blocks of version6 and own packing buffers.
+	do
+		while ((tile = take_tile(w)) >= 0) {
+			int i = tile / tiles_n * TM, j = tile % tiles_n * TN;
+			int mc = job3.rows - i < TM ? job3.rows - i : TM, nc = job3.cols - j < TN ? job3.cols - j : TN;
+			block6(job1, job2, job3, i, j, mc, nc, pack1, pack2);
+		}
+	while (steal_tiles(w));
+
+	free(pack1);
+	free(pack2);
+	return NULL;
+}
+
+void plan_tiles(struct matrix result) {
+	tiles_m = (result.rows + TM - 1) / TM;
+	tiles_n = (result.cols + TN - 1) / TN;
+	tiles 	= tiles_m * tiles_n;
+}
+
+int first_owner(int tile) {
+	// Thread that starts out with a tile.
+	int t = 0;
+	while (t + 1 < threads && (long long) tiles * (t + 1) / threads <= tile)
+		++t;
+	return t;
+}
+
+void deal_tiles(void) {
+	// An equal range of tiles for each thread.
+	int t;
+	for (t = 0; t < threads; ++t) {
+		workers7[t].id = t;
+		atomic_store(&workers7[t].range, make_range((long long) tiles * t / threads, (long long) tiles * (t + 1) / threads));
+	}
+}
+
+void version7(struct matrix mat1, struct matrix mat2, struct matrix result) {
+	// The calling thread is worker 0.
+	int t;
+	job1 = mat1;
+	job2 = mat2;
+	job3 = result;
+	plan_tiles(result);
+	deal_tiles();
+	for (t = 1; t < threads; ++t)
+		pthread_create(&workers7[t].thread, NULL, run_worker7, &workers7[t]);
+	run_worker7(&workers7[0]);
+	for (t = 1; t < threads; ++t)
+		pthread_join(workers7[t].thread, NULL);
+}
+
+// Algorithm 8: Strassen-Winograd, the blocked kernels below a crossover size
+/*
+	Each level splits the matrices in quadrants and makes 7 products of half the size
+	out of 8, for 15 additions of quadrants (Winograd's form of Strassen's algorithm):
+		S1 = A21 + A22 	S2 = S1 - A11 	S3 = A11 - A21 	S4 = A12 - S2
+		T1 = B12 - B11 	T2 = B22 - T1 	T3 = B22 - B12 	T4 = T2 - B21
+		M1 = A11 B11 	M2 = A12 B21 	M3 = S4 B22 	M4 = A22 T4
+		M5 = S1 T1 		M6 = S2 T2 		M7 = S3 T3
+		C11 = M1 + M2 	C12 = M1 + M6 + M5 + M3 	C21 = M1 + M6 + M7 - M4 	C22 = M1 + M6 + M7 + M5
+	The products go into the quadrants of result where they're summed (the schedule of Douglas et al.),
+	so a level needs only 3 temporaries: X (the S), Y (the T) and Z (M1). They're taken from one arena,
+	allocated up front for the whole recursion and only grown for larger matrices.
+	Dimensions that aren't even leave a row, column or depth of one cell out of the recursion, which
+	the classical kernel adds afterwards. Below the crossover (-crossover, any dimension smaller) the
+	blocked kernel takes over: version6, or version7 with more than one thread.
+	Sums of cells would overflow the 8 and 16 bit types, so it only multiplies int32, float and double.
+	Unlike the other versions, version8 overwrites result instead of adding to it.
+*/
+#define MATRIX_SUMS(name, T) \
+void add_##name(struct matrix x, struct matrix y, struct matrix z) { \
+	int i, j; \
+	for (i = 0; i < z.rows; ++i) for (j = 0; j < z.cols; ++j) \
+		CELLT(T, z, i, j) = CELLT(T, x, i, j) + CELLT(T, y, i, j); \
+} \
+void sub_##name(struct matrix x, struct matrix y, struct matrix z) { \
+	int i, j; \
+	for (i = 0; i < z.rows; ++i) for (j = 0; j < z.cols; ++j) \
+		CELLT(T, z, i, j) = CELLT(T, x, i, j) - CELLT(T, y, i, j); \
+}
+MATRIX_SUMS(int32, int)
+MATRIX_SUMS(float, float)
+MATRIX_SUMS(double, double)
+
+struct sums {
+	void (*add)(struct matrix x, struct matrix y, struct matrix z); 	// z = x + y
+	void (*sub)(struct matrix x, struct matrix y, struct matrix z); 	// z = x - y
+} sums[TYPES] = { { add_int32, sub_int32 }, { add_float, sub_float }, { add_double, sub_double } };
+
+int crossover = 512; 		// Smallest dimension that's split (-crossover)
+char* arena; 				// Temporaries of every level
+size_t arena_size, arena_top;
+
+// rows x cols cells of m from row i and column j on, in place.
+struct matrix view(struct matrix m, int i, int j, int rows, int cols) {
+	struct matrix v = m;
+	v.rows = rows;
+	v.cols = cols;
+	v.cells = CELLP(m, i, j);
+	return v;
+}
+
+void clear_view(struct matrix m) {
+	int i;
+	for (i = 0; i < m.rows; ++i)
+		memset(CELLP(m, i, 0), 0, (size_t) m.cols * m.size);
+}
+
+struct matrix arena_matrix(int rows, int cols) {
+	struct matrix m;
+	m.rows = rows;
+	m.cols = cols;
+	m.size = elements[type].sizes[2];
+	m.ld = leading_dimension(cols, m.size);
+	m.cells = arena + arena_top;
+	arena_top += (size_t) rows * m.ld * m.size;
+	return m;
+}
+
+int splits(int m, int k, int n) {
+	return m >= crossover && k >= crossover && n >= crossover;
+}
+
+// Bytes of the temporaries of a multiplication and all its levels below.
+size_t arena_bytes(int m, int k, int n) {
+	size_t x, y, z;
+	int size = elements[type].sizes[2];
+	if (!splits(m, k, n))
+		return 0;
+	x = (size_t) (m / 2) * leading_dimension(k / 2, size) * size;
+	y = (size_t) (k / 2) * leading_dimension(n / 2, size) * size;
+	z = (size_t) (m / 2) * leading_dimension(n / 2, size) * size;
+	return x + y + z + arena_bytes(m / 2, k / 2, n / 2);
+}
+
+void classical(struct matrix mat1, struct matrix mat2, struct matrix result) {
+	if (threads > 1)
+		version7(mat1, mat2, result);
+	else
+		version6(mat1, mat2, result);
+}
+
+void strassen(struct matrix a, struct matrix b, struct matrix c) {
+	int m = c.rows, k = a.cols, n = c.cols, m2 = m / 2, k2 = k / 2, n2 = n / 2;
+	void (*add)(struct matrix x, struct matrix y, struct matrix z) = sums[type].add;
+	void (*sub)(struct matrix x, struct matrix y, struct matrix z) = sums[type].sub;
+	struct matrix a11, a12, a21, a22, b11, b12, b21, b22, c11, c12, c21, c22, x, y, z;
+	size_t top = arena_top;
+
+	if (!splits(m, k, n)) {
+		clear_view(c);
+		classical(a, b, c);
+		return;
+	}
+	a11 = view(a, 0, 0, m2, k2); a12 = view(a, 0, k2, m2, k2); a21 = view(a, m2, 0, m2, k2); a22 = view(a, m2, k2, m2, k2);
+	b11 = view(b, 0, 0, k2, n2); b12 = view(b, 0, n2, k2, n2); b21 = view(b, k2, 0, k2, n2); b22 = view(b, k2, n2, k2, n2);
+	c11 = view(c, 0, 0, m2, n2); c12 = view(c, 0, n2, m2, n2); c21 = view(c, m2, 0, m2, n2); c22 = view(c, m2, n2, m2, n2);
+	x = arena_matrix(m2, k2);
+	y = arena_matrix(k2, n2);
+	z = arena_matrix(m2, n2);
+
+	// (1) M7, M5, M6 and M3 in the quadrants of c, M1 in z.
+	// (2) the sums of the quadrants, M4 and M2 last, in c11 once it's free.
+	sub(a11, a21, x); 	sub(b22, b12, y); 	strassen(x, y, c21);
+	add(a21, a22, x); 	sub(b12, b11, y); 	strassen(x, y, c22);
+	sub(x, a11, x); 	sub(b22, y, y); 	strassen(x, y, c12);
+	sub(a12, x, x); 						strassen(x, b22, c11);
+	strassen(a11, b11, z);
+	add(z, c12, c12);
+	add(c12, c21, c21);
+	add(c12, c22, c12);
+	add(c21, c22, c22);
+	add(c12, c11, c12);
+	sub(y, b21, y); 	strassen(a22, y, c11);
+	sub(c21, c11, c21);
+	strassen(a12, b21, c11);
+	add(z, c11, c11);
+	arena_top = top;
+
+	// The cells left out by odd dimensions: the last depth, the last column, the last row.
+	if (k % 2)
+		classical(view(a, 0, k - 1, 2 * m2, 1), view(b, k - 1, 0, 1, 2 * n2), view(c, 0, 0, 2 * m2, 2 * n2));
+	if (n % 2) {
+		clear_view(view(c, 0, n - 1, m, 1));
+		classical(a, view(b, 0, n - 1, k, 1), view(c, 0, n - 1, m, 1));
+	}
+	if (m % 2) {
+		clear_view(view(c, m - 1, 0, 1, 2 * n2));
+		classical(view(a, m - 1, 0, 1, k), b, view(c, m - 1, 0, 1, 2 * n2));
+	}
+}
+
+void version8(struct matrix mat1, struct matrix mat2, struct matrix result) {
+	size_t bytes = arena_bytes(result.rows, mat1.cols, result.cols);
+	if (bytes > arena_size) {
+		free(arena);
+		arena = aligned_alloc(ALIGN, bytes);
+		arena_size = bytes;
+	}
+	arena_top = 0;
+	strassen(mat1, mat2, result);
 }
 
 // The matrices. mat_ref is used for reference. If the multiplication is done correctly,
-// mat_r should equal mat_ref.
-int mat_a[N][N], mat_b[N][N], mat_r[N][N], mat_ref[N][N];
+// mat_r should equal mat_ref. mat_a is M x K, mat_b is K x N, mat_r and mat_ref are M x N.
+struct matrix mat_a, mat_b, mat_r, mat_ref;
+
+void alloc_matrices(int m, int k, int n) {
+	int* sizes = elements[type].sizes;
+	alloc_matrix(&mat_a, m, k, sizes[0]);
+	alloc_matrix(&mat_b, k, n, sizes[1]);
+	alloc_matrix(&mat_r, m, n, sizes[2]);
+	alloc_matrix(&mat_ref, m, n, sizes[2]);
+}
+
+void free_matrices(void) {
+	free_matrix(&mat_a);
+	free_matrix(&mat_b);
+	free_matrix(&mat_r);
+	free_matrix(&mat_ref);
+}
 
 // Call this before performing the operation (and do *not* include the time to
 // return from this function in your measurements). It fills mat_a and mat_b with
-// random integer values in the range [0..9].
+// random integer values in the range [0..9], of the element type.
 void init_matrices() {
-	int i, j;
 	srand(0xBADB0LL);
-	for (i = 0; i < N; ++i) for (j = 0; j < N; ++j) {
-		mat_a[i][j] = rand() % 10;
-		mat_b[i][j] = rand() % 10;
-		mat_r[i][j] = 0;
-		mat_ref[i][j] = 0;
+	elements[type].init(mat_a, mat_b);
+	clear_matrix(&mat_r);
+	clear_matrix(&mat_ref);
+}
+
+// First touch of the matrices (see version7), before init_matrices writes them.
+void* touch_rows(void* args) {
+	// (1) rows of mat_a and mat_r: those of the first tile of each row of tiles the thread starts out with.
+	// (2) rows of mat_b: every threads-th row.
+	struct worker7* w = args;
+	int i;
+	for (i = 0; i < mat_r.rows; ++i)
+		if (first_owner(i / TM * tiles_n) == w->id) {
+			memset(CELLP(mat_a, i, 0), 0, (size_t) mat_a.ld * mat_a.size);
+			memset(CELLP(mat_r, i, 0), 0, (size_t) mat_r.ld * mat_r.size);
+		}
+	for (i = w->id; i < mat_b.rows; i += threads)
+		memset(CELLP(mat_b, i, 0), 0, (size_t) mat_b.ld * mat_b.size);
+	return NULL;
+}
+
+void touch_matrices(void) {
+	int t;
+	plan_tiles(mat_r);
+	for (t = 0; t < threads; ++t) {
+		workers7[t].id = t;
+		pthread_create(&workers7[t].thread, NULL, touch_rows, &workers7[t]);
 	}
+	for (t = 0; t < threads; ++t)
+		pthread_join(workers7[t].thread, NULL);
 }
 
-void runtest(void * f(int mat1[N][N], int mat2[N][N], int result[N][N]),
-	int version, double clocks[5], int mat1[N][N], int mat2[N][N], int result[N][N]) {
-	
-	// Initialize the matrices
-	init_matrices();
+// Wall clock time in seconds (clock() adds up the CPU time of all threads).
+double wall_time(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+	Timing. Each version runs warmups times first (-warmup), which faults in the pages of result and
+	the packing buffers and warms the caches, and then trials times (-trials), each timed on its own
+	with the wall clock. result is cleared between the runs, outside the time. The median is the
+	time reported, the minimum and the standard deviation tell how noisy the machine was.
+	mat_ref is computed once (reference_matrix), every version is checked against it after its first trial.
+
+	With -perf the cycles, instructions and cache misses of every trial are counted as well
+	(perf_event_open, Linux only, and only when /proc/sys/kernel/perf_event_paranoid lets us).
+	The counters follow the threads of version7, they're inherited by threads started later.
+*/
+#define COUNTERS 3 	// Cycles, instructions and cache misses
+
+struct stats {
+	int version;
+	double median, min, mean, stddev; 	// Seconds per run
+	double gops; 						// Operations per second at the median, in billions
+	double counts[COUNTERS]; 			// Per run (median of the trials), -1 without -perf
+	int correct;
+};
+
+int trials = 5, warmups = 1; 	// Timed runs and runs before them, of each version
+int perf_fds[COUNTERS] = { -1, -1, -1 };
+int reference_done = 0; 		// mat_ref holds the product of mat_a and mat_b
+
+// Counters of this process and the threads it starts, 1 if the kernel allows them.
+int open_counters(void) {
+#ifdef __linux__
+	unsigned long long configs[COUNTERS] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES };
+	int c;
+	for (c = 0; c < COUNTERS; ++c) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = configs[c];
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		perf_fds[c] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (perf_fds[c] < 0) {
+			while (c-- > 0)
+				close(perf_fds[c]);
+			perf_fds[0] = -1;
+			return 0;
+		}
+	}
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+void start_counters(void) {
+#ifdef __linux__
+	int c;
+	for (c = 0; c < COUNTERS && perf_fds[0] >= 0; ++c) {
+		ioctl(perf_fds[c], PERF_EVENT_IOC_RESET, 0);
+		ioctl(perf_fds[c], PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+
+void stop_counters(double counts[COUNTERS]) {
+	int c;
+	for (c = 0; c < COUNTERS; ++c) {
+		unsigned long long value;
+		counts[c] = -1;
+#ifdef __linux__
+		if (perf_fds[0] >= 0) {
+			ioctl(perf_fds[c], PERF_EVENT_IOC_DISABLE, 0);
+			if (read(perf_fds[c], &value, sizeof(value)) == sizeof(value))
+				counts[c] = (double) value;
+		}
+#endif
+	}
+}
+
+int compare_doubles(const void* x, const void* y) {
+	double a = *(const double*) x, b = *(const double*) y;
+	return a < b ? -1 : a > b;
+}
 
-	clock_t t0, t1;
-//	printf("Started matrix multiplication using version %d.\n", version);
-	// Take the time
-	t0 = clock();
+double median(double* values, int count) {
+	qsort(values, count, sizeof(double), compare_doubles);
+	return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+void reference_matrix(void) {
+	if (!reference_done) {
+		clear_matrix(&mat_ref);
+		elements[type].reference(mat_a, mat_b, mat_ref);
+		reference_done = 1;
+	}
+}
 
-	// Run the selected algorithm
-	f(mat1, mat2, mat_r);
+// Versions 1 to 5 only multiply int32 matrices, version5 needs AVX2, and version8 no 8 or 16 bit types.
+int runs_version(int version) {
+	if (version == 8)
+		return type == INT32 || type == FLOAT || type == DOUBLE;
+	return version >= 6 || (type == INT32 && (version < 5 || has_avx2()));
+}
 
-	// Take the time again
-	t1 = clock();
+const char* skipped_because(int version) {
+	return version == 8 ? "it doesn't multiply 8 and 16 bit types" :
+		type != INT32 ? "it only multiplies int32" : "the CPU has no AVX2";
+}
 
-//	printf("Finished in %lf seconds.\n", (double)(t1 - t0) / CLOCKS_PER_SEC);
-	clocks[version - 1] += ((double)(t1 - t0) / CLOCKS_PER_SEC);
+// Times f on mat_a and mat_b (see Timing).
+void measure(void f(struct matrix mat1, struct matrix mat2, struct matrix result), int version, struct stats* s) {
+	double* times = malloc(trials * sizeof(double));
+	double* counts = malloc((size_t) trials * COUNTERS * sizeof(double));
+	double trial[COUNTERS];
+	int t, c;
 
-	/* Check that mat_r is correct. For this the reference matrix mat_ref is computed
-	// using the basic() implementation, and then mat_r is compared to mat_ref. */
-	printf("Checking resulting matrix.\n");
-	version1(mat_a, mat_b, mat_ref);
-	if (!compare_matrices(mat_r, mat_ref))
+	for (t = 0; t < warmups; ++t) {
+		clear_matrix(&mat_r);
+		f(mat_a, mat_b, mat_r);
+	}
+	s->version = version;
+	s->mean = 0;
+	for (t = 0; t < trials; ++t) {
+		double t0, t1;
+		clear_matrix(&mat_r);
+		start_counters();
+		t0 = wall_time();
+		f(mat_a, mat_b, mat_r);
+		t1 = wall_time();
+		stop_counters(trial);
+		times[t] = t1 - t0;
+		s->mean += times[t] / trials;
+		for (c = 0; c < COUNTERS; ++c)
+			counts[c * trials + t] = trial[c];
+		if (t == 0) {
+			reference_matrix();
+			s->correct = compare_matrices(mat_r, mat_ref, mat_a.cols);
+		}
+	}
+	s->stddev = 0;
+	for (t = 0; t < trials; ++t)
+		s->stddev += (times[t] - s->mean) * (times[t] - s->mean) / trials;
+	s->stddev = sqrt(s->stddev);
+	s->median = median(times, trials);
+	s->min = times[0];
+	s->gops = 2.0 * mat_a.rows * mat_a.cols * mat_b.cols / s->median / 1e9;
+	for (c = 0; c < COUNTERS; ++c)
+		s->counts[c] = median(&counts[c * trials], trials);
+	free(times);
+	free(counts);
+}
+
+void runtest(void f(struct matrix mat1, struct matrix mat2, struct matrix result), int version, struct stats* s) {
+	// Check that mat_r is correct: it's compared to mat_ref, computed once using the basic()
+	// implementation of the element type.
+	measure(f, version, s);
+	printf("Checking resulting matrix of version %d.\n", version);
+	if (!s->correct)
 		printf("Error: mat_r does not match the reference matrix!\n");
 	else
 		printf("Correct!\n");
 }
 
-int main(void) {
+const char* gops_unit(void) {
+	return type == FLOAT || type == DOUBLE ? "GFLOP/s" : "GOP/s";
+}
+
+void print_stats(struct stats* s) {
+	printf("[%d] %lf seconds (min %lf, stddev %lf), %.2f %s", s->version, s->median, s->min, s->stddev, s->gops, gops_unit());
+	if (s->counts[0] > 0)
+		printf(", IPC %.2f, %.0f cache misses", s->counts[1] / s->counts[0], s->counts[2]);
+	printf("%s\n", s->correct ? "." : ", wrong result!");
+}
+
+// The results for regression tracking, one row (object) per version, -1 for counters that weren't read.
+void write_csv(const char* path, struct stats* s, int count) {
+	FILE* file = fopen(path, "w");
+	int i;
+	if (!file) {
+		printf("Can't write %s.\n", path);
+		return;
+	}
+	fprintf(file, "version,type,isa,m,k,n,threads,warmups,trials,median_s,min_s,mean_s,stddev_s,gops,cycles,instructions,cache_misses,correct\n");
+	for (i = 0; i < count; ++i)
+		fprintf(file, "%d,%s,%s,%d,%d,%d,%d,%d,%d,%.9f,%.9f,%.9f,%.9f,%.4f,%.0f,%.0f,%.0f,%d\n",
+			s[i].version, elements[type].name, isa->name, mat_a.rows, mat_a.cols, mat_b.cols, threads, warmups, trials,
+			s[i].median, s[i].min, s[i].mean, s[i].stddev, s[i].gops, s[i].counts[0], s[i].counts[1], s[i].counts[2], s[i].correct);
+	fclose(file);
+}
+
+void write_json(const char* path, struct stats* s, int count) {
+	FILE* file = fopen(path, "w");
+	int i;
+	if (!file) {
+		printf("Can't write %s.\n", path);
+		return;
+	}
+	fprintf(file, "[\n");
+	for (i = 0; i < count; ++i)
+		fprintf(file, "  {\"version\": %d, \"type\": \"%s\", \"isa\": \"%s\", \"m\": %d, \"k\": %d, \"n\": %d, \"threads\": %d, "
+			"\"warmups\": %d, \"trials\": %d, \"median_s\": %.9f, \"min_s\": %.9f, \"mean_s\": %.9f, \"stddev_s\": %.9f, "
+			"\"gops\": %.4f, \"cycles\": %.0f, \"instructions\": %.0f, \"cache_misses\": %.0f, \"correct\": %s}%s\n",
+			s[i].version, elements[type].name, isa->name, mat_a.rows, mat_a.cols, mat_b.cols, threads, warmups, trials,
+			s[i].median, s[i].min, s[i].mean, s[i].stddev, s[i].gops, s[i].counts[0], s[i].counts[1], s[i].counts[2],
+			s[i].correct ? "true" : "false", i + 1 < count ? "," : "");
+	fprintf(file, "]\n");
+	fclose(file);
+}
+
+// Speedup of version7 over its single thread run, for 1 to all threads.
+void scaling_test(void) {
+	int most = threads, t;
+	double base = 0;
+	struct stats s;
+
+	printf("Scaling of version7:\n");
+	for (t = 1; t <= most; ++t) {
+		threads = t;
+		measure(version7, 7, &s);
+		base = t == 1 ? s.median : base;
+		printf("%3d threads: %lf seconds, speedup %.2f, efficiency %.0f%%.\n",
+			t, s.median, base / s.median, 100 * base / s.median / t);
+	}
+	threads = most;
+}
+
+// Speed of the fast versions for square sizes from L1 resident up to largest (-sweep), to find the cache cliffs.
+void sweep_test(int largest) {
+	void (*kernels[3])(struct matrix mat1, struct matrix mat2, struct matrix result) = { version5, version6, version7 };
+	long l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE), l2 = sysconf(_SC_LEVEL2_CACHE_SIZE), l3 = sysconf(_SC_LEVEL3_CACHE_SIZE);
+	int n, v;
+
+	printf("Sweep of sizes (GOP/s, a multiply and an add are 2 operations, ! marks a wrong result), %s %s kernel:\n",
+		elements[type].name, isa->name);
+	printf("%6s %10s %5s %10s %10s %10s\n", "N", "KB", "fits", "version5", "version6", "version7");
+	for (n = 16; n <= largest; n = n * 5 / 4) {
+		// (1) the reference, as long as version1 is quick enough.
+		// (2) a checked run of each version, then runs until the time is long enough to measure.
+		size_t bytes;
+		alloc_matrices(n, n, n);
+		init_matrices();
+		bytes = (size_t) n * ((size_t) mat_a.ld * mat_a.size + (size_t) mat_b.ld * mat_b.size + (size_t) mat_r.ld * mat_r.size);
+		if (n <= 512)
+			elements[type].reference(mat_a, mat_b, mat_ref);
+		printf("%6d %10zu %5s", n, bytes / 1024, l1 > 0 && bytes <= (size_t) l1 ? "L1" :
+			l2 > 0 && bytes <= (size_t) l2 ? "L2" : l3 > 0 && bytes <= (size_t) l3 ? "L3" : "RAM");
+		for (v = 0; v < 3; ++v) {
+			int correct, runs = 0;
+			double t0, t1;
+			if (!runs_version(v + 5)) {
+				printf(" %9s ", "-");
+				continue;
+			}
+			clear_matrix(&mat_r);
+			kernels[v](mat_a, mat_b, mat_r);
+			correct = n > 512 || compare_matrices(mat_r, mat_ref, n);
+			t0 = wall_time();
+			do {
+				kernels[v](mat_a, mat_b, mat_r);
+				runs++;
+			} while ((t1 = wall_time()) - t0 < 0.1);
+			printf(" %9.2f%s", 2.0 * n * n * n * runs / (t1 - t0) / 1e9, correct ? " " : "!");
+		}
+		printf("\n");
+		free_matrices();
+	}
+}
+
+// Where Strassen-Winograd starts to pay (-strassen largest): one level of it against the best classical kernel.
+void crossover_test(int largest) {
+	int n, from = 0, given = crossover;
+	struct stats s;
+
+	printf("Strassen-Winograd, one level over the classical kernel, against the best classical kernel (%s, %s kernel):\n",
+		elements[type].name, isa->name);
+	printf("%6s %12s %12s %8s\n", "N", "classical", "version8", "speedup");
+	for (n = 128; n <= largest; n = n * 5 / 4) {
+		// (1) version6, and version7 with more than one thread. The best result is the reference of version8.
+		// (2) version8 split once: halves are below the crossover.
+		double best;
+		alloc_matrices(n, n, n);
+		init_matrices();
+		measure(version6, 6, &s);
+		best = s.median;
+		memcpy(mat_ref.cells, mat_r.cells, (size_t) n * mat_r.ld * mat_r.size);
+		reference_done = 1;
+		if (threads > 1) {
+			measure(version7, 7, &s);
+			best = s.median < best ? s.median : best;
+		}
+		crossover = n;
+		measure(version8, 8, &s);
+		crossover = given;
+		printf("%6d %11.6fs %11.6fs %8.2f%s\n", n, best, s.median, best / s.median, s.correct ? "" : " wrong result!");
+		from = s.median < best ? (from ? from : n) : 0;
+		reference_done = 0;
+		free_matrices();
+	}
+	if (from)
+		printf("Strassen-Winograd beats the classical kernels from N = %d on: -crossover %d.\n", from, from);
+	else
+		printf("Strassen-Winograd doesn't beat the classical kernels up to N = %d.\n", largest);
+}
+
+int main(int argc, char* argv[]) {
 #ifdef _MSC_VER
 	system("pause"); // Put this here to allow the program to load up without skewing results.
 #endif
-	// Clocks to calculate average speeds.
-	double clocks[5] = {0,0,0,0,0};
-	int iterations = 1, i;
-
-	// Run the algorithms
-	for (i = 0; i < iterations; ++i) {
-		runtest(version1, 1, clocks, mat_a, mat_b, mat_r);
-		runtest(version2, 2, clocks, mat_a, mat_b, mat_r);
-		runtest(version3, 3, clocks, mat_a, mat_b, mat_r);
-		runtest(version4, 4, clocks, mat_a, mat_b, mat_r);
-		runtest(version5, 5, clocks, mat_a, mat_b, mat_r);
-	}
-
-	printf("Testing complete, %d iterations.\n", iterations);
-	for (i = 0; i < 5; ++i)
-		printf("[%d] %lf seconds.\n", i+1, clocks[i] / iterations);
+	// Timings of the versions that ran.
+	struct stats results[8];
+	int ran = 0, i, v, perf = 0;
+	const char* csv = NULL;
+	const char* json = NULL;
+	void (*versions[8])(struct matrix mat1, struct matrix mat2, struct matrix result) =
+		{ version1, version2, version3, version4, version5, version6, version7, version8 };
+
+	int m = N, k = N, n = N, sweep = 0, strassen_test = 0;
+	const char* isa_name = NULL;
+	const char* type_name = elements[INT32].name;
+
+	// (1) sizes: -size N for square matrices, -size MxKxN otherwise.
+	// (2) threads of version7 (all cores unless -threads is given), and their first touch (-numa).
+	// (3) -sweep largest: the speed over a range of sizes instead.
+	// (4) -isa name: the kernel of version6 and version7, the widest the CPU runs by default.
+	// (5) -type name: the element type of the matrices.
+	// (6) timing (see measure): -trials T, -warmup W, -perf, and -csv file and -json file for the results.
+	// (7) -crossover N: the smallest size version8 splits, -strassen largest: find the best one instead.
+	threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	for (i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "-size") && i + 1 < argc) {
+			int given = sscanf(argv[++i], "%dx%dx%d", &m, &k, &n);
+			k = given == 1 ? m : given == 3 ? k : 0;
+			n = given == 1 ? m : n;
+		}
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-numa"))
+			first_touch = 1;
+		else if (!strcmp(argv[i], "-sweep") && i + 1 < argc)
+			sweep = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-isa") && i + 1 < argc)
+			isa_name = argv[++i];
+		else if (!strcmp(argv[i], "-type") && i + 1 < argc)
+			type_name = argv[++i];
+		else if (!strcmp(argv[i], "-trials") && i + 1 < argc)
+			trials = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-warmup") && i + 1 < argc)
+			warmups = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-perf"))
+			perf = 1;
+		else if (!strcmp(argv[i], "-csv") && i + 1 < argc)
+			csv = argv[++i];
+		else if (!strcmp(argv[i], "-json") && i + 1 < argc)
+			json = argv[++i];
+		else if (!strcmp(argv[i], "-crossover") && i + 1 < argc)
+			crossover = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-strassen") && i + 1 < argc)
+			strassen_test = atoi(argv[++i]);
+	}
+	trials = trials < 1 ? 1 : trials;
+	warmups = warmups < 0 ? 0 : warmups;
+	crossover = crossover < 2 ? 2 : crossover;
+	for (type = 0; type < TYPES && strcmp(type_name, elements[type].name); ++type)
+		;
+	if (type == TYPES) {
+		printf("Element types are:");
+		for (type = 0; type < TYPES; ++type)
+			printf(" %s", elements[type].name);
+		printf(".\n");
+		return 1;
+	}
+	threads = threads < 1 ? 1 : threads > MAX_THREADS ? MAX_THREADS : threads;
+	if (m < 1 || k < 1 || n < 1) {
+		printf("Sizes must be N or MxKxN, all positive.\n");
+		return 1;
+	}
+	if (!(isa = pick_isa(isa_name, type))) {
+		printf("This CPU can't run the %s kernel for %s. It runs:", isa_name, type_name);
+		for (i = 0; i < ISA_KERNELS; ++i)
+			if (isa_kernels[i].type == type && isa_kernels[i].supported())
+				printf(" %s", isa_kernels[i].name);
+		printf(".\n");
+		return 1;
+	}
+	if (sweep) {
+		sweep_test(sweep);
+		return 0;
+	}
+	if (strassen_test) {
+		if (!runs_version(8)) {
+			printf("version8 is skipped, %s.\n", skipped_because(8));
+			return 1;
+		}
+		crossover_test(strassen_test);
+		return 0;
+	}
+	alloc_matrices(m, k, n);
+	if (first_touch)
+		touch_matrices();
+	printf("Multiplying %d x %d by %d x %d %s matrices.\n", m, k, k, n, elements[type].name);
+	printf("Kernel of version6 and version7: %s (%d x %d tiles).\n", isa->name, MR, isa->nr);
+	if (perf && !open_counters())
+		printf("No perf counters (%s), timing only.\n", strerror(errno));
+
+	// Initialize the matrices, then run the algorithms
+	init_matrices();
+	for (v = 1; v <= 8; ++v)
+		if (runs_version(v))
+			runtest(versions[v - 1], v, &results[ran++]);
+
+	printf("Testing complete, median of %d trials after %d warmup runs.\n", trials, warmups);
+	for (i = 0, v = 1; v <= 8; ++v)
+		if (!runs_version(v))
+			printf("[%d] skipped, %s.\n", v, skipped_because(v));
+		else
+			print_stats(&results[i++]);
+	if (csv)
+		write_csv(csv, results, ran);
+	if (json)
+		write_json(json, results, ran);
+	scaling_test();
+	free_matrices();
 	
 	// If using Visual Studio, do not close the console window immediately
 #ifdef _MSC_VER
@@ -209,6 +1341,7 @@ int main(void) {
     2.256460  0.502110   version3
     1.919360  0.332810   version4
     0.420020  0.139220   version5
+    0.361687  0.080189   version6 (5 runs, another machine: version5 took 0.851567 s, 0.239115 s there)
     
     Discussion and conclusion:
     The closer you get to accessing all 3 matrices row first, the faster the algorithm ends up in the end.
@@ -217,4 +1350,14 @@ int main(void) {
     what you're trying to do, and reorganizes the algorithm to reduce cache miss.
     The reason why AVX is only slightly slower without optimization is likely because the algorithm is already
     organized in the best possible way. AVX is superior because it processes 8 calculations at a time in parallell.
+    Blocking (version6) is about 3 times faster than version5 again: the loads and stores of result are gone from
+    the inner loop, which leaves the vector multiplications themselves (vpmulld) as the limit.
+    That is also why the width of the vectors pays off one to one there: version6 took 0.055 s with -isa avx512,
+    0.083 s with avx2, 0.144 s with sse4.1 and 0.466 s with scalar (all on the other machine).
+    The other element types (-type, version6 with the widest kernel there): float 0.023 s and double 0.048 s, as
+    FMA is quicker than vpmulld, int16 0.017 s and int8 0.007 s with VNNI (0.022 s with -isa avx2, widened to int16).
+    Strassen-Winograd (version8) barely pays on the other machine: at N = 1000 one level took 0.050 s against 0.047 s
+    for version6, and -strassen 2600 found it faster only around N = 1850 (1.12 times). Its 15 additions of quadrants
+    stream through memory while version6 runs at 40 GOP/s from the caches, so the 1/8 of the products it saves
+    is eaten up by them until the matrices are a lot larger.
 */
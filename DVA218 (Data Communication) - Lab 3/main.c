@@ -6,231 +6,1047 @@
 
 #include "utp.h"
 #include <pthread.h>
-#include <unistd.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 #define VERBOSE			// Remove this to prevent debug output
 #define NIL		"___"		// Print when state is missing from i/o info
 #define BUFFER_SIZE 	1024 		// General buffer size for input/output
-#define THREAD_SLEEP 	20000		// How long should selective repeat sleep
 #define QUIT_MSG 	"QUIT\n" 	// What to check for in input stream to send FIN
+#define LINE_SIZE 	(BUFFER_SIZE + 64) 	// Output line (message and prefix)
+#define INPUT_LINES 	64 		// Lines queued from the reader thread per worker
+#define OUTPUT_LINES 	1024 		// Lines queued for the writer thread per worker
+#define BENCH_BULK 	1 		// Workloads of a benchmark client (-workload)
+#define BENCH_RR 	2
+#define BENCH_SINK 	1 		// Roles of a benchmark server (-bench)
+#define BENCH_ECHO 	2
+#define BENCH_BYTES 	(4 << 20) 	// Default size of a bulk transfer
+#define BENCH_COUNT 	1000 		// Default requests of a request/response run
+#define BENCH_SIZE 	64 		// Default size of a request
+#define BENCH_POINTS 	16 		// Values per swept option
+#define BENCH_DEADLINE 	60 		// Seconds a sweep point may take
 
+/*--------------------------------------------------
+ * Session (everything one peer needs)
+ *--------------------------------------------------
+ * The connection is the first member, so that a
+ * connection found in the server's table leads to
+ * its session. Timers are keyed by connection ID.
+ *--------------------------------------------------*/
+struct session {
+	struct utp_conn 	conn;		// Connection structure (first member).
+	struct utp_window 	buffer;		// Buffers for send, recv and ack bitmap.
+	struct utp_tracker 	status;		// Status tracker for frame sequences.
+	int32_t wsize, fsize, psize; 		// Size parameters: initial window, frame, payload
+	int32_t rwnd; 				// Receive window last advertised
+	int64_t recvEdge, sendEdge; 		// First seq beyond the advertised windows (own, peer's)
+	int32_t ackfreq, ackPending; 		// Frames per cumulative ACK, frames not yet acknowledged
+	int32_t fec; 				// Data frames per parity frame (0 = off)
+	struct utp_pack* 	parity;		// Parity of the group being sent
+	int64_t ackSince, ackEcho; 		// First unacknowledged arrival, timestamp to echo
+	int64_t requestArmed; 			// Deadline of the live request timer (0 if idle)
+	int64_t paceArmed; 			// Deadline of the live pacing timer (0 if idle)
+	int32_t inFlight; 			// Sent frames not yet acknowledged
+	int32_t frameCount; 			// Frames in the send window
+	int32_t retries; 			// SYN|ACK or FIN|ACK repeats (server)
+	int 	resent; 			// Timed out during this timer pass
+	int 	stalled; 			// Data waits for the window (counted once per stall)
+	int64_t sinkSince; 			// Arrival of the first frame of the message being reassembled
+	struct utp_stream 	source;		// Message being fragmented (a line or a file)
+	struct utp_stream 	sink;		// Message being reassembled (memory or a file)
+	char* 	input; 				// Lines waiting to be sent
+	int 	inHead, inPos; 			// First unsent line, fill of input
+	int64_t inSince; 			// Arrival of the oldest unsent line
+	int64_t coalesce; 			// Longest a small line waits for others (0 = off)
+	int64_t coalesceArmed; 			// Deadline of the live coalescing timer (0 if idle)
+	char* 	batch; 				// Lines packed for one CAT frame
+	int 	batched; 			// The source is the batch
+	char* 	echo; 				// Copy of the last message echoed (server -bench echo)
+	int64_t echoSize; 			// Allocated size of the echo copy
+	struct session* prev; 			// Open sessions (server)
+	struct session* next;
+};
+
+/*--------------------------------------------------
+ * Worker (one thread per socket)
+ *--------------------------------------------------
+ * When serving, every worker binds its own socket
+ * to the port (SO_REUSEPORT), the kernel hashes
+ * each peer to one of them. Workers share nothing
+ * with each other. stdin and stdout belong to a
+ * reader and a writer thread, connected to every
+ * worker by lock-free SPSC queues, so terminal
+ * i/o never stalls the protocol. A pipe doorbell
+ * wakes the other side when a queue goes from
+ * empty to non-empty.
+ *--------------------------------------------------*/
+struct worker {
+	pthread_t 		thread;
+	struct utp_context 	ctx;		// Own copy of the options (error injection state)
+	struct utp_server 	server;		// Peers hashed to this worker's socket
+	struct utp_queue 	input;		// Lines from the reader thread
+	struct utp_queue 	output;		// Lines for the writer thread
+	int 			bell[2];	// Rung when input was empty
+	int 			tdClean;	// Teardown of all its sessions was clean
+};
+
+int 	serving = 0; 			// Many peers on one socket (server -peers)
+int 	workerCount = 1; 		// Threads serving the port
+int 	outputBell[2]; 			// Rung when an output queue was empty
+int 	sendFile = -1; 			// File to send to the single peer (-send)
+int 	recvFile = -1; 			// File for the messages of the single peer (-recv)
+atomic_int writing = 1; 		// Writer thread condition
 
-int  	running = 1, tdClean = 0; 	// (1) Thread condition (2) Clean exit
-int32_t wsize, fsize, psize; 		// Size parameters: window, frame, payload
+/*--------------------------------------------------
+ * Benchmark (synthetic workloads)
+ *--------------------------------------------------
+ * A bulk client sends -bytes as one file and
+ * times it until the last frame is acknowledged.
+ * A request/response client sends -count requests
+ * of -size bytes one at a time, the server echoes
+ * each, and times every round trip. Only the
+ * single peer's worker touches it.
+ *--------------------------------------------------*/
+struct bench {
+	int 	workload; 			// BENCH_BULK or BENCH_RR (0 = no benchmark)
+	int 	answer; 			// BENCH_SINK or BENCH_ECHO (server)
+	int64_t bytes; 				// Size of the bulk transfer
+	int32_t count, size, done; 		// Requests to make, their size, answered so far
+	char* 	request; 			// Payload of every request
+	int64_t start, sent; 			// Start of the run, send time of the open request
+	int 	finished; 			// The last response is in
+	struct utp_histogram 	latency;	// Request to response (usec)
+};
 
-pthread_mutex_t 	fileAccess; 	// Mutex lock for socket writing/reading.
+struct utp_context 	context;	// Options of the process.
+struct bench 		bench;		// Workload of a benchmark run.
+struct worker* 		workers;	// Worker threads.
+struct session 		peer;		// The only session when not serving.
 
-struct utp_window 	buffer;		// Buffers for send, recv and acks.
-struct utp_tracker 	status;		// Status tracker for frame sequences.
-struct utp_conn 	conn;		// Connection structure.
-struct utp_pack* 	frame;		// Shared frame for sequential send/recv.
+// State of the current worker thread
+__thread int  	running = 1, tdClean = 0; 	// (1) Thread condition (2) Clean exit
+__thread int32_t sock; 				// Socket of all sessions of the worker
+__thread struct worker* 	self;		// Worker running this thread.
+__thread struct session* 	sessions;	// Open sessions when serving.
+__thread struct session* 	graveyard;	// Closed sessions, freed after each pass.
+__thread struct utp_pack* 	frame;		// Frame being handled, shared for sequential send/recv.
+__thread struct utp_pool 	pool;		// Frames of the windows and the receive batch.
+__thread int 			sessionCount;	// Sessions sharing the window budget.
+__thread struct utp_pack* 	inbox[UTP_BATCH_MAX];		// Receive batch (slots of one allocation).
+__thread struct utp_conn* 	inboxConn[UTP_BATCH_MAX];	// Connection of each received frame.
+__thread struct sockaddr_in 	inboxFrom[UTP_BATCH_MAX];	// Sender of each received frame.
+__thread struct utp_timers 	timers;		// Timers of every session, tagged with the connection ID.
+__thread struct utp_loop 	loop;		// Waits on socket, input and the timers.
 
 /*--------------------------------------------------
  * Helper functions
  *--------------------------------------------------*/
-int sequenceInSpan(int64_t seq, int64_t offset) {
+int sequenceInSpan(struct utp_ring* ring, int64_t seq, int64_t offset) {
 	// Determines if a frame sequence and related tracker offset
 	// are aligned, in order to weed out packages that have already
-	// arrived, packages that haven't been acknowledged, 
-	// and packages that are not part of the current set.
+	// arrived, packages that haven't been acknowledged,
+	// and packages that are not part of the current set (ring).
 	int64_t idx = (seq - offset);
-	return 	(idx >= 0) && (idx < wsize);
+	return 	(idx >= 0) && (idx <= ring->mask);
+}
+
+struct utp_pack* getFrame(struct utp_ring* ring, int64_t seq) {
+	// Returns the frame in the ring buffer slot of a sequence number (seq modulo capacity)
+	return ring->slots[seq & ring->mask];
+}
+
+int32_t ringCapacity(int32_t size) {
+	// Smallest power of two that holds a full window
+	int32_t capacity = 1;
+	while (capacity < size)
+		capacity <<= 1;
+	return capacity;
+}
+
+int isAcked(struct session* s, int64_t seq) {
+	// Checks the ack bitmap bit of a sequence number's ring slot
+	int64_t slot = seq & s->buffer.send.mask;
+	return (s->buffer.acks[slot >> 6] >> (slot & 63)) & 1;
+}
+
+void setAcked(struct session* s, int64_t seq, int acked) {
+	int64_t   slot = seq & s->buffer.send.mask;
+	uint64_t  bit  = (uint64_t) 1 << (slot & 63);
+	uint64_t* word = &(s->buffer.acks[slot >> 6]);
+	*word = acked ? (*word | bit) : (*word & ~bit);
+}
+
+/*--------------------------------------------------
+ * Window buffers (growing and shrinking)
+ *--------------------------------------------------
+ * Rings hold frames of the worker's pool, so a
+ * ring of another capacity only moves pointers:
+ * frames of the span starting at head keep their
+ * seq, new slots are filled from the pool, slots
+ * beyond a smaller ring are given back (the caller
+ * makes sure nothing is held there). The budget
+ * (-memory) is what the pool may hand out.
+ *--------------------------------------------------*/
+void resizeRing(struct utp_ring* ring, int64_t head, int32_t capacity) {
+	int32_t old  = ring->slots ? ring->mask + 1 : 0;
+	int32_t kept = old < capacity ? old : capacity;
+	struct utp_pack** slots = calloc(capacity, sizeof(struct utp_pack*));
+
+	for (int64_t seq = head; seq < head + kept; seq++)
+		slots[seq & (capacity - 1)] = ring->slots[seq & ring->mask];
+	for (int64_t seq = head + kept; seq < head + old; seq++)
+		UTP_POOL_GIVE(&pool, ring->slots[seq & ring->mask]);
+	for (int32_t i = 0; i < capacity; i++) {
+		if (!slots[i]) {
+			slots[i] = UTP_POOL_TAKE(&pool);
+			slots[i]->seq = -1;
+		}
+	}
+	free(ring->slots);
+	ring->slots = slots;
+	ring->mask 	= capacity - 1;
+}
+
+void releaseRing(struct utp_ring* ring) {
+	for (int32_t i = 0; ring->slots && i <= ring->mask; i++)
+		UTP_POOL_GIVE(&pool, ring->slots[i]);
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+int64_t spareBudget() {
+	// Frames the pool may still hand out, negative when over budget.
+	return self->ctx.memory / pool.stride - (pool.total - pool.spareCount);
+}
+
+void growSendWindow(struct session* s) {
+	// Doubles the send ring, the ack bits of the frames in flight move along.
+	int32_t   capacity = 2 * (s->buffer.send.mask + 1);
+	uint64_t* acks 	   = calloc((capacity + 63) / 64, sizeof(uint64_t));
+	for (int64_t seq = s->status.sendNext; seq < s->conn.seqSend; seq++) {
+		int64_t slot = seq & (capacity - 1);
+		if (isAcked(s, seq))
+			acks[slot >> 6] |= (uint64_t) 1 << (slot & 63);
+	}
+	resizeRing(&s->buffer.send, s->status.sendNext, capacity);
+	free(s->buffer.acks);
+	s->buffer.acks = acks;
+}
+
+int32_t receiveWindow(struct session* s) {
+	// (1) what the receive ring holds, plus a share of what is left of the budget.
+	// (2) never below the negotiated window, never above UTP_WINDOW_MAX.
+	int64_t window = s->buffer.recv.mask + 1 + spareBudget() / (sessionCount > 0 ? sessionCount : 1);
+	window = window < UTP_WINDOW_MAX ? window : UTP_WINDOW_MAX;
+	return window > s->wsize ? (int32_t) window : s->wsize;
+}
+
+int roomToSend(struct session* s) {
+	// (1) the peer's advertised window ends at sendEdge.
+	// (2) a full send ring doubles, as long as the budget allows.
+	if (s->conn.seqSend >= s->sendEdge)
+		return 0;
+	if (s->frameCount <= s->buffer.send.mask)
+		return 1;
+	if (s->buffer.send.mask + 1 >= UTP_WINDOW_MAX || spareBudget() <= s->buffer.send.mask)
+		return 0;
+	growSendWindow(s);
+	return 1;
+}
+
+struct session* findSession(uint32_t id) {
+	// Session of a connection ID, NULL once it has been closed.
+	if (serving)
+		return (struct session*) UTP_SERVER_FIND(&self->server, id);
+	return peer.conn.id == id ? &peer : NULL;
+}
+
+struct session* firstSession() {
+	// Head of the sessions to iterate, the single peer has no next.
+	return serving ? sessions : &peer;
+}
+
+int optionValue(char* param, int fallback, int argc, char* argv[]) {
+	// Numeric option, read before the UTP interface parses the command line.
+	for (int i = 2; i + 1 < argc; i++)
+		if (!strcmp(argv[i], param))
+			return atoi(argv[i + 1]);
+	return fallback;
 }
 
-struct utp_pack* getFrame(int64_t index, struct utp_pack* buffer) {
-	// Returns a frame pointer in a buffer given an index offset
-	return buffer + (index * fsize);
+char* optionString(char* param, int argc, char* argv[]) {
+	for (int i = 2; i + 1 < argc; i++)
+		if (!strcmp(argv[i], param))
+			return argv[i + 1];
+	return NULL;
 }
 
-pthread_t createThreadForFunction(void* function) {
+pthread_t createThreadForFunction(void* function, void* args) {
 	// Create a new thread for a given function and return the handler.
 	pthread_t thread;
-	pthread_create(&thread, NULL, function, NULL);
+	pthread_create(&thread, NULL, function, args);
 	return thread;
 }
 
 int readInputWithQuit(char* stream, int* offset) {
-	// (1) read a line from stdin and store in buffer.
+	// (1) read a line from stdin and store in buffer (-1 at end of file).
 	// (2) check for quit message.
 	// (3) increase cursor offset.
 	// (4) remove trailing newline.
-	fgets(stream + *offset, BUFFER_SIZE - *offset, stdin);
+	if (!fgets(stream + *offset, BUFFER_SIZE - *offset, stdin))
+		return -1;
 	int quitRequest = !strcmp(stream + *offset, QUIT_MSG);
 	*offset += strlen(stream + *offset) - 1;
 	memset(stream + *offset, 0, 1);
 	return quitRequest;
 }
 
-void _p(char* in, char* out, int64_t offs, int64_t seq, int64_t time, char* msg) {
+void openBell(int bell[2], int wait) {
+	// Doorbell pipe, never blocks the ringing side (nor a worker that drains it).
+	if (pipe(bell) < 0)
+		bell[0] = bell[1] = -1;
+	fcntl(bell[1], F_SETFL, O_NONBLOCK);
+	if (!wait)
+		fcntl(bell[0], F_SETFL, O_NONBLOCK);
+}
+
+void ring(int bell) {
+	char tone = 1;
+	if (write(bell, &tone, 1) < 0) {}	// A full pipe is rung already.
+}
+
+void quiet(int bell) {
+	char tones[64];
+	while (read(bell, tones, sizeof(tones)) > 0) {}
+}
+
+void emit(const char* format, ...) {
+	// Queues a line for the writer thread, prints it right away only if the queue is full.
+	char 	text[LINE_SIZE];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	length = length < (int) sizeof(text) ? length : (int) sizeof(text) - 1;
+
+	int32_t queued = UTP_QUEUE_PUSH(&self->output, text, length);
+	if (queued < 0)
+		fwrite(text, 1, length, stdout);
+	else if (queued == 0)
+		ring(outputBell[1]);
+}
+
+void _p(char* in, char* out, int64_t offs, int64_t seq, int64_t time, char* msg, int16_t size) {
 // Prints <INPUT | OUTPUT> and message information
 #ifdef VERBOSE //////////////////
-	printf("<%s | %s> ", in, out);
-	printf("%+04hhd ",((int8_t) offs));
-	printf(" %05hhu ",((uint8_t) time));
-	printf(" %05hhu ",((uint8_t) seq));
-	printf("%s\n", 		msg);
+	emit("<%s | %s> %+04hhd  %05hhu  %05hhu %.*s\n", in, out,
+		((int8_t) offs), ((uint8_t) time), ((uint8_t) seq), size, msg);
 #endif //////////////////////////
 }
 
-void debug(uint8_t input, uint8_t output) {
+void debug(struct session* s, uint8_t input, uint8_t output) {
 // Wrapper for message printing to keep this file more readable.
 #ifdef VERBOSE //////////////////
 	int64_t seq = frame->seq;
 	int64_t tim = frame->time;
 	char* 	msg = frame->msg;
+	int16_t len = frame->size;
 	switch(input) {
-		case NAK: _p(UTP_FLAG(frame,REQ)?"REQ":"NAK", "MSG", seq - status.sendNext, seq, tim, msg); return;
-		case ACK: _p("ACK", NIL, seq - status.sendNext, seq, tim, ""); return;
-		case FIN: _p("FIN", "ACK", 0, seq, tim, ""); return;
-		case MSG: _p(UTP_FLAG(frame,END)?"END":"MSG", "ACK", seq-status.recvNext, seq, tim, msg); return;
+		case NAK: _p(UTP_FLAG(frame,REQ)?"REQ":"NAK", "MSG", seq - s->status.sendNext, seq, tim, msg, 0); return;
+		case ACK: _p("ACK", NIL, seq - s->status.sendNext, seq, tim, "", 0); return;
+		case FIN: _p("FIN", "ACK", 0, seq, tim, "", 0); return;
+		case FEC: _p("FEC", NIL, seq - s->status.recvNext, seq, tim, "", 0); return;
+		case MSG: _p(UTP_FLAG(frame,CAT)?"CAT":UTP_FLAG(frame,END)?"END":"MSG", "ACK", seq-s->status.recvNext, seq, tim,
+			UTP_FLAG(frame,CAT)?"":msg, len); return;
 	}
 	switch(output) {
-		case NAK: _p(NIL, "NAK", seq - status.recvNext, seq, tim, ""); return;
-		case MSG: _p(NIL, UTP_FLAG(frame,END)?"END":"MSG", seq-status.sendNext, seq, tim, msg); return;
+		case NAK: _p(NIL, "NAK", seq - s->status.recvNext, seq, tim, "", 0); return;
+		case MSG: _p(NIL, UTP_FLAG(frame,END)?"END":"MSG", seq-s->status.sendNext, seq, tim, msg, len); return;
 	}
 #endif //////////////////////////
 }
 
+void reportStats(struct session* s) {
+	// Statistics of a session, the same counters are readable through UTP_STATS_READ.
+	struct utp_stats stats;
+	char text[LINE_SIZE];
+	UTP_STATS_READ(&s->conn, &stats);
+	UTP_STATS_FORMAT(&stats, text, sizeof(text));
+	if (serving)
+		emit("Peer %08x statistics:\n%s", s->conn.id, text);
+	else
+		emit("Statistics:\n%s", text);
+}
+
+/*--------------------------------------------------
+ * Sessions (setup and teardown)
+ *--------------------------------------------------
+ * startSession:
+ *	Sizes and allocates the windows of a session
+ *	from the terms its connection agreed on.
+ * acceptSession:
+ * 	Opens a session for the SYN of a new peer.
+ * dropSession:
+ * 	Forgets a peer. The memory is released after
+ * 	the current pass, since frames of the same
+ * 	batch may still refer to the session.
+ *--------------------------------------------------*/
+void startSession(struct session* s) {
+	// Set up size parameters.
+	s->wsize = UTP_GET_WINDOW_SIZE(&s->conn);
+	s->fsize = UTP_GET_FRAME_SIZE(&s->conn);
+	s->psize = UTP_GET_PAYLOAD_SIZE(&s->conn);
+	s->ackfreq = UTP_GET_ACK_FREQUENCY(&s->conn);
+	s->rwnd  = s->wsize;
+	s->fec 	 = UTP_GET_FEC(&s->conn);
+	s->coalesce = self->ctx.coalesce;
+	sessionCount++;
+	if (self->ctx.stats)
+		UTP_TIMER_ADD(&timers, UTP_TIME() + self->ctx.stats, UTP_TIMER_STATS, s->conn.id, 0, 0);
+
+	// Initialize window ring buffers (frames of the worker's pool) and i/o streams
+	resizeRing(&s->buffer.recv, 0, ringCapacity(s->wsize));
+	resizeRing(&s->buffer.send, 0, ringCapacity(s->wsize));
+	s->buffer.acks = calloc((s->buffer.send.mask + 64) / 64, sizeof(uint64_t));
+	s->input  = calloc(BUFFER_SIZE, sizeof(char));
+	s->batch  = s->coalesce ? malloc(s->psize) : NULL;
+	UTP_STREAM_INIT(&s->source, -1);
+	UTP_STREAM_INIT(&s->sink, -1);
+	if (s->fec) {
+		s->parity = UTP_POOL_TAKE(&pool);
+		UTP_FEC_START(s->parity, s->conn.seqSend);
+	}
+
+	// Initialize status tracker, both windows start out at the negotiated size.
+	s->status.sendLast = 0;
+	s->status.recvLast = 0;
+	s->status.sendNext = s->conn.seqSend;
+	s->status.recvNext = s->conn.seqRecv + 1;
+	s->sendEdge = s->status.sendNext + s->wsize;
+	s->recvEdge = s->status.recvNext + s->wsize;
+}
+
+void freeSession(struct session* s) {
+	if (self->ctx.stats)
+		reportStats(s);
+	releaseRing(&s->buffer.recv);
+	releaseRing(&s->buffer.send);
+	free(s->buffer.acks);
+	if (s->parity)
+		UTP_POOL_GIVE(&pool, s->parity);
+	s->parity = NULL;
+	sessionCount--;
+	free(s->input);
+	free(s->batch);
+	free(s->echo);
+	UTP_STREAM_FREE(&s->sink);
+	if (s != &peer)
+		free(s);
+}
+
+void armHandshake(struct session* s, uint8_t kind) {
+	// Repeat timer of the SYN|ACK or FIN|ACK of a server session.
+	UTP_TIMER_ADD(&timers, UTP_TIME() + UTP_GET_RTO(&s->conn), kind, s->conn.id, 0, 0);
+}
+
+struct session* acceptSession(struct utp_pack* syn, struct sockaddr_in* from) {
+	struct session* s = calloc(1, sizeof(struct session));
+	if (!UTP_SERVER_ACCEPT(&self->server, &s->conn, syn, from)) {
+		free(s);
+		return NULL;
+	}
+	startSession(s);
+	armHandshake(s, UTP_TIMER_HANDSHAKE);
+
+	s->next = sessions;
+	if (sessions)
+		sessions->prev = s;
+	sessions = s;
+	emit("Peer %08x connecting from %s.\n", s->conn.id, inet_ntoa(from->sin_addr));
+	return s;
+}
+
+void dropSession(struct session* s) {
+	// Closed, later frames of the batch are ignored.
+	s->conn.state = 0;
+	UTP_SERVER_DROP(&self->server, &s->conn);
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		sessions = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+
+	s->next = graveyard;
+	graveyard = s;
+}
+
+void buryClosed() {
+	while (graveyard) {
+		struct session* s = graveyard;
+		graveyard = s->next;
+		freeSession(s);
+	}
+}
+
+void closeSession(struct session* s) {
+	// The peer sent a FIN, answer with FIN|ACK until its final ACK arrives.
+	UTP_PACK_PROPERTIES(frame, 0, s->conn.seqSend, FIN | ACK);
+	UTP_SEND(&s->conn, frame);
+	if (s->conn.state != UTP_STATE_FIN) {
+		s->conn.state = UTP_STATE_FIN;
+		s->retries = 0;
+		armHandshake(s, UTP_TIMER_CLOSE);
+	}
+}
+
+void repeatHandshake(struct session* s, uint8_t kind) {
+	// (1) stop once the handshake or teardown is over.
+	// (2) give up on peers that went silent.
+	// (3) otherwise repeat the SYN|ACK or FIN|ACK.
+	int state = kind == UTP_TIMER_HANDSHAKE ? UTP_STATE_SYN : UTP_STATE_FIN;
+	if (s->conn.state != state)
+		return;
+	if (++s->retries > UTP_TEARDOWN_MAX) {
+		emit("Peer %08x timed out.\n", s->conn.id);
+		dropSession(s);
+		return;
+	}
+	if (state == UTP_STATE_SYN)
+		UTP_SERVER_REPEAT(&s->conn, frame);
+	else {
+		UTP_PACK_PROPERTIES(frame, 0, s->conn.seqSend, FIN | ACK);
+		UTP_SEND(&s->conn, frame);
+	}
+	armHandshake(s, kind);
+}
+
 /*--------------------------------------------------
- *	Automatic repeat request (threads)
+ *	Automatic repeat request (timers)
  *--------------------------------------------------
+ * Serviced from the event loop, which sleeps until
+ * the earliest deadline (or blocks when idle).
  * resend: 	resends a frame that has timed out
- * request: 	requests a frame that never arrived
+ * request: 	requests frames that never arrived
+ * fastResend:	resends frames a SEL ACK shows lost,
+ *		without waiting for their timeout
  *--------------------------------------------------*/
-void* resend(void* args) {
-	while(running) {
-		pthread_mutex_lock(&fileAccess);
-
-		// Are there missing ACKs for sent frames?
-		if (sequenceInSpan(status.sendLast, status.sendNext)) {
-
-			int64_t lastIndex = status.sendLast - status.sendNext;
-			int64_t sendSeq, acksSeq, sendTime;
-			struct utp_pack* resPack;
-			
-			for(int64_t i = 0; i <= lastIndex; i++) {
-				acksSeq  = getFrame(i, buffer.acks)->seq;
-				resPack  = getFrame(i, buffer.send);
-				sendSeq  = resPack->seq;
-				sendTime = resPack->time;
-
-				// If the sequence number on sent frame and received ack doesn't line up,
-				// and the timeout for the frame has expired -> resend the frame
-				if (sendSeq != acksSeq && UTP_TIMEOUT_EXPIRED(sendTime)) {
-					_p(NIL,"RES", sendSeq-status.sendNext, sendSeq, sendTime, resPack->msg);
-					UTP_FLAG_ADD(resPack, RES);
-					UTP_SEND(&conn, resPack);
-				}
-			}
+void armResend(struct session* s, struct utp_pack* sent) {
+	// Tagged with the send time, a later transmission arms its own timer.
+	UTP_TIMER_ADD(&timers, sent->time + UTP_GET_RTO(&s->conn), UTP_TIMER_RESEND, s->conn.id, sent->seq, sent->time);
+}
+
+void armRequest(struct session* s, int64_t deadline) {
+	s->requestArmed = deadline;
+	UTP_TIMER_ADD(&timers, deadline, UTP_TIMER_REQUEST, s->conn.id, 0, deadline);
+}
+
+int resend(struct session* s, struct utp_timer* timer) {
+	int64_t seq = timer->key;
+	struct utp_pack* resPack = getFrame(&s->buffer.send, seq);
+
+	// Drop timers of acknowledged frames and of older transmissions.
+	if (!sequenceInSpan(&s->buffer.send, seq, s->status.sendNext) || seq > s->status.sendLast || isAcked(s, seq) ||
+		resPack->seq != seq || resPack->time != timer->stamp)
+		return 0;
+
+	// The RTO grew since the timer was armed, wait for the new deadline.
+	if (!UTP_RTO_EXPIRED(&s->conn, resPack->time)) {
+		armResend(s, resPack);
+		return 0;
+	}
+	_p(NIL,"RES", seq-s->status.sendNext, seq, resPack->time, resPack->msg, resPack->size);
+	UTP_FLAG_ADD(resPack, RES);
+	UTP_SEND(&s->conn, resPack);
+	armResend(s, resPack);
+	return 1;
+}
+
+
+void request(struct session* s, struct utp_timer* timer) {
+	// Drop timers that were replaced, stop when there are no missing frames.
+	if (timer->stamp != s->requestArmed)
+		return;
+	s->requestArmed = 0;
+	if (!sequenceInSpan(&s->buffer.recv, s->status.recvLast, s->status.recvNext))
+		return;
+
+	// Use last received frame as baseline as to WHEN requests should be sent.
+	// If the last frame has timed out, it's a good time to start checking the
+	// receive buffer for missing frames that need to be requested from sender.
+	int64_t lastTime = getFrame(&s->buffer.recv, s->status.recvLast)->time;
+	if (!UTP_RTO_EXPIRED(&s->conn, lastTime)) {
+		armRequest(s, lastTime + UTP_GET_RTO(&s->conn));
+		return;
+	}
+
+	for(int64_t seq = s->status.recvNext; seq <= s->status.recvLast; seq++) {
+
+		// If the slot of the expected sequence number holds another
+		// sequence number (older lap or never received), the frame is missing.
+		if (getFrame(&s->buffer.recv, seq)->seq != seq) {
+			UTP_PACK_PROPERTIES(frame, 0, seq, NAK | REQ);
+			debug(s, -1, NAK);
+			UTP_SEND(&s->conn, frame);
 		}
-		pthread_mutex_unlock(&fileAccess);
-		usleep(THREAD_SLEEP);
 	}
+	armRequest(s, UTP_TIME() + UTP_GET_RTO(&s->conn));
 }
 
+void fastResend(struct session* s, int64_t newest) {
+	// (1) only a gap at the window head (the receiver acknowledges gaps at once).
+	// (2) a frame is lost once UTP_DUPTHRESH frames beyond it are acknowledged.
+	// (3) only transmissions older than the newest frame acknowledged, a frame
+	//     resent since waits for an ACK of something sent after it (or its timer).
+	if (newest <= s->status.sendNext || isAcked(s, s->status.sendNext))
+		return;
+	int64_t after  = getFrame(&s->buffer.send, newest)->time;
+	int32_t beyond = 0;
 
-void* request(void* args) {
-	while(running) {
-		pthread_mutex_lock(&fileAccess);
-
-		// Are there missing frames?
-		if (sequenceInSpan(status.recvLast, status.recvNext)) {
-			int64_t lastIndex = status.recvLast - status.recvNext;
-
-			// Use last received frame as baseline as to WHEN requests should be sent.
-			// If the last frame has timed out, it's a good time to start checking the
-			// receive buffer for missing frames that need to be requested from sender.
-			if (UTP_TIMEOUT_EXPIRED(getFrame(lastIndex, buffer.recv)->time)) {
-				int64_t recvSeq;
-
-				for(int64_t i = 0; i <= lastIndex; i++) {
-					recvSeq = getFrame(i, buffer.recv)->seq;
-
-					// If the received sequence number and the expected sequence number
-					// does not form the correct buffer index, the frame is missing.
-					if (recvSeq - status.recvNext != i) {
-						UTP_PACK_PROPERTIES(frame, 0, status.recvNext + i, NAK | REQ);
-						debug(-1, NAK);
-						UTP_SEND(&conn, frame);
-					}
-				}
-			}
+	for (int64_t seq = s->status.sendLast; seq >= s->status.sendNext; seq--) {
+		struct utp_pack* resPack = getFrame(&s->buffer.send, seq);
+		if (isAcked(s, seq)) {
+			beyond++;
+			continue;
 		}
-		pthread_mutex_unlock(&fileAccess);
-		usleep(THREAD_SLEEP);
+		if (beyond < UTP_DUPTHRESH || resPack->seq != seq || resPack->time >= after)
+			continue;
+		_p(NIL,"RES", seq-s->status.sendNext, seq, resPack->time, resPack->msg, resPack->size);
+		UTP_FLAG_ADD(resPack, RES);
+		UTP_SEND(&s->conn, resPack);
+		armResend(s, resPack);
+		UTP_CC_LOSS(&s->conn, seq, 0);
 	}
 }
 
 /*--------------------------------------------------
  * Sliding window (utility functions)
+ *--------------------------------------------------
+ * Window buffers are ring buffers indexed by seq
+ * modulo capacity, the tracker offsets are the head
+ * of each window. Sliding only advances the offset,
+ * a slot is valid when it holds the seq it maps to.
  *--------------------------------------------------*/
-// Shift a frame buffer by one frame ([0] << [1] << [2] etc)
-void slide(void* dest) {
-	memmove(dest, dest + fsize, (wsize - 1) * fsize);
+// Inserts the received frame into a ring at the slot of its sequence number
+void insert(struct session* s, struct utp_ring* ring, int64_t seq) {
+	// (1) swap the received frame into its ring slot, the payload stays where it was received.
+	// (2) the slot's old frame becomes the frame being handled, with the header
+	//     (not the payload) of the received one, and returns to the receive batch.
+	struct utp_pack** slot 	= &ring->slots[seq & ring->mask];
+	struct utp_pack*  spare = *slot;
+	*slot = frame;
+	memcpy(spare, frame, sizeof(struct utp_pack));
+	frame = spare;
 }
 
-// Inserts a frame into a buffer at a calculated index
-void insert(void* dest, int64_t seq, int64_t offset) {
-	int position = (seq - offset) * fsize;
-	memcpy(dest + position, frame, fsize);
+// Rebuilds the one frame missing from the group of a received parity (frame)
+int recoverFrame(struct session* s) {
+	// (1) frames before the window head count while their slot still holds them.
+	// (2) more than one frame missing is left to the retransmissions.
+	// (3) add all others to the parity, what remains is the missing frame.
+	int64_t start = frame->seq, lost = -1;
+	int32_t span  = UTP_FEC_SPAN(frame);
+	if (span <= 0 || start + span <= s->status.recvNext || start + span > s->recvEdge)
+		return 0;
+	for (int64_t seq = start; seq < start + span; seq++) {
+		if (getFrame(&s->buffer.recv, seq)->seq == seq)
+			continue;
+		if (seq < s->status.recvNext || lost >= 0)
+			return 0;
+		lost = seq;
+	}
+	if (lost < 0)
+		return 0;
+	for (int64_t seq = start; seq < start + span; seq++)
+		if (seq != lost)
+			UTP_FEC_ADD(frame, getFrame(&s->buffer.recv, seq));
+
+	struct utp_pack* rebuilt = UTP_POOL_TAKE(&pool);
+	if (!UTP_FEC_REBUILD(frame, rebuilt, lost)) {
+		UTP_POOL_GIVE(&pool, rebuilt);
+		return 0;
+	}
+	// (4) the rebuilt frame takes the slot, the frame it replaces returns to the pool.
+	if (!sequenceInSpan(&s->buffer.recv, lost, s->status.recvNext))
+		resizeRing(&s->buffer.recv, s->status.recvNext, ringCapacity(lost - s->status.recvNext + 1));
+	struct utp_pack** slot = &s->buffer.recv.slots[lost & s->buffer.recv.mask];
+	UTP_POOL_GIVE(&pool, *slot);
+	*slot = rebuilt;
+	UTP_STAT_ADD(&s->conn.stats.rebuilt, 1);
+	if (lost > s->status.recvLast)
+		s->status.recvLast = lost;
+	return 1;
 }
 
 /*--------------------------------------------------
  * Sliding window (send)
  *--------------------------------------------------
- * sendFrames: 
+ * sendFrames:
  *	Splits input stream into frames and transmits
- * 	the message sequentially on socket.
+ * 	the message as one burst on socket, as far as
+ * 	the window, congestion window and pacer allow.
  * slideWindow:
  * 	Slides the sending window forward when the
  * 	first frame on the link has been acknowledged.
  *--------------------------------------------------*/
-void sendFrames(char* input, int* inPos, int* frameCount) {
-	// assert window isn't overflown and that input stream has data
-	while(*frameCount < wsize && *inPos > 0) {
-		// populate frame with message from input stream
-		UTP_PACK_MESSAGE(frame, input, conn.seqSend++, MSG);
-
-		// check if input stream overflows payload
-		if (*inPos > psize) {
-			// (1) move input stream to exclude the MSG that frame was populated with.
-			// (2) prepare the last payload chunk to read from input stream.
-			// (3) reduce the position counter by one payload chunk.
-			memmove(input, input + psize, BUFFER_SIZE - psize);
-			memset(input + *inPos - psize, 0, psize);
-			*inPos -= psize;
+void flushFrames(struct session* s, struct utp_pack** burst, int count) {
+	// (1) send the burst with as few system calls as possible.
+	// (2) arm a retransmit timer per frame, stamped when it was encoded.
+	//     Parity frames are never resent.
+	UTP_SEND_BATCH(&s->conn, burst, count);
+	for (int i = 0; i < count; i++) {
+		struct utp_pack* sent = burst[i];
+		if (UTP_TYPE(sent->flags) == FEC) {
+			_p(NIL, "FEC", sent->seq-s->status.sendNext, sent->seq, sent->time, "", 0);
+			continue;
+		}
+		armResend(s, sent);
+		_p(NIL, UTP_FLAG(sent,CAT)?"CAT":UTP_FLAG(sent,END)?"END":"MSG", sent->seq-s->status.sendNext, sent->seq, sent->time,
+			UTP_FLAG(sent,CAT)?"":sent->msg, sent->size);
+	}
+}
+
+int coalesceLines(struct session* s) {
+	// (1) count the lines that fit in one frame, each behind its length.
+	// (2) a frame with room left waits for more, until the oldest line is due.
+	//     Teardown and a filling input buffer don't wait.
+	// (3) the lines become one CAT message.
+	int32_t limit = UTP_GET_DATA_SIZE(&s->conn);
+	int32_t used  = 0;
+	int 	head  = s->inHead;
+	while (head < s->inPos) {
+		int length = strlen(s->input + head);
+		if (used + UTP_RECORD_HEADER + length > limit)
+			break;
+		used += UTP_RECORD_HEADER + length;
+		head += length + 1;
+	}
+
+	int64_t due = s->inSince + s->coalesce;
+	int 	full = head < s->inPos || s->inPos >= BUFFER_SIZE / 2;
+	if (!full && running && UTP_TIME() < due) {
+		if (s->coalesceArmed != due) {
+			s->coalesceArmed = due;
+			UTP_TIMER_ADD(&timers, due, UTP_TIMER_COALESCE, s->conn.id, 0, due);
+		}
+		return 0;
+	}
+
+	for (used = 0; s->inHead < head; ) {
+		int length = strlen(s->input + s->inHead);
+		used = UTP_PACK_RECORD(s->batch, used, s->input + s->inHead, length);
+		s->inHead += length + 1;
+	}
+	UTP_WRITE(&s->source, s->batch, used);
+	s->batched = 1;
+	return 1;
+}
+
+int nextMessage(struct session* s) {
+	// (1) a message still being fragmented goes on.
+	// (2) the next queued line becomes the message (not while a file is sent),
+	//     or shares a frame with the lines after it when coalescing.
+	// (3) all lines are out, the input buffer is reused.
+	if (UTP_STREAM_PENDING(&s->source))
+		return 1;
+	if (s->inHead < s->inPos && sendFile < 0) {
+		int length = strlen(s->input + s->inHead);
+		if (s->coalesce && UTP_RECORD_HEADER + length <= UTP_GET_DATA_SIZE(&s->conn))
+			return coalesceLines(s);
+		UTP_WRITE(&s->source, s->input + s->inHead, length);
+		s->inHead += length + 1;
+		return 1;
+	}
+	s->inHead = s->inPos = 0;
+	return 0;
+}
+
+int protectFrame(struct session* s, struct utp_pack* sent) {
+	// (1) fold the frame into the parity of its group.
+	// (2) a full group, or the end of a message, closes the group (returns 1).
+	// (3) a message of a single frame isn't worth a parity, start over.
+	UTP_FEC_ADD(s->parity, sent);
+	int32_t span = UTP_FEC_SPAN(s->parity);
+	if (span >= s->fec || (UTP_FLAG(sent, END) && span > 1))
+		return 1;
+	if (UTP_FLAG(sent, END))
+		UTP_FEC_START(s->parity, s->conn.seqSend);
+	return 0;
+}
+
+void sendFrames(struct session* s) {
+	struct utp_pack* burst[UTP_BATCH_MAX + 1];
+	int count = 0;
+
+	// Data waits for the handshake and stops at teardown.
+	if (s->conn.state != UTP_STATE_OPEN)
+		return;
+
+	// assert window isn't overflown and that there's a message to send
+	while(s->inFlight < UTP_CC_WINDOW(&s->conn) && roomToSend(s) && nextMessage(s)) {
+		// wait for the pacer to release the next frame
+		int64_t paceAt = UTP_CC_PACE(&s->conn, UTP_TIME());
+		if (paceAt) {
+			if (!s->paceArmed) {
+				s->paceArmed = paceAt;
+				UTP_TIMER_ADD(&timers, paceAt, UTP_TIMER_PACE, s->conn.id, 0, paceAt);
+			}
+			break;
+		}
+
+		// populate the send buffer slot with the next payload of the message
+		struct utp_pack* slot = getFrame(&s->buffer.send, s->conn.seqSend);
+		UTP_PACK_STREAM(&s->conn, slot, &s->source, s->conn.seqSend++, s->batched ? MSG | CAT : MSG);
+		s->batched = 0;
+
+		// (1) queue the prepared frame, the slot is kept for potential resends.
+		// (2) update the status tracker with the last frame sequence number.
+		// (3) increment the frame counter/decrease sliding window potential.
+		burst[count++] = slot;
+		s->status.sendLast = slot->seq;
+		s->frameCount += 1;
+		s->inFlight++;
+
+		// a closed group is followed by its parity, which goes out with the burst.
+		if (s->fec && protectFrame(s, slot)) {
+			burst[count++] = s->parity;
+			flushFrames(s, burst, count);
+			UTP_FEC_START(s->parity, s->conn.seqSend);
+			count = 0;
 		}
-		// entire input buffer fits in payload, reset the input buffer.
-		else {
-			memset(input, 0, BUFFER_SIZE);
-			*inPos = 0;
+		if (count == UTP_BATCH_MAX) {
+			flushFrames(s, burst, count);
+			count = 0;
 		}
+	}
+	if (count)
+		flushFrames(s, burst, count);
 
-		// (1) send the prepared frame.
-		// (2) copy the frame into the send buffer for potential resends.
-		// (3) update the status tracker with the last frame sequence number.
-		// (4) increment the frame counter/decrease sliding window potential.
-		UTP_SEND(&conn, frame);
-		insert(buffer.send, frame->seq, status.sendNext);
-		status.sendLast = frame->seq;
-		*frameCount += 1;
-		debug(-1, MSG);
+	// Count stalls: data waits, the congestion or advertised window is full.
+	int waiting = UTP_STREAM_PENDING(&s->source) || (s->inHead < s->inPos && sendFile < 0);
+	int full 	= s->inFlight >= UTP_CC_WINDOW(&s->conn) || s->conn.seqSend >= s->sendEdge ||
+				  s->frameCount > s->buffer.send.mask;
+	if (waiting && full && !s->stalled)
+		UTP_STAT_ADD(&s->conn.stats.stalls, 1);
+	s->stalled = waiting && full;
+}
+
+/*--------------------------------------------------
+ * Path MTU (send)
+ *--------------------------------------------------
+ * probePath:
+ * 	Sends the next probe of the search, a probe
+ * 	too large for the local interface fails at
+ * 	once. Frames packed from now on use the
+ * 	payload the path has confirmed.
+ *--------------------------------------------------*/
+void reportPayload(struct session* s) {
+	if (serving)
+		emit("Peer %08x payload size: %d bytes.\n", s->conn.id, s->conn.pmtu.size);
+	else
+		emit("Payload size: %d bytes.\n", s->conn.pmtu.size);
+}
+
+void probePath(struct session* s) {
+	int64_t now 	= UTP_TIME();
+	int32_t size 	= s->conn.state == UTP_STATE_OPEN ? UTP_PMTU_PROBE(&s->conn, now) : 0;
+	if (!size)
+		return;
+
+	UTP_PACK_PROBE(frame, size, s->conn.seqSend);
+	if (UTP_SEND(&s->conn, frame) < 0 && errno == EMSGSIZE) {
+		UTP_PMTU_LOST(&s->conn, now, 1);
+		return;
 	}
+	UTP_TIMER_ADD(&timers, now + UTP_GET_RTO(&s->conn), UTP_TIMER_PROBE, s->conn.id, size, now);
 }
 
-void slideWindow(int* frameCount) {
-	// while 1st ack lines up with send offset !(result is zero)
-	while (!(buffer.acks->seq - status.sendNext)) {
-		// (1) shift frame buffers by one frame
-		// (2) increment send offset
+void slideWindow(struct session* s) {
+	// while 1st frame on the link is acknowledged
+	while (isAcked(s, s->status.sendNext)) {
+		// (1) clear the ack bit for the next lap of the ring
+		// (2) increment send offset (head of the ring)
 		// (3) decrement the frame counter/increase sliding window potential.
-		slide(buffer.send);
-		slide(buffer.acks);
-		status.sendNext++;
-		*frameCount -= 1;
+		setAcked(s, s->status.sendNext, 0);
+		s->status.sendNext++;
+		s->frameCount -= 1;
 	}
 }
 
+/*--------------------------------------------------
+ * Selective acknowledgement
+ *--------------------------------------------------
+ * packSelectiveAck:
+ *	Prepares a SEL ACK: frame->seq is the next
+ *	expected sequence (everything before it is
+ *	acknowledged), the payload is the advertised
+ *	window followed by a bitmap of frames received
+ *	beyond it, bit i = seq + 1 + i. The right edge
+ *	(seq + window) never moves back, an idle ring
+ *	shrinks back to what the edge still needs.
+ * markSelectiveAck:
+ * 	Applies a received ACK or SEL ACK to the
+ * 	bitmap of acknowledged sent frames.
+ * acknowledge:
+ * 	Delayed ACK mode (ackfreq > 1): one ACK per
+ * 	ackfreq frames, or once the ACK delay expires.
+ * 	Gaps, duplicates and END frames are always
+ * 	acknowledged immediately.
+ *--------------------------------------------------*/
+void packSelectiveAck(struct session* s, int64_t echo) {
+	int64_t span  = s->status.recvLast - s->status.recvNext;
+	int32_t room  = (s->psize > UTP_HANDSHAKE_SIZE ? s->psize : UTP_HANDSHAKE_SIZE) - UTP_ACK_WINDOW;
+	int32_t bytes = span > 0 ? (span + 7) / 8 : 0;
+	char* 	bitmap = frame->msg + UTP_ACK_WINDOW;
+	bytes = bytes > room ? room : bytes;
+
+	s->rwnd = receiveWindow(s);
+	if (s->status.recvNext + s->rwnd > s->recvEdge)
+		s->recvEdge = s->status.recvNext + s->rwnd;
+	int32_t need = ringCapacity(s->recvEdge - s->status.recvNext);
+	if (span < 0 && s->buffer.recv.mask + 1 > need)
+		resizeRing(&s->buffer.recv, s->status.recvNext, need);
+
+	UTP_PACK_ACK(frame, ACK | SEL);
+	frame->seq  = s->status.recvNext;
+	frame->size = UTP_ACK_WINDOW + bytes;
+	frame->echo = echo;
+	UTP_PACK_WINDOW(frame, (int32_t) (s->recvEdge - s->status.recvNext));
+	memset(bitmap, 0, bytes);
+
+	for (int64_t i = 0; i < bytes * 8; i++) {
+		int64_t seq = s->status.recvNext + 1 + i;
+		if (seq <= s->status.recvLast && getFrame(&s->buffer.recv, seq)->seq == seq)
+			bitmap[i >> 3] |= 1 << (i & 7);
+	}
+}
+
+int64_t ackFrame(struct session* s, int64_t seq, int64_t newest) {
+	// Marks a sent frame as acknowledged, returns the newest seq acknowledged by this ACK.
+	if (isAcked(s, seq))
+		return newest;
+	setAcked(s, seq, 1);
+	s->inFlight--;
+	return seq > newest ? seq : newest;
+}
+
+int64_t markSelectiveAck(struct session* s) {
+	int64_t newest = -1;
+
+	// Plain ACK, acknowledges a single frame.
+	if (!UTP_FLAG(frame, SEL)) {
+		if (sequenceInSpan(&s->buffer.send, frame->seq, s->status.sendNext) && frame->seq <= s->status.sendLast)
+			newest = ackFrame(s, frame->seq, newest);
+		return newest;
+	}
+	// (1) cumulative part, everything before frame->seq.
+	// (2) selective part, frames flagged in the bitmap (after the advertised window).
+	for (int64_t seq = s->status.sendNext; seq < frame->seq && seq <= s->status.sendLast; seq++)
+		newest = ackFrame(s, seq, newest);
+
+	char* bitmap = frame->msg + UTP_ACK_WINDOW;
+	for (int64_t i = 0; i < (frame->size - UTP_ACK_WINDOW) * 8; i++) {
+		int64_t seq = frame->seq + 1 + i;
+		if ((bitmap[i >> 3] >> (i & 7)) & 1 && sequenceInSpan(&s->buffer.send, seq, s->status.sendNext) && seq <= s->status.sendLast)
+			newest = ackFrame(s, seq, newest);
+	}
+	return newest;
+}
+
+void sampleRoundTrip(struct session* s, int64_t newest) {
+	// (1) a timestamp echo measures the transmission that was acknowledged.
+	// (2) otherwise use the send time, unless the frame was resent (Karn's rule).
+	if (newest < 0)
+		return;
+	struct utp_pack* sent = getFrame(&s->buffer.send, newest);
+	if (frame->echo)
+		UTP_RTT_SAMPLE(&s->conn, frame->time - frame->echo);
+	else if (!UTP_FLAG(sent, RES))
+		UTP_RTT_SAMPLE(&s->conn, frame->time - sent->time);
+}
+
+void sendSelectiveAck(struct session* s) {
+	packSelectiveAck(s, s->ackEcho);
+	UTP_SEND(&s->conn, frame);
+	s->ackPending = 0;
+}
+
+void acknowledge(struct session* s, int immediate) {
+	// (1) remember the received frame for a coalesced ACK.
+	// (2) send the ACK now if required or the batch is full.
+	// (3) otherwise make sure the batch goes out within the ACK delay.
+	int first = !s->ackPending;
+	if (first)
+		s->ackSince = UTP_TIME();
+	s->ackEcho = frame->echo;
+	s->ackPending++;
+
+	if (immediate || s->ackPending >= s->ackfreq)
+		sendSelectiveAck(s);
+	else if (first)
+		UTP_TIMER_ADD(&timers, s->ackSince + UTP_GET_ACK_DELAY(&s->conn), UTP_TIMER_ACK, s->conn.id, 0, s->ackSince);
+}
+
+/*--------------------------------------------------
+ * Benchmark (measuring a session)
+ *--------------------------------------------------
+ * startBench:
+ * 	Starts the workload once the peer is connected.
+ * echoMessage:
+ * 	Sends a complete message back (server). A
+ * 	request that arrives before the last echo is
+ * 	fragmented is not answered, the client never
+ * 	has two open.
+ * reportBench:
+ * 	Prints the result line the sweep parses.
+ *--------------------------------------------------*/
+void sendRequest(struct session* s) {
+	bench.sent = UTP_TIME();
+	UTP_WRITE(&s->source, bench.request, bench.size);
+	sendFrames(s);
+}
+
+void startBench(struct session* s) {
+	bench.start = UTP_TIME();
+	if (bench.workload == BENCH_RR)
+		sendRequest(s);
+}
+
+void echoMessage(struct session* s) {
+	if (UTP_STREAM_PENDING(&s->source))
+		return;
+	if (s->sink.offset > s->echoSize) {
+		s->echoSize = s->sink.offset;
+		s->echo = realloc(s->echo, s->echoSize);
+	}
+	memcpy(s->echo, s->sink.data, s->sink.offset);
+	UTP_WRITE(&s->source, s->echo, s->sink.offset);
+}
+
+void receiveResponse(struct session* s) {
+	// A complete message is the response of the open request.
+	UTP_HIST_RECORD(&bench.latency, UTP_TIME() - bench.sent);
+	if (++bench.done < bench.count)
+		sendRequest(s);
+	else
+		bench.finished = 1;
+}
+
+void reportBench(struct session* s) {
+	// Bulk latency is the RTT of its frames, request/response the time to each answer.
+	struct utp_stats stats;
+	UTP_STATS_READ(&s->conn, &stats);
+	struct utp_histogram* latency = bench.workload == BENCH_BULK ? &stats.rtt : &bench.latency;
+	int64_t bytes = bench.workload == BENCH_BULK ? bench.bytes : 2 * (int64_t) bench.size * bench.done;
+	double 	seconds = (UTP_TIME() - bench.start) / 1e6;
+	emit("Bench: %s %ld bytes in %.3f s, goodput %.2f Mbit/s, latency p50/p99/p999 %ld/%ld/%ld usec, retransmits %.2f%%.\n",
+		bench.workload == BENCH_BULK ? "bulk" : "rr", bytes, seconds, seconds > 0 ? bytes * 8 / seconds / 1e6 : 0,
+		UTP_HIST_PERCENTILE(latency, 50), UTP_HIST_PERCENTILE(latency, 99), UTP_HIST_PERCENTILE(latency, 99.9),
+		stats.framesSent ? 100.0 * stats.resent / stats.framesSent : 0);
+}
+
 /*--------------------------------------------------
  * Sliding window (receive)
  *--------------------------------------------------
@@ -238,127 +1054,705 @@ void slideWindow(int* frameCount) {
  * window forward when received sequence number and
  * expected sequence number are aligned.
  *--------------------------------------------------*/
-void processReceived(char* output, int* offset) {
-	// while 1st recv lines up with offset !(result is zero)
-	while (!(buffer.recv->seq - status.recvNext)) {
-		int16_t msgSize = buffer.recv->size;
-		char* 	msg 	= buffer.recv->msg;
-
-		// copy frame payload into output buffer
-		memcpy(output + *offset, msg, msgSize);
-		*offset += msgSize;
-
-		// end of message is flagged in this frame, print buffer and reset.
-		if (UTP_FLAG(buffer.recv, END)) {
-			printf("> %s\n", output);
-			memset(output, 0, BUFFER_SIZE);
-			*offset = 0;
-		}
+int deliverMessage(struct session* s, int complete) {
+	// The sink holds a complete message (1), print it and reset.
+	if (complete > 0)
+		UTP_HIST_RECORD(&s->conn.stats.delivery, UTP_TIME() - s->sinkSince);
+	if (complete < 0)
+		emit("Message of %08x lost: %s.\n", s->conn.id, strerror(errno));
+	if (complete > 0 && (s->sink.fd >= 0 || bench.answer == BENCH_SINK))
+		emit("Received %ld bytes.\n", s->sink.offset);
+	else if (complete > 0 && bench.answer == BENCH_ECHO)
+		echoMessage(s);
+	else if (complete > 0 && bench.workload == BENCH_RR)
+		receiveResponse(s);
+	else if (complete > 0 && serving)
+		emit("> [%08x] %.*s\n", s->conn.id, (int) s->sink.offset, s->sink.data);
+	else if (complete > 0)
+		emit("> %.*s\n", (int) s->sink.offset, s->sink.data);
+	if (complete)
+		s->sink.offset = 0;
+	return complete;
+}
+
+void processReceived(struct session* s) {
+	// while 1st recv lines up with offset
+	struct utp_pack* recvPack;
+	while ((recvPack = getFrame(&s->buffer.recv, s->status.recvNext))->seq == s->status.recvNext) {
+		// (1) append the frame payload to the message (or write it to the file).
+		// (2) end of message is flagged in this frame, deliver it.
+		// (3) a CAT frame holds whole messages, each is delivered on its own.
+		int32_t offset = 0;
+		if (!s->sink.offset)
+			s->sinkSince = recvPack->time;
+		if (UTP_FLAG(recvPack, CAT))
+			while (deliverMessage(s, UTP_READ_RECORD(&s->sink, recvPack, &offset)) > 0);
+		else
+			deliverMessage(s, UTP_READ(&s->sink, recvPack));
 
 		// slide the receiving window forward, increase offset.
-		slide(buffer.recv);
-		status.recvNext++;
+		s->status.recvNext++;
+	}
+}
+
+// Dispatches expired ARQ, delayed ACK, pacing and handshake timers
+void serviceTimers() {
+	struct utp_timer timer;
+
+	while (UTP_TIMER_POP(&timers, UTP_TIME(), &timer)) {
+		struct session* s = findSession(timer.id);
+		if (!s)
+			continue;
+		switch (timer.kind) {
+			case UTP_TIMER_RESEND:	s->resent |= resend(s, &timer); break;
+			case UTP_TIMER_REQUEST:	request(s, &timer); break;
+			case UTP_TIMER_ACK:
+				// Delayed ACK, unless the batch was acknowledged already.
+				if (s->ackPending && s->ackSince == timer.stamp)
+					sendSelectiveAck(s);
+				break;
+			case UTP_TIMER_PACE:
+				// The event loop sends the released frames.
+				s->paceArmed = 0;
+				break;
+			case UTP_TIMER_COALESCE:
+				// The event loop sends the lines that are due.
+				if (s->coalesceArmed == timer.stamp)
+					s->coalesceArmed = 0;
+				break;
+			case UTP_TIMER_HANDSHAKE:
+			case UTP_TIMER_CLOSE:
+				repeatHandshake(s, timer.kind);
+				break;
+			case UTP_TIMER_PROBE:
+				UTP_PMTU_LOST(&s->conn, timer.stamp, 0);
+				break;
+			case UTP_TIMER_STATS:
+				reportStats(s);
+				UTP_TIMER_ADD(&timers, timer.deadline + self->ctx.stats, UTP_TIMER_STATS, s->conn.id, 0, 0);
+				break;
+		}
+	}
+	// Back off exponentially and collapse cwnd, once per timeout event.
+	// Timeouts in a row may also mean the path stopped carrying large frames.
+	for (struct session* s = firstSession(); s; s = s->next) {
+		if (s->resent) {
+			s->resent = 0;
+			UTP_RTO_BACKOFF(&s->conn);
+			UTP_CC_LOSS(&s->conn, 0, 1);
+			if (UTP_PMTU_TIMEOUT(&s->conn))
+				reportPayload(s);
+		}
 	}
 }
 
 /*--------------------------------------------------
- * Event handler (main thread)
+ * Event handler (frames of a session)
  *--------------------------------------------------
- * Handles messaging with peer, reads data from
- * socket and stdin, and writes frames to socket.
+ * receiveFrames:
+ * 	Drains the socket. When serving, frames of new
+ * 	peers come with a NULL connection.
+ * handleFrame:
+ * 	Handles one verified frame of a session.
  *--------------------------------------------------*/
-void* eventHandler(void* args) {
-	char* 	input = calloc(BUFFER_SIZE, sizeof(char));
-	char* 	output = calloc(BUFFER_SIZE, sizeof(char));
-	int 	inPos = 0, outPos = 0;
+int receiveFrames() {
+	if (serving)
+		return UTP_SERVER_RECV(&self->server, inbox, inboxConn, inboxFrom, UTP_BATCH_MAX);
 
-	fd_set 	files;
-	int 	frameCount = 0;
+	int received = UTP_RECV_BATCH(&peer.conn, inbox, UTP_BATCH_MAX);
+	for (int i = 0; i < received; i++)
+		inboxConn[i] = &peer.conn;
+	return received;
+}
 
-	while(running) {
-		FD_ZERO(&files);
-		FD_SET(conn.sock, &files);
-		FD_SET(fileno(stdin), &files);
-
-		// Wait for message on socket(n) or stdin(0).
-		// select(n, ...) uses i < n so need to increment span by 1 to catch socket.
-		select(conn.sock + 1, &files, NULL, NULL, NULL);
-		pthread_mutex_lock(&fileAccess);
-
-		// A frame was successfully received on the socket.
-		if(UTP_RECV(&conn, frame, 0)) {
-			switch(UTP_TYPE(frame->flags)) {
-				
-				case NAK:
-					debug(NAK, MSG);
-					UTP_SEND(&conn, getFrame(frame->seq - status.sendNext, buffer.send));
-					break;
-
-
-				case MSG:
-					debug(MSG, ACK);
-					if (sequenceInSpan(frame->seq, status.recvNext)) {
-						insert(buffer.recv, frame->seq, status.recvNext);
-
-						if (frame->seq > status.recvLast)
-							status.recvLast = frame->seq;
-
-						processReceived(output, &outPos);
-					}
-					// respond with ACK regardless of whether this frame is expected.
-					UTP_PACK_PROPERTIES(frame, 0, frame->seq, ACK);
-					UTP_SEND(&conn, frame);
-					break;
-
-
-				case ACK:
-					debug(ACK, -1);
-					if (sequenceInSpan(frame->seq, status.sendNext)) {
-						insert(buffer.acks, frame->seq, status.sendNext);
-						slideWindow(&frameCount);
-					}
-					sendFrames(input, &inPos, &frameCount);
-					break;
-
-
-				case FIN:
-					debug(FIN, ACK);
-					running = 0;
-					tdClean = UTP_CLOSE_RECV(&conn, frame);
-					break;
+void handleFrame(struct session* s) {
+	// (1) the session was dropped earlier in this batch.
+	// (2) a server session in teardown only waits for the final ACK.
+	if (!s->conn.state)
+		return;
+	if (s->conn.state == UTP_STATE_FIN) {
+		if (UTP_FLAG_EXACT(frame, ACK)) {
+			emit("Peer %08x disconnected.\n", s->conn.id);
+			dropSession(s);
+		}
+		else if (UTP_FLAG_EXACT(frame, FIN))
+			closeSession(s);
+		return;
+	}
+
+	switch(UTP_TYPE(frame->flags)) {
+
+		case NAK:
+			debug(s, NAK, MSG);
+			if (sequenceInSpan(&s->buffer.send, frame->seq, s->status.sendNext) &&
+				getFrame(&s->buffer.send, frame->seq)->seq == frame->seq && !isAcked(s, frame->seq)) {
+				struct utp_pack* resPack = getFrame(&s->buffer.send, frame->seq);
+				UTP_FLAG_ADD(resPack, RES);
+				UTP_SEND(&s->conn, resPack);
+				armResend(s, resPack);
+				UTP_CC_LOSS(&s->conn, frame->seq, 0);
+			}
+			break;
+
+
+		case MSG: {
+			debug(s, MSG, ACK);
+			int expected = frame->seq >= s->status.recvNext && frame->seq < s->recvEdge;
+			int final    = UTP_FLAG(frame, END);
+			if (expected) {
+				// the peer uses the window it was given, grow the ring to hold it.
+				if (!sequenceInSpan(&s->buffer.recv, frame->seq, s->status.recvNext))
+					resizeRing(&s->buffer.recv, s->status.recvNext, ringCapacity(frame->seq - s->status.recvNext + 1));
+				insert(s, &s->buffer.recv, frame->seq);
+
+				if (frame->seq > s->status.recvLast)
+					s->status.recvLast = frame->seq;
+
+				processReceived(s);
+			}
+			// respond with a selective ACK of the whole receive window,
+			// regardless of whether this frame is expected. Duplicates,
+			// gaps (frames held beyond recvNext) and END frames can't wait.
+			int gap = s->status.recvLast >= s->status.recvNext;
+			acknowledge(s, !expected || final || gap);
+
+			// frames are missing, make sure they get requested.
+			if (gap && !s->requestArmed)
+				armRequest(s, UTP_TIME() + UTP_GET_RTO(&s->conn));
+			break;
+		}
 
 
+		case ACK: {
+			debug(s, ACK, -1);
+			int32_t acked  = s->inFlight;
+			int32_t window = UTP_PARSE_WINDOW(frame);
+			if (window > 0) {
+				s->conn.rwnd = window < UTP_WINDOW_MAX ? window : UTP_WINDOW_MAX;
+				if (frame->seq + s->conn.rwnd > s->sendEdge)
+					s->sendEdge = frame->seq + s->conn.rwnd;
 			}
+			int64_t newest = markSelectiveAck(s);
+			sampleRoundTrip(s, newest);
+			UTP_CC_ACK(&s->conn, acked - s->inFlight);
+			fastResend(s, newest);
+			if (acked > s->inFlight)
+				UTP_PMTU_ACK(&s->conn);
+			slideWindow(s);
+			break;
 		}
 
-		// There's a line of text available on stdin.
-		else if (FD_ISSET(fileno(stdin), &files)) {
-			if(readInputWithQuit(input, &inPos)) {
-				running = 0;
-				tdClean = UTP_CLOSE_SEND(&conn, frame);
+
+		case FEC:
+			// Parity of a group, rebuild a lost frame without waiting for its resend.
+			debug(s, FEC, -1);
+			if (recoverFrame(s)) {
+				processReceived(s);
+				acknowledge(s, 1);
+			}
+			break;
+
+
+		case PRB:
+			// Path MTU probe of the peer, or the answer to one of ours.
+			if (UTP_FLAG(frame, REQ)) {
+				UTP_PACK_PROBE_ANSWER(frame);
+				UTP_SEND(&s->conn, frame);
 			}
-			else {
-				sendFrames(input, &inPos, &frameCount);
+			else if (UTP_PMTU_CONFIRM(&s->conn, UTP_PARSE_PROBE(frame)))
+				reportPayload(s);
+			break;
+
+
+		case FIN:
+			debug(s, FIN, ACK);
+			if (serving) {
+				emit("Peer %08x disconnecting.\n", s->conn.id);
+				closeSession(s);
+				break;
 			}
+			running = 0;
+			tdClean = UTP_CLOSE_RECV(&s->conn, frame);
+			break;
+
+
+		default:
+			// A repeated SYN|ACK, the final ACK of the handshake got lost.
+			UTP_OPEN_REPEAT(&s->conn, frame);
+			break;
+	}
+}
+
+/*--------------------------------------------------
+ * Event handler (stdin)
+ *--------------------------------------------------
+ * The reader thread queues each line (with its
+ * terminator) for every worker, QUIT is queued as
+ * an empty entry. A line goes to the peer, or to
+ * every open session when serving. QUIT tears
+ * down all of them.
+ *--------------------------------------------------*/
+void* inputReader(void* args) {
+	char 	line[BUFFER_SIZE];
+	int 	quitRequest = 0;
+
+	while (!quitRequest) {
+		int length = 0;
+		memset(line, 0, BUFFER_SIZE);
+		if ((quitRequest = readInputWithQuit(line, &length)) < 0)
+			break;
+
+		// Wait for room rather than lose a line, only this thread is held up.
+		for (int i = 0; i < workerCount; i++) {
+			int32_t queued;
+			while ((queued = UTP_QUEUE_PUSH(&workers[i].input, line, quitRequest ? 0 : length + 1)) < 0)
+				usleep(1000);
+			if (queued == 0)
+				ring(workers[i].bell[1]);
 		}
-		pthread_mutex_unlock(&fileAccess);
 	}
+	return NULL;
+}
 
-	free(input);
-	free(output);
+void readInput(char* line, int length) {
+	if (length < 0) {
+		running = 0;
+		tdClean = 1;
+		for (struct session* s = firstSession(); s; s = s->next)
+			if (s->conn.state == UTP_STATE_OPEN) {
+				sendFrames(s);		// Lines held for coalescing go out first.
+				tdClean &= UTP_CLOSE_SEND(&s->conn, frame);
+			}
+		return;
+	}
+	for (struct session* s = firstSession(); s; s = s->next) {
+		if (s->conn.state != UTP_STATE_OPEN || !length || s->inPos + length >= BUFFER_SIZE)
+			continue;
+		if (s->inHead >= s->inPos)
+			s->inSince = UTP_TIME();
+		memcpy(s->input + s->inPos, line, length + 1);
+		s->inPos += length + 1;
+		sendFrames(s);
+	}
+}
+
+void sentFile(struct session* s) {
+	// The peer has all of the file once nothing is pending or in the window.
+	if (sendFile < 0 || UTP_STREAM_PENDING(&s->source) || s->frameCount)
+		return;
+	emit("Sent %ld bytes.\n", s->source.length);
+	if (bench.workload)
+		reportBench(s);
+	close(sendFile);
+	sendFile = -1;
+	readInput(NULL, -1);
+}
+
+void answeredAll(struct session* s) {
+	// The request/response run closes once its last answer is in.
+	if (!bench.finished)
+		return;
+	bench.finished = 0;
+	reportBench(s);
+	readInput(NULL, -1);
+}
+
+/*--------------------------------------------------
+ * Event handler (stdout)
+ *--------------------------------------------------
+ * The writer thread drains the output queues of
+ * all workers until the last worker is done.
+ *--------------------------------------------------*/
+void* outputWriter(void* args) {
+	char 	line[LINE_SIZE];
+	char 	tones[64];
+	int32_t size;
+
+	while (1) {
+		int done = !atomic_load(&writing);
+		for (int i = 0; i < workerCount; i++)
+			while ((size = UTP_QUEUE_POP(&workers[i].output, line)) >= 0)
+				fwrite(line, 1, size, stdout);
+		fflush(stdout);
+		if (done || read(outputBell[0], tones, sizeof(tones)) <= 0)
+			break;
+	}
+	return NULL;
+}
+
+/*--------------------------------------------------
+ * Event handler (worker thread)
+ *--------------------------------------------------
+ * Handles messaging with peers, reads data from
+ * socket and input, and writes frames to socket.
+ *--------------------------------------------------*/
+void* eventHandler(void* args) {
+	char* 	line = calloc(BUFFER_SIZE, sizeof(char));
+	self = args;
+
+	// Allocate the receive batch, the first slot doubles as the shared frame.
+	// When serving, frames must hold a SYN as well as the largest payload offered.
+	// Windows share the pool of the batch, the single peer gets all its frames at once.
+	struct utp_terms* terms = &self->server.terms;
+	int32_t payload = terms->psize > UTP_HANDSHAKE_SIZE ? terms->psize : UTP_HANDSHAKE_SIZE;
+	int32_t fsize 	= serving ? (int32_t) sizeof(struct utp_pack) + payload : UTP_GET_FRAME_SIZE(&peer.conn);
+	int32_t chunk 	= serving ? UTP_BATCH_MAX : UTP_BATCH_MAX + 2 * ringCapacity(UTP_GET_WINDOW_SIZE(&peer.conn));
+	UTP_POOL_INIT(&pool, fsize, chunk);
+	for (int i = 0; i < UTP_BATCH_MAX; i++)
+		inbox[i] = UTP_POOL_TAKE(&pool);
+	frame = inbox[0];
+
+	// Initialize timers (sessions arm theirs when they start) and the event loop
+	sock = serving ? self->server.sock : peer.conn.sock;
+	UTP_TIMERS_INIT(&timers, serving ? UTP_BATCH_MAX : 2 * ringCapacity(UTP_GET_WINDOW_SIZE(&peer.conn)));
+
+	// The single peer is connected already, sessions of a server open on SYN.
+	// From now on it uses the options of its worker (impairment state included).
+	if (!serving) {
+		peer.conn.ctx = &self->ctx;
+		startSession(&peer);
+		if (recvFile >= 0)
+			peer.sink.fd = recvFile;
+	}
+	UTP_LOOP_INIT(&loop, self->ctx.loop);
+	UTP_LOOP_WATCH(&loop, sock);
+	UTP_LOOP_WATCH(&loop, self->bell[0]);
+	if (self == workers)
+		emit("Event loop: %s.\n", UTP_GET_LOOP_NAME(loop.backend));
+
+	// A file goes out right away, nothing else would wake the loop.
+	if (!serving && sendFile >= 0 && UTP_WRITE_FILE(&peer.source, sendFile)) {
+		emit("Sending %ld bytes.\n", peer.source.length);
+		if (bench.workload)
+			startBench(&peer);
+		sendFrames(&peer);
+	}
+	else if (!serving && bench.workload == BENCH_RR)
+		startBench(&peer);
+
+	int64_t heldArmed = 0;
+	while(running) {
+		// Release what the impairment model held back, wake up for the next one.
+		int64_t held = UTP_IMPAIR_FLUSH(&self->ctx);
+		if (held && held != heldArmed)
+			UTP_TIMER_ADD(&timers, held, UTP_TIMER_IMPAIR, 0, 0, held);
+		heldArmed = held;
+
+		// Wait for message on socket or stdin, wake up early when the next timer is due.
+		UTP_LOOP_WAIT(&loop, &timers);
+
+		// Drain every datagram queued on the socket, handle the verified frames.
+		int received = UTP_LOOP_READY(&loop, sock) ? receiveFrames() : 0;
+		for (int i = 0; i < received && running; i++) {
+			frame = inbox[i];
+			if (inboxConn[i])
+				handleFrame((struct session*) inboxConn[i]);
+			else
+				acceptSession(frame, &inboxFrom[i]);
+			inbox[i] = frame;	// A frame swapped into a window leaves its spare.
+		}
+
+		// There are lines of text from stdin.
+		if (!received && running && UTP_LOOP_READY(&loop, self->bell[0])) {
+			int32_t size;
+			quiet(self->bell[0]);
+			while (running && (size = UTP_QUEUE_POP(&self->input, line)) >= 0)
+				readInput(line, size - 1);
+		}
+
+		// Retransmit, request, delayed ACK, pacing and handshake timers that are due,
+		// then fill whatever room the window and congestion window have left,
+		// after the whole batch of ACKs has been counted.
+		if (running)
+			serviceTimers();
+		for (struct session* s = firstSession(); s && running; s = s->next) {
+			sendFrames(s);
+			probePath(s);
+		}
+		if (!serving && running)
+			sentFile(&peer);
+		if (!serving && running)
+			answeredAll(&peer);
+		buryClosed();
+	}
+
+	// Forget the peers, the teardown is over.
+	if (serving) {
+		while (sessions)
+			dropSession(sessions);
+		buryClosed();
+		UTP_SERVER_CLOSE(&self->server);
+	}
+	else
+		freeSession(&peer);
+	UTP_TIMERS_FREE(&timers);
+	UTP_IMPAIR_FREE(&self->ctx);
+	UTP_LOOP_FREE(&loop);
+	UTP_POOL_FREE(&pool);
+	free(line);
+
+	self->tdClean = tdClean;
+	return NULL;
+}
+
+void openWorker(struct worker* w, int index) {
+	// Own copy of the options, queues and doorbell to the i/o threads.
+	w->ctx = context;
+	w->ctx.seed ^= (uint64_t) index * 0x9E3779B97F4A7C15ULL;
+	UTP_QUEUE_INIT(&w->input, INPUT_LINES, BUFFER_SIZE);
+	UTP_QUEUE_INIT(&w->output, OUTPUT_LINES, LINE_SIZE);
+	openBell(w->bell, 0);
+}
+
+int openWorkers(int argc, char* argv[]) {
+	// Every worker gets its own socket.
+	workerCount = context.workers;
+	workers = calloc(workerCount, sizeof(struct worker));
+	for (int i = 0; i < workerCount; i++) {
+		openWorker(&workers[i], i);
+		if (UTP_SERVER_OPEN(&workers[i].server, &workers[i].ctx, argc, argv))
+			return 1;
+	}
+	printf("Serving up to %d peers on port %d", workers->server.peers * workerCount, ntohs(workers->server.local.sin_port));
+	printf(workerCount > 1 ? ", %d workers.\n" : ".\n", workerCount);
+	printf("Congestion control: %s", UTP_GET_CC_NAME(workers->server.cc));
+	printf(workers->server.pacing ? ", paced at %d%%.\n" : ".\n", workers->server.pacing);
+	return 0;
+}
+
+int openFiles(int argc, char* argv[]) {
+	// Files of the single peer, before the handshake so a bad path fails early.
+	char* sendPath = optionString("-send", argc, argv);
+	char* recvPath = optionString("-recv", argc, argv);
+	if (sendPath && (sendFile = open(sendPath, O_RDONLY)) < 0) {
+		printf("Can't read %s: %s.\n", sendPath, strerror(errno));
+		return 0;
+	}
+	if (recvPath && (recvFile = open(recvPath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		printf("Can't write %s: %s.\n", recvPath, strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+int openBench(int argc, char* argv[]) {
+	// (1) role of a server: discard or echo what its peers send.
+	// (2) a bulk workload is a file of -bytes, sent the way -send would.
+	// (3) a request/response workload sends one buffer -count times.
+	char* answer 	= optionString("-bench", argc, argv);
+	char* workload 	= optionString("-workload", argc, argv);
+	if (answer)
+		bench.answer = !strcmp(answer, "echo") ? BENCH_ECHO : !strcmp(answer, "sink") ? BENCH_SINK : -1;
+	if (workload)
+		bench.workload = !strcmp(workload, "rr") ? BENCH_RR : !strcmp(workload, "bulk") ? BENCH_BULK : -1;
+	if (bench.answer < 0 || bench.workload < 0) {
+		printf("Unknown benchmark %s.\n", bench.answer < 0 ? answer : workload);
+		return 0;
+	}
+	bench.bytes = optionValue("-bytes", BENCH_BYTES, argc, argv);
+	bench.count = optionValue("-count", BENCH_COUNT, argc, argv);
+	bench.size 	= optionValue("-size", BENCH_SIZE, argc, argv);
+	if (bench.workload == BENCH_RR) {
+		bench.request = malloc(bench.size > 0 ? bench.size : 1);
+		for (int i = 0; i < bench.size; i++)
+			bench.request[i] = 'a' + i % 26;
+		return bench.size > 0 && bench.count > 0;
+	}
+	if (bench.workload != BENCH_BULK)
+		return 1;
+
+	char path[] = "/tmp/utp-bench-XXXXXX";
+	char chunk[BUFFER_SIZE];
+	for (int i = 0; i < BUFFER_SIZE; i++)
+		chunk[i] = 'a' + i % 26;
+	if ((sendFile = mkstemp(path)) < 0) {
+		printf("Can't create %s: %s.\n", path, strerror(errno));
+		return 0;
+	}
+	unlink(path);
+	for (int64_t left = bench.bytes; left > 0; left -= BUFFER_SIZE)
+		if (write(sendFile, chunk, left < BUFFER_SIZE ? left : BUFFER_SIZE) < 0) {
+			printf("Can't write %s: %s.\n", path, strerror(errno));
+			return 0;
+		}
+	return 1;
+}
+
+/*--------------------------------------------------
+ * Benchmark (sweeps)
+ *--------------------------------------------------
+ * ./program bench [address] runs the workload once
+ * for every combination of the comma separated
+ * -wsize, -psize and -timer lists. Each point is a
+ * client process (and a loopback server process
+ * unless an address is given) running this same
+ * program, the parent reads the result line of
+ * the client and prints one row per point. A
+ * remote server must be started with -bench echo
+ * (rr) or -bench sink (bulk). Everything else on
+ * the command line is passed on to both ends.
+ *--------------------------------------------------*/
+int sweepPoints(char* list, int fallback, int points[]) {
+	// Values of a comma separated list (one fallback value without it).
+	int count = 0;
+	if (!list)
+		points[count++] = fallback;
+	for (char* value = list; value && count < BENCH_POINTS; value = strchr(value, ',')) {
+		if (*value == ',')
+			value++;
+		points[count++] = atoi(value);
+	}
+	return count;
+}
+
+int sweptOption(char* arg) {
+	return !strcmp(arg, "-wsize") || !strcmp(arg, "-psize") || !strcmp(arg, "-timer")
+		|| !strcmp(arg, "-port") || !strcmp(arg, "-workload") || !strcmp(arg, "-bench");
+}
+
+int main(int argc, char* argv[]);
+
+pid_t forkBench(char* args[], int count, int out, int deadline) {
+	// The child runs main itself, with an empty stdin so only the workload is sent.
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid)
+		return pid;
+	int null = open("/dev/null", O_RDWR);
+	dup2(null, 0);
+	dup2(out >= 0 ? out : null, 1);
+	alarm(deadline);
+	exit(main(count, args));
+}
+
+int benchPoint(char* args[], int count, char* remote, int server) {
+	// (1) start the loopback server, give it a moment to bind.
+	// (2) run the client, keep its result line.
+	// (3) the server outlives the teardown at most by a few RTOs.
+	static char result[LINE_SIZE];
+	int 	out[2];
+	pid_t 	host = -1;
+	if (!remote) {
+		host = forkBench(args, server, -1, BENCH_DEADLINE + 5);
+		usleep(100000);
+	}
+
+	args[server] = args[0];
+	pipe(out);
+	pid_t client = forkBench(args + server, count - server, out[1], BENCH_DEADLINE);
+	close(out[1]);
+	FILE* 	from = fdopen(out[0], "r");
+	char 	line[LINE_SIZE];
+	result[0] = 0;
+	while (fgets(line, sizeof(line), from))
+		if (!strncmp(line, "Bench: ", 7))
+			strcpy(result, line);
+	fclose(from);
+	waitpid(client, NULL, 0);
+
+	for (int i = 0; host > 0 && i < 50 && !waitpid(host, NULL, WNOHANG); i++)
+		usleep(100000);
+	if (host > 0 && !kill(host, SIGKILL))
+		waitpid(host, NULL, 0);
+
+	double 	seconds, goodput, resent;
+	int64_t bytes, p50, p99, p999;
+	int parsed = sscanf(result, "Bench: %*s %ld bytes in %lf s, goodput %lf Mbit/s, latency p50/p99/p999 %ld/%ld/%ld usec, retransmits %lf%%.",
+		&bytes, &seconds, &goodput, &p50, &p99, &p999, &resent);
+	if (parsed == 7)
+		printf("%10.2f %10.3f %8ld %8ld %8ld %8.2f%%\n", goodput, seconds, p50, p99, p999, resent);
+	else
+		printf("%10s\n", "failed");
+	fflush(stdout);
+	return parsed == 7;
+}
+
+int runBench(int argc, char* argv[]) {
+	// (1) the address is optional, without it every point starts its own server.
+	// (2) one argument vector per point: the server's first, the client's after it.
+	char* 	remote 	 = argc > 2 && argv[2][0] != '-' ? argv[2] : NULL;
+	char* 	workload = optionString("-workload", argc, argv);
+	int 	wsizes[BENCH_POINTS], psizes[BENCH_POINTS], timers[BENCH_POINTS];
+	int 	nw = sweepPoints(optionString("-wsize", argc, argv), UTP_DEFAULT_WSIZE, wsizes);
+	int 	np = sweepPoints(optionString("-psize", argc, argv), UTP_DEFAULT_PSIZE, psizes);
+	int 	nt = sweepPoints(optionString("-timer", argc, argv), UTP_DEFAULT_TIMEOUT, timers);
+	char 	port[16], wsize[16], psize[16], timer[16];
+	char** 	args = calloc(2 * argc + 32, sizeof(char*));
+	int 	failed = 0;
+
+	workload = workload && !strcmp(workload, "rr") ? "rr" : "bulk";
+	snprintf(port, sizeof(port), "%d", optionValue("-port", UTP_DEFAULT_PORT, argc, argv));
+	printf("Benchmark: %s workload, %s.\n", workload, remote ? remote : "loopback");
+	printf("%6s %6s %8s %10s %10s %8s %8s %8s %9s\n", "wsize", "psize", "timer",
+		"Mbit/s", "seconds", "p50", "p99", "p999", "resent");
+
+	for (int w = 0; w < nw; w++)
+	for (int p = 0; p < np; p++)
+	for (int t = 0; t < nt; t++) {
+		snprintf(wsize, sizeof(wsize), "%d", wsizes[w]);
+		snprintf(psize, sizeof(psize), "%d", psizes[p]);
+		snprintf(timer, sizeof(timer), "%d", timers[t]);
+		char* terms[] = { "-port", port, "-wsize", wsize, "-psize", psize, "-timer", timer };
+		int count = 0;
+		args[count++] = argv[0];
+		args[count++] = "server";
+		for (int i = 0; i < 8; i++)
+			args[count++] = terms[i];
+		args[count++] = "-bench";
+		args[count++] = !strcmp(workload, "rr") ? "echo" : "sink";
+		for (int i = remote ? 3 : 2; i < argc; i++) {
+			if (sweptOption(argv[i]) && i + 1 < argc)
+				i++;
+			else
+				args[count++] = argv[i];
+		}
+		int server = count;
+		args[count++] = NULL; 			// argv[0] of the client
+		args[count++] = "client";
+		args[count++] = remote ? remote : "127.0.0.1";
+		for (int i = 0; i < 8; i++)
+			args[count++] = terms[i];
+		args[count++] = "-workload";
+		args[count++] = workload;
+		for (int i = remote ? 3 : 2; i < argc; i++) {
+			if (sweptOption(argv[i]) && i + 1 < argc)
+				i++;
+			else
+				args[count++] = argv[i];
+		}
+		args[count] = NULL;
+
+		printf("%6d %6d %8d ", wsizes[w], psizes[p], timers[t]);
+		failed += !benchPoint(args, count, remote, server);
+	}
+	free(args);
+	return failed ? 1 : 0;
 }
 
 /*--------------------------------------------------
  * Main: setup, start threads, teardown.
  *--------------------------------------------------*/
 int main(int argc, char* argv[]) {
+	// Sweep a benchmark? The points run as child processes of their own.
+	if (argc > 1 && !strcmp(argv[1], "bench"))
+		return runBench(argc, argv);
+
 	// Start host?
 	if (argc > 1 && (!strcmp(argv[1], "listen") || !strcmp(argv[1], "server"))) {
-		running != UTP_OPEN_RECV(&conn, argc, argv);
+		UTP_CONTEXT_INIT(&context, argc, argv);
+		serving = optionValue("-peers", UTP_DEFAULT_PEERS, argc, argv) > 1;
+		if (!openBench(argc, argv))
+			running = 0;
+		else if (serving)
+			running = !openWorkers(argc, argv);
+		else if ((running = openFiles(argc, argv)))
+			running != UTP_OPEN_RECV(&peer.conn, &context, argc, argv);
 	}
 	// start peer?
 	else if (argc > 1 && (!strcmp(argv[1], "connect") || !strcmp(argv[1], "client"))) {
-		running != UTP_OPEN_SEND(&conn, argc, argv);
+		UTP_CONTEXT_INIT(&context, argc, argv);
+		if ((running = openFiles(argc, argv) && openBench(argc, argv)))
+			running != UTP_OPEN_SEND(&peer.conn, &context, argc, argv);
 	}
 	else {
 		UTP_HELP();
@@ -367,7 +1761,7 @@ int main(int argc, char* argv[]) {
 
 	if (running) {
 		srand(time(NULL));
-		printf("Connection established.\n");
+		printf(serving ? "Waiting for peers.\n" : "Connection established.\n");
 		printf("-----------------------------\n");
 	#ifdef VERBOSE
 		printf("Verbose printout notation:\n");
@@ -375,45 +1769,42 @@ int main(int argc, char* argv[]) {
 		printf("-----------------------------\n");
 	#endif
 
-		// Set up size parameters.
-		wsize = UTP_GET_WINDOW_SIZE();
-		fsize =	UTP_GET_FRAME_SIZE();
-		psize = UTP_GET_PAYLOAD_SIZE();
-
-		// Allocate the frame to hold data.
-		frame = malloc(fsize);
-
-		// Initialize window buffers
-		buffer.recv = calloc(wsize, fsize);
-		buffer.send = calloc(wsize, fsize);
-		buffer.acks = calloc(wsize, fsize);
-
-		// Initialize status tracker
-		status.sendLast = 0;
-		status.recvLast = 0;
-		status.sendNext = conn.seqSend;
-		status.recvNext = conn.seqRecv + 1;
+		// The single peer needs a single worker.
+		if (!serving) {
+			workers = calloc(1, sizeof(struct worker));
+			openWorker(workers, 0);
+		}
 
-		// Start threads
-		pthread_t _resend  = createThreadForFunction(resend);
-		pthread_t _request = createThreadForFunction(request);
-		pthread_t _events  = createThreadForFunction(eventHandler);
+		// Start i/o threads and event handlers (ARQ timers are serviced from their loops)
+		// The reader may stay blocked on stdin after teardown, it ends with the process.
+		openBell(outputBell, 1);
+		pthread_t _writer = createThreadForFunction(outputWriter, NULL);
+		pthread_detach(createThreadForFunction(inputReader, NULL));
+		for (int i = 0; i < workerCount; i++)
+			workers[i].thread = createThreadForFunction(eventHandler, &workers[i]);
 
-		// Wait for threads to finish (exit).
-		pthread_join(_resend, 	NULL);
-		pthread_join(_request, 	NULL);
-		pthread_join(_events, 	NULL);
+		// Wait for threads to finish (exit), then for the last lines to be written.
+		tdClean = 1;
+		for (int i = 0; i < workerCount; i++) {
+			pthread_join(workers[i].thread, NULL);
+			tdClean &= workers[i].tdClean;
+		}
+		atomic_store(&writing, 0);
+		ring(outputBell[1]);
+		pthread_join(_writer, NULL);
 
 		// Was teardown clean or did it time out?
-		if (tdClean)
-			printf("Teardown accepted. Final sequence: %ld\n", conn.seqSend);
+		if (tdClean && serving)
+			printf("Teardown accepted.\n");
+		else if (tdClean)
+			printf("Teardown accepted. Final sequence: %ld\n", peer.conn.seqSend);
 		else
 			printf("Teardown finished due to timeout.\n");
 
-		free(buffer.recv);
-		free(buffer.send);
-		free(buffer.acks);
-		free(frame);
+		for (int i = 0; i < workerCount; i++)
+			UTP_QUEUE_FREE(&workers[i].output);
+		if (recvFile >= 0)
+			close(recvFile);
 		printf("Connection terminated.\n");
 	}
 	return 0;
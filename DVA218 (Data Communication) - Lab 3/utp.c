@@ -14,98 +14,1471 @@ fd_set getSelectSet(int fd) {
 }
 
 struct timeval getSelectTimeout(int timeout) {
+	// tv_usec must stay below one second.
 	struct timeval t;
-	t.tv_sec = 0;
-	t.tv_usec = timeout;
+	t.tv_sec  = timeout / 1000000;
+	t.tv_usec = timeout % 1000000;
 	return t;
 }
 
 /*******************************************************/
 // Payload & window size setting/getting
-int UTP_WINDOW  = 1;
-int UTP_PAYLOAD = UTP_HANDSHAKE_SIZE;
-int UTP_TIMEOUT = UTP_DEFAULT_TIMEOUT;
+// Negotiated sizes live in each connection's terms.
 
 
 //////	Payload & window size setting/getting
-void UTP_FORCE_WINDOW_SIZE(int size) {
-	UTP_WINDOW = size > 1 ? size : UTP_WINDOW;
+void UTP_FORCE_WINDOW_SIZE(struct utp_conn* conn, int size) {
+	conn->terms.wsize = size > 1 ? size : conn->terms.wsize;
 }
 
-void UTP_FORCE_PAYLOAD_SIZE(int size) {
-	UTP_PAYLOAD = size > 1 ? size : UTP_PAYLOAD;
+void UTP_FORCE_PAYLOAD_SIZE(struct utp_conn* conn, int size) {
+	conn->terms.psize = size > 1 ? size : conn->terms.psize;
 }
 
-void UTP_SET_WINDOW_SIZE(int recvSize, int sendSize) {
-	UTP_FORCE_WINDOW_SIZE(recvSize > sendSize ? sendSize : recvSize);
+void UTP_SET_WINDOW_SIZE(struct utp_conn* conn, int recvSize, int sendSize) {
+	UTP_FORCE_WINDOW_SIZE(conn, recvSize > sendSize ? sendSize : recvSize);
 }
-void UTP_SET_PAYLOAD_SIZE(int recvSize, int sendSize) {
-	UTP_FORCE_PAYLOAD_SIZE(recvSize > sendSize ? sendSize : recvSize);
+void UTP_SET_PAYLOAD_SIZE(struct utp_conn* conn, int recvSize, int sendSize) {
+	UTP_FORCE_PAYLOAD_SIZE(conn, recvSize > sendSize ? sendSize : recvSize);
 }
 
+void UTP_SET_ACK_FREQUENCY(struct utp_conn* conn, int recvFreq, int sendFreq) {
+	// Coalesce no more than either peer allows, 1 disables delayed ACKs.
+	int freq = recvFreq > sendFreq ? sendFreq : recvFreq;
+	conn->terms.ackfreq = freq > 1 ? freq : 1;
+}
+
+int UTP_GET_ACK_FREQUENCY(struct utp_conn* conn) {
+	return conn->terms.ackfreq;
+}
+
+void UTP_SET_FEC(struct utp_conn* conn, int recvSpan, int sendSpan) {
+	// Both peers must ask for parity, the longer group (less overhead) wins.
+	// Call after the payload size is agreed, parity needs room for its header.
+	int span = recvSpan > sendSpan ? recvSpan : sendSpan;
+	span 	 = span > UTP_FEC_MAX ? UTP_FEC_MAX : span;
+	int both = recvSpan > 0 && sendSpan > 0 && conn->terms.psize > UTP_FEC_HEADER;
+	conn->terms.fec = both ? (span > 2 ? span : 2) : 0;
+}
+
+int UTP_GET_FEC(struct utp_conn* conn) {
+	return conn->terms.fec;
+}
+
+int64_t UTP_GET_ACK_DELAY(struct utp_conn* conn) {
+	// Coalesced ACKs must leave the peer's timeout plenty of room.
+	int64_t timeout = UTP_GET_TIMEOUT(conn);
+	return UTP_DEFAULT_ACK_DELAY < timeout / 2 ? UTP_DEFAULT_ACK_DELAY : timeout / 2;
+}
+
+
+int UTP_GET_WINDOW_SIZE(struct utp_conn* conn) {
+	return conn->terms.wsize;
+}
+
+int UTP_GET_PAYLOAD_SIZE(struct utp_conn* conn) {
+	return conn->terms.psize;
+}
+
+int32_t UTP_GET_DATA_SIZE(struct utp_conn* conn) {
+	// Payload of the next data frame, parity needs its header on top.
+	return conn->pmtu.size - (conn->terms.fec ? UTP_FEC_HEADER : 0);
+}
+
+int32_t payloadCapacity(struct utp_conn* conn) {
+	// A frame must hold a data payload as well as repeated handshake terms.
+	return conn->terms.psize > UTP_HANDSHAKE_SIZE ? conn->terms.psize : UTP_HANDSHAKE_SIZE;
+}
+
+int UTP_GET_FRAME_SIZE(struct utp_conn* conn) {
+	return sizeof(struct utp_pack) + (payloadCapacity(conn) * sizeof(char));
+}
+
+int UTP_GET_BUFFER_SIZE(struct utp_conn* conn, int numFrames) {
+	return UTP_GET_FRAME_SIZE(conn) * numFrames;
+}
+
+void connInit(struct utp_conn* conn) {
+	// Terms in effect until the handshake is done.
+	conn->id 	= 0;
+	conn->state 	= 0;
+	conn->compact 	= 0;
+	conn->terms 	= (struct utp_terms) { UTP_HANDSHAKE_SIZE, 1, UTP_HANDSHAKE_CHECKSUM, UTP_DEFAULT_ACKFREQ };
+	conn->seqPeer 	= 0;
+}
+
+
+//////	Checksum engine
+/*--------------------------------------------------
+ * Checksum engines
+ *--------------------------------------------------
+ * Every engine digests the encoded wire header and
+ * the valid part of the payload (frame->size bytes),
+ * never the padding behind it. Digests are written
+ * in network byte order into the header sum field.
+ * The handshake always runs on the handshake engine,
+ * the negotiated engine is used once connected.
+ *--------------------------------------------------*/
+
+void writeNetwork(unsigned char* out, uint64_t value, int length) {
+	// Big-endian store of the lower length bytes of value.
+	for (int i = length - 1; i >= 0; i--, value >>= 8)
+		out[i] = (unsigned char) value;
+}
+
+uint64_t readNetwork(const unsigned char* in, int length) {
+	uint64_t value = 0;
+	for (int i = 0; i < length; i++)
+		value = (value << 8) | in[i];
+	return value;
+}
+
+uint64_t digestRead64(const unsigned char* in) {
+	// Little-endian load, independent of host byte order.
+	uint64_t value = 0;
+	for (int i = 7; i >= 0; i--)
+		value = (value << 8) | in[i];
+	return value;
+}
+
+uint32_t digestRead32(const unsigned char* in) {
+	return (uint32_t) in[0] | (uint32_t) in[1] << 8 | (uint32_t) in[2] << 16 | (uint32_t) in[3] << 24;
+}
+
+// MD5 (legacy, OpenSSL)
+void digestMD5(const unsigned char* data, size_t size, unsigned char* out) {
+	MD5(data, size, out);
+}
+
+// CRC32C (Castagnoli), hardware accelerated where available
+#define CRC32C_POLY 0x82F63B78
+
+uint32_t crc32cTable[256];
+
+uint32_t crc32cSoftware(uint32_t crc, const unsigned char* data, size_t size) {
+	while (size--)
+		crc = crc32cTable[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+uint32_t crc32cHardware(uint32_t crc, const unsigned char* data, size_t size) {
+	uint64_t crc64 = crc, chunk;
+	for (; size >= 8; size -= 8, data += 8) {
+		memcpy(&chunk, data, 8);
+		crc64 = _mm_crc32_u64(crc64, chunk);
+	}
+	crc = (uint32_t) crc64;
+	while (size--)
+		crc = _mm_crc32_u8(crc, *data++);
+	return crc;
+}
+#define CRC32C_HARDWARE() __builtin_cpu_supports("sse4.2")
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+
+uint32_t crc32cHardware(uint32_t crc, const unsigned char* data, size_t size) {
+	uint64_t chunk;
+	for (; size >= 8; size -= 8, data += 8) {
+		memcpy(&chunk, data, 8);
+		crc = __crc32cd(crc, chunk);
+	}
+	while (size--)
+		crc = __crc32cb(crc, *data++);
+	return crc;
+}
+#define CRC32C_HARDWARE() 1
+
+#else
+#define crc32cHardware crc32cSoftware
+#define CRC32C_HARDWARE() 0
+#endif
+
+uint32_t (*crc32cUpdate)(uint32_t, const unsigned char*, size_t) = NULL;
+pthread_once_t crc32cOnce = PTHREAD_ONCE_INIT;
+
+void crc32cProbe() {
+	// Pick the hardware path if the CPU supports it, otherwise build the table.
+	if (CRC32C_HARDWARE()) {
+		crc32cUpdate = crc32cHardware;
+		return;
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+		crc32cTable[i] = crc;
+	}
+	crc32cUpdate = crc32cSoftware;
+}
+
+void digestCRC32C(const unsigned char* data, size_t size, unsigned char* out) {
+	pthread_once(&crc32cOnce, crc32cProbe);
+	writeNetwork(out, ~crc32cUpdate(~0U, data, size), 4);
+}
+
+// XXH64 (seed 0)
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+#define XXH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+uint64_t xxhRound(uint64_t acc, uint64_t lane) {
+	acc += lane * XXH_PRIME2;
+	acc  = XXH_ROTL(acc, 31);
+	return acc * XXH_PRIME1;
+}
+
+uint64_t xxhMerge(uint64_t acc, uint64_t val) {
+	acc ^= xxhRound(0, val);
+	return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+void digestXXH64(const unsigned char* data, size_t size, unsigned char* out) {
+	const unsigned char* end = data + size;
+	uint64_t hash;
+
+	if (size >= 32) {
+		// (1) four parallel accumulators over 32 byte stripes.
+		// (2) converge the accumulators into a single hash.
+		uint64_t v1 = XXH_PRIME1 + XXH_PRIME2, v2 = XXH_PRIME2, v3 = 0, v4 = -XXH_PRIME1;
+		for (; data + 32 <= end; data += 32) {
+			v1 = xxhRound(v1, digestRead64(data));
+			v2 = xxhRound(v2, digestRead64(data + 8));
+			v3 = xxhRound(v3, digestRead64(data + 16));
+			v4 = xxhRound(v4, digestRead64(data + 24));
+		}
+		hash = XXH_ROTL(v1, 1) + XXH_ROTL(v2, 7) + XXH_ROTL(v3, 12) + XXH_ROTL(v4, 18);
+		hash = xxhMerge(xxhMerge(xxhMerge(xxhMerge(hash, v1), v2), v3), v4);
+	}
+	else {
+		hash = XXH_PRIME5;
+	}
+	hash += (uint64_t) size;
+
+	// Consume the remaining tail (< 32 bytes).
+	for (; data + 8 <= end; data += 8) {
+		hash ^= xxhRound(0, digestRead64(data));
+		hash  = XXH_ROTL(hash, 27) * XXH_PRIME1 + XXH_PRIME4;
+	}
+	if (data + 4 <= end) {
+		hash ^= (uint64_t) digestRead32(data) * XXH_PRIME1;
+		hash  = XXH_ROTL(hash, 23) * XXH_PRIME2 + XXH_PRIME3;
+		data += 4;
+	}
+	for (; data < end; data++) {
+		hash ^= (*data) * XXH_PRIME5;
+		hash  = XXH_ROTL(hash, 11) * XXH_PRIME1;
+	}
+
+	// Final avalanche.
+	hash ^= hash >> 33; hash *= XXH_PRIME2;
+	hash ^= hash >> 29; hash *= XXH_PRIME3;
+	hash ^= hash >> 32;
+	writeNetwork(out, hash, 8);
+}
+
+// No checksum (trusted links)
+void digestNone(const unsigned char* data, size_t size, unsigned char* out) {}
+
+const struct utp_checksum UTP_CHECKSUMS[UTP_CHECKSUM_COUNT] = {
+	[UTP_CHECKSUM_MD5]	= { "md5",	MD5_DIGEST_LENGTH,	digestMD5 },
+	[UTP_CHECKSUM_CRC32C]	= { "crc32c",	4,			digestCRC32C },
+	[UTP_CHECKSUM_XXH64]	= { "xxh64",	8,			digestXXH64 },
+	[UTP_CHECKSUM_NONE]	= { "none",	0,			digestNone },
+};
+
+
+void UTP_FORCE_CHECKSUM(struct utp_conn* conn, int type) {
+	if (type == UTP_CHECKSUM_CRC32C && !crc32cUpdate)
+		crc32cProbe();
+	conn->terms.checksum = (type >= 0 && type < UTP_CHECKSUM_COUNT) ? type : conn->terms.checksum;
+}
+
+int UTP_AGREE_CHECKSUM(int recvType, int sendType) {
+	// Peers must agree on the engine, fall back to the handshake engine otherwise.
+	return (recvType == sendType) ? recvType : UTP_HANDSHAKE_CHECKSUM;
+}
+
+int UTP_GET_CHECKSUM(struct utp_conn* conn) {
+	return conn->terms.checksum;
+}
+
+int UTP_GET_CHECKSUM_LENGTH(int type) {
+	return UTP_CHECKSUMS[type].length;
+}
+
+const char* UTP_GET_CHECKSUM_NAME(int type) {
+	return (type >= 0 && type < UTP_CHECKSUM_COUNT) ? UTP_CHECKSUMS[type].name : "unknown";
+}
+
+int UTP_CHECKSUM_BY_NAME(char* name, int fallback) {
+	for (int i = 0; name && i < UTP_CHECKSUM_COUNT; i++)
+		if (strcmp(name, UTP_CHECKSUMS[i].name) == 0)
+			return i;
+	return fallback;
+}
+
+
+void UTP_CHECKSUM_PREPARE(int type, unsigned char* sum) {
+	memset(sum, 0, UTP_GET_CHECKSUM_LENGTH(type));
+}
+
+void UTP_CHECKSUM_ADD(int type, unsigned char* data, int32_t length, unsigned char* sum) {
+	// Digest the encoded frame with the sum field zeroed, then fill it in.
+	unsigned char digest[UTP_CHECKSUM_LENGTH];
+	UTP_CHECKSUM_PREPARE(type, sum);
+	UTP_CHECKSUMS[type].digest(data, length, digest);
+	memcpy(sum, digest, UTP_GET_CHECKSUM_LENGTH(type));
+}
+
+int UTP_CHECKSUM_VERIFY(int type, unsigned char* data, int32_t length, unsigned char* sum) {
+	// create a local receive hash.
+	unsigned char recv[UTP_CHECKSUM_LENGTH];
+	int valid;
+
+	// (1) copy hash from frame.
+	// (2) calculate a local version of the hash.
+	// (3) compare the received hash to the local version.
+	// (4) restore the received hash, leaving the frame untouched.
+	memcpy(recv, sum, UTP_GET_CHECKSUM_LENGTH(type));
+	UTP_CHECKSUM_ADD(type, data, length, sum);
+	valid = memcmp(recv, sum, UTP_GET_CHECKSUM_LENGTH(type)) == 0;
+	memcpy(sum, recv, UTP_GET_CHECKSUM_LENGTH(type));
+	return valid;
+}
+
+
+//////	Wire format
+/*--------------------------------------------------
+ * Wire format
+ *--------------------------------------------------
+ * The in-memory frame is never sent raw. The header
+ * is encoded right in front of the payload (into the
+ * tail of frame->wire) so header and payload form a
+ * single contiguous datagram without copying.
+ *
+ * Handshake frames carry the full 64 bit sequence.
+ * Once connected, frames carry the low 32 bits and
+ * the receiver extends them against the closest
+ * known sequence: its own send sequence for ACK and
+ * NAK frames, the highest peer sequence otherwise.
+ * Data frames carry the 32 bit send timestamp, and
+ * ACK/NAK frames echo it back when it is known.
+ * Frames carry the connection ID once it is known,
+ * so one socket can serve many peers.
+ *--------------------------------------------------*/
+void UTP_WIRE_COMPACT(struct utp_conn* conn, int enable) {
+	conn->compact = enable;
+}
+
+int wireEchoes(uint8_t flags) {
+	// ACK and NAK frames refer to the receiver's own sequence and clock,
+	// so does the answer to a path MTU probe.
+	uint8_t type = UTP_TYPE(flags);
+	return type == ACK || type == NAK || (type == PRB && !(flags & REQ));
+}
+
+int64_t wireExtend(int64_t reference, uint32_t low) {
+	// Closest 64 bit value to reference with the given low 32 bits.
+	return reference + (int32_t) (low - (uint32_t) reference);
+}
+
+int wireChecksum(struct utp_conn* conn, uint8_t options) {
+	// Handshake headers (long sequence) use the handshake engine.
+	return (options & UTP_WIRE_LONGSEQ) ? UTP_HANDSHAKE_CHECKSUM : conn->terms.checksum;
+}
+
+uint8_t wireOptions(struct utp_conn* conn) {
+	// Header options of the frames this connection sends, timestamp aside.
+	return (conn->compact ? 0 : UTP_WIRE_LONGSEQ) | (conn->id ? UTP_WIRE_CONNID : 0);
+}
+
+int32_t wireHeaderSize(struct utp_conn* conn, uint8_t options) {
+	return 4 + ((options & UTP_WIRE_CONNID) ? 4 : 0)
+		 + ((options & UTP_WIRE_LONGSEQ) ? 8 : 4)
+		 + ((options & UTP_WIRE_TIME) ? 4 : 0)
+		 + UTP_GET_CHECKSUM_LENGTH(wireChecksum(conn, options));
+}
+
+int UTP_GET_HEADER_SIZE(struct utp_conn* conn) {
+	// Header size of a data frame in the current format.
+	return wireHeaderSize(conn, wireOptions(conn) | (conn->compact ? UTP_WIRE_TIME : 0));
+}
+
+int32_t UTP_WIRE_ENCODE(struct utp_conn* conn, struct utp_pack* frame) {
+	// (1) pick the header options for this frame.
+	// (2) write the header so that it ends where the payload starts.
+	uint8_t options = wireOptions(conn);
+	int64_t stamp 	= wireEchoes(frame->flags) ? frame->echo : frame->time;
+	if (conn->compact && stamp)
+		options |= UTP_WIRE_TIME;
+
+	int32_t head 	  = wireHeaderSize(conn, options);
+	int32_t idLength  = (options & UTP_WIRE_CONNID) ? 4 : 0;
+	int32_t seqLength = (options & UTP_WIRE_LONGSEQ) ? 8 : 4;
+	unsigned char* out = (unsigned char*) frame->msg - head;
+
+	frame->id = conn->id;
+	out[0] = (UTP_WIRE_VERSION << 4) | options;
+	out[1] = frame->flags;
+	writeNetwork(out + 2, (uint16_t) frame->size, 2);
+	if (idLength)
+		writeNetwork(out + 4, (uint64_t) conn->id, 4);
+	writeNetwork(out + 4 + idLength, (uint64_t) frame->seq, seqLength);
+	if (options & UTP_WIRE_TIME)
+		writeNetwork(out + 4 + idLength + seqLength, (uint64_t) stamp, 4);
+	return head;
+}
+
+int32_t UTP_WIRE_DECODE(struct utp_conn* conn, struct utp_pack* frame, unsigned char* data, int32_t length) {
+	// Returns the header length, or 0 if the header is malformed.
+	if (length < 4 || (data[0] >> 4) != UTP_WIRE_VERSION)
+		return 0;
+
+	uint8_t options   = data[0] & 0x0F;
+	int32_t head 	  = wireHeaderSize(conn, options);
+	int32_t idLength  = (options & UTP_WIRE_CONNID) ? 4 : 0;
+	int32_t seqLength = (options & UTP_WIRE_LONGSEQ) ? 8 : 4;
+	uint16_t size 	  = (uint16_t) readNetwork(data + 2, 2);
+
+	if (length < head || size > payloadCapacity(conn))
+		return 0;
+
+	frame->flags = data[1];
+	frame->size  = (int16_t) size;
+	frame->id    = idLength ? (uint32_t) readNetwork(data + 4, 4) : 0;
+	frame->time  = UTP_TIME();
+	frame->echo  = 0;
+
+	if (options & UTP_WIRE_LONGSEQ)
+		frame->seq = (int64_t) readNetwork(data + 4 + idLength, 8);
+	else
+		frame->seq = wireExtend(wireEchoes(frame->flags) ? conn->seqSend : conn->seqPeer,
+			(uint32_t) readNetwork(data + 4 + idLength, 4));
+
+	if (options & UTP_WIRE_TIME) {
+		uint32_t stamp = (uint32_t) readNetwork(data + 4 + idLength + seqLength, 4);
+		// An echo is our own clock and can be extended, a peer stamp is kept as is.
+		frame->echo = wireEchoes(frame->flags) ? wireExtend(frame->time, stamp) : stamp;
+	}
+	return head;
+}
+
+uint32_t UTP_WIRE_PEEK_ID(unsigned char* data, int32_t length) {
+	// Connection ID of an encoded frame, 0 if it carries none.
+	if (length < 8 || (data[0] >> 4) != UTP_WIRE_VERSION || !(data[0] & UTP_WIRE_CONNID))
+		return 0;
+	return (uint32_t) readNetwork(data + 4, 4);
+}
+
+
+//////	Timer and timeout
+int64_t UTP_TIME() {
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return t.tv_sec * 1000000 + t.tv_usec;
+}
+
+int64_t UTP_GET_TIMEOUT(struct utp_conn* conn) {
+	return conn->ctx->timeout;
+}
+
+void UTP_SET_TIMEOUT(struct utp_context* ctx, int64_t timeout) {
+	ctx->timeout = timeout > 0 ? timeout : UTP_DEFAULT_TIMEOUT;
+}
+
+int UTP_TIMEOUT_EXPIRED(struct utp_conn* conn, int64_t timestamp) {
+	int64_t now = UTP_TIME();
+	return (timestamp + UTP_GET_TIMEOUT(conn)) < now ? 1 : 0;
+}
+
+
+//////	Congestion control
+/*--------------------------------------------------
+ * Congestion controllers
+ *--------------------------------------------------
+ * The sender keeps no more than UTP_CC_WINDOW frames
+ * in flight, min(cwnd, advertised window). ACKs grow
+ * the window, loss signals shrink it: a NAK is a
+ * loss event (once per window of data, NewReno
+ * style), a retransmit timeout collapses cwnd to one.
+ * With pacing on, frames are spread over the RTT at
+ * cwnd/srtt times the pacing gain instead of bursts.
+ *--------------------------------------------------*/
+#define CUBIC_C 	0.4
+#define CUBIC_BETA 	0.7
+
+void ccNoneAck(struct utp_cwnd* cc, int32_t acked, int64_t srtt) {}
+
+void ccNoneLoss(struct utp_cwnd* cc) {}
+
+void ccRenoAck(struct utp_cwnd* cc, int32_t acked, int64_t srtt) {
+	// Slow start below ssthresh, then one frame per window of ACKs.
+	if (cc->cwnd < cc->ssthresh)
+		cc->cwnd += acked;
+	else
+		cc->cwnd += (double) acked / cc->cwnd;
+}
+
+void ccRenoLoss(struct utp_cwnd* cc) {
+	cc->ssthresh = cc->cwnd / 2 > 2 ? cc->cwnd / 2 : 2;
+	cc->cwnd 	 = cc->ssthresh;
+}
+
+double cubeRoot(double x) {
+	// Newton iteration, x >= 0, avoids pulling in libm for cbrt().
+	double r = x > 1 ? x / 3 : 1;
+	for (int i = 0; i < 32; i++)
+		r -= (r * r * r - x) / (3 * r * r);
+	return r;
+}
+
+void ccCubicAck(struct utp_cwnd* cc, int32_t acked, int64_t srtt) {
+	if (cc->cwnd < cc->ssthresh) {
+		cc->cwnd += acked;
+		return;
+	}
+	// W(t) = C (t - K)^3 + Wmax, evaluated one RTT ahead.
+	int64_t now = UTP_TIME();
+	if (!cc->epoch) {
+		cc->epoch = now;
+		cc->wmax  = cc->wmax > cc->cwnd ? cc->wmax : cc->cwnd;
+	}
+	double k 	 = cubeRoot(cc->wmax * (1 - CUBIC_BETA) / CUBIC_C);
+	double t 	 = (now - cc->epoch + srtt) / 1000000.0 - k;
+	double target = CUBIC_C * t * t * t + cc->wmax;
+
+	if (target > cc->cwnd)
+		cc->cwnd += (target - cc->cwnd) / cc->cwnd * acked;
+	else
+		cc->cwnd += 0.01 * acked / cc->cwnd;
+}
+
+void ccCubicLoss(struct utp_cwnd* cc) {
+	cc->wmax 	 = cc->cwnd;
+	cc->cwnd 	 = cc->cwnd * CUBIC_BETA > 2 ? cc->cwnd * CUBIC_BETA : 2;
+	cc->ssthresh = cc->cwnd;
+	cc->epoch 	 = 0;
+}
+
+const struct utp_congestion UTP_CONGESTION[UTP_CC_COUNT] = {
+	[UTP_CC_NONE]		= { "none",	ccNoneAck,	ccNoneLoss },
+	[UTP_CC_NEWRENO]	= { "newreno",	ccRenoAck,	ccRenoLoss },
+	[UTP_CC_CUBIC]		= { "cubic",	ccCubicAck,	ccCubicLoss },
+};
+
+
+void UTP_CC_INIT(struct utp_conn* conn, int algorithm, int pacing) {
+	struct utp_cwnd* cc = &(conn->cc);
+	memset(cc, 0, sizeof(*cc));
+	cc->algorithm = (algorithm >= 0 && algorithm < UTP_CC_COUNT) ? algorithm : UTP_DEFAULT_CC;
+	cc->cwnd 	  = algorithm == UTP_CC_NONE ? UTP_WINDOW_MAX : UTP_CC_INITIAL;
+	cc->ssthresh  = UTP_WINDOW_MAX;
+	cc->recover   = conn->seqSend;
+	cc->pacing 	  = pacing > 0 ? pacing : 0;
+}
+
+int UTP_CC_BY_NAME(char* name, int fallback) {
+	for (int i = 0; name && i < UTP_CC_COUNT; i++)
+		if (strcmp(name, UTP_CONGESTION[i].name) == 0)
+			return i;
+	return fallback;
+}
+
+const char* UTP_GET_CC_NAME(int algorithm) {
+	return (algorithm >= 0 && algorithm < UTP_CC_COUNT) ? UTP_CONGESTION[algorithm].name : "unknown";
+}
+
+void UTP_CC_ACK(struct utp_conn* conn, int32_t acked) {
+	struct utp_cwnd* cc = &(conn->cc);
+	if (acked <= 0)
+		return;
+	UTP_CONGESTION[cc->algorithm].ack(cc, acked, conn->srtt);
+
+	// Growing past the advertised window gains nothing.
+	cc->cwnd = cc->cwnd > conn->rwnd ? conn->rwnd : cc->cwnd;
+}
+
+void UTP_CC_LOSS(struct utp_conn* conn, int64_t seq, int timeout) {
+	struct utp_cwnd* cc = &(conn->cc);
+	if (cc->algorithm == UTP_CC_NONE)
+		return;
+
+	// Retransmit timeout: restart from one frame in slow start.
+	if (timeout) {
+		UTP_CONGESTION[cc->algorithm].loss(cc);
+		cc->cwnd 	= 1;
+		cc->recover = conn->seqSend;
+		return;
+	}
+	// Loss signal: reduce once per window of data (frames sent before the last reduction).
+	if (seq < cc->recover)
+		return;
+	UTP_CONGESTION[cc->algorithm].loss(cc);
+	cc->recover = conn->seqSend;
+}
+
+int32_t UTP_CC_WINDOW(struct utp_conn* conn) {
+	int32_t cwnd = (int32_t) conn->cc.cwnd;
+	cwnd = cwnd > 1 ? cwnd : 1;
+	return cwnd < conn->rwnd ? cwnd : conn->rwnd;
+}
+
+int64_t UTP_CC_PACE(struct utp_conn* conn, int64_t now) {
+	// Returns 0 and books a send slot if a frame may go now,
+	// otherwise the time at which the next frame may be sent.
+	struct utp_cwnd* cc = &(conn->cc);
+	if (!cc->pacing || !conn->srtt)
+		return 0;
+	if (now < cc->paceNext)
+		return cc->paceNext;
+
+	int64_t interval = (conn->srtt * 100) / ((int64_t) (cc->cwnd * cc->pacing) + 1);
+	cc->paceNext = (cc->paceNext > now ? cc->paceNext : now) + interval;
+	return 0;
+}
+
+
+//////	Path MTU
+/*--------------------------------------------------
+ * Path MTU search (DPLPMTUD, RFC 8899)
+ *--------------------------------------------------
+ * The negotiated payload size is the ceiling frame
+ * buffers hold. With probing on, data frames start
+ * at the floor, a payload that fits the datagram
+ * any path is assumed to carry. Padding-only probes
+ * (PRB|REQ) search upwards: a probe the peer answers
+ * raises the payload of new frames, UTP_PMTU_PROBES
+ * probes without an answer lower the upper bound.
+ * Nothing fragments (IP_PMTUDISC_PROBE), so a lost
+ * probe means the path didn't carry it. Once done,
+ * the search starts over after UTP_PMTU_RAISE.
+ *
+ * UTP_PMTU_BLACKHOLE retransmit timeouts in a row
+ * fall back to the floor. Frames sent at the old
+ * size are numbered already and can't be split,
+ * their resends are allowed to fragment instead.
+ *--------------------------------------------------*/
+void setFragmentation(int sock, int allow) {
+#ifdef IP_PMTUDISC_PROBE
+	int mode = allow ? IP_PMTUDISC_DONT : IP_PMTUDISC_PROBE;
+	setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode));
+#endif
+}
+
+void UTP_PMTU_INIT(struct utp_conn* conn, int enable) {
+	struct utp_pmtu* pmtu = &conn->pmtu;
+	int32_t floor = UTP_PMTU_BASE - UTP_IP_UDP_HEADER - UTP_WIRE_HEADER_MAX;
+
+	memset(pmtu, 0, sizeof(struct utp_pmtu));
+	pmtu->ceiling = conn->terms.psize;
+	pmtu->floor   = floor < pmtu->ceiling ? floor : pmtu->ceiling;
+	pmtu->enabled = enable && pmtu->floor < pmtu->ceiling;
+	pmtu->size    = pmtu->enabled ? pmtu->floor : pmtu->ceiling;
+	if (pmtu->enabled)
+		setFragmentation(conn->sock, 0);
+}
+
+/*--------------------------------------------------
+ * RETURN VALUE (probe):
+ 	n: payload of the probe to send now
+ 	0: no probe (one in flight, or search done)
+ *--------------------------------------------------*/
+int32_t UTP_PMTU_PROBE(struct utp_conn* conn, int64_t now) {
+	// (1) one probe at a time, a finished search waits for the raise timer.
+	// (2) try the ceiling first, then halve the span between the bounds.
+	struct utp_pmtu* pmtu = &conn->pmtu;
+	if (!pmtu->enabled || pmtu->probe || now < pmtu->next)
+		return 0;
+
+	int32_t upper = pmtu->failed ? pmtu->failed - 1 : pmtu->ceiling;
+	if (upper - pmtu->size < UTP_PMTU_STEP) {
+		pmtu->failed = 0;
+		pmtu->next   = now + UTP_PMTU_RAISE;
+		return 0;
+	}
+	pmtu->probe = pmtu->failed ? pmtu->size + (upper - pmtu->size + 1) / 2 : upper;
+	pmtu->sent  = now;
+	return pmtu->probe;
+}
+
+/*--------------------------------------------------
+ * RETURN VALUE (confirm, timeout):
+ 	1: payload of new frames changed
+ 	0: unchanged
+ *--------------------------------------------------*/
+int UTP_PMTU_CONFIRM(struct utp_conn* conn, int32_t size) {
+	// The path carried a probe of size (a late answer counts as well).
+	struct utp_pmtu* pmtu = &conn->pmtu;
+	if (size == pmtu->probe) {
+		pmtu->probe 	= 0;
+		pmtu->attempts 	= 0;
+	}
+	if (!pmtu->enabled || size <= pmtu->size || size > pmtu->ceiling)
+		return 0;
+	pmtu->size = size;
+	if (pmtu->failed && pmtu->failed <= size)
+		pmtu->failed = 0;
+	return 1;
+}
+
+void UTP_PMTU_LOST(struct utp_conn* conn, int64_t sent, int tooBig) {
+	// The probe sent at that time got no answer, or couldn't even leave the host.
+	struct utp_pmtu* pmtu = &conn->pmtu;
+	if (!pmtu->probe || pmtu->sent != sent)
+		return;
+	if (tooBig || ++pmtu->attempts >= UTP_PMTU_PROBES) {
+		pmtu->failed 	= pmtu->probe;
+		pmtu->attempts 	= 0;
+	}
+	pmtu->probe = 0;
+}
+
+void UTP_PMTU_ACK(struct utp_conn* conn) {
+	conn->pmtu.timeouts = 0;
+}
+
+int UTP_PMTU_TIMEOUT(struct utp_conn* conn) {
+	struct utp_pmtu* pmtu = &conn->pmtu;
+	if (!pmtu->enabled || ++pmtu->timeouts < UTP_PMTU_BLACKHOLE || pmtu->size == pmtu->floor)
+		return 0;
+	pmtu->failed 	= pmtu->size;
+	pmtu->size 	= pmtu->floor;
+	pmtu->timeouts 	= 0;
+	pmtu->probe 	= 0;
+	pmtu->attempts 	= 0;
+	return 1;
+}
+
+
+//////	Timers
+/*--------------------------------------------------
+ * Timer heap
+ *--------------------------------------------------
+ * Binary min-heap of deadlines. Timers are never
+ * cancelled, the owner checks the key and stamp of
+ * an expired timer and drops it if it is stale.
+ * UTP_TIMER_WAIT gives the select() timeout until the
+ * earliest deadline, or NULL to block when idle.
+ *--------------------------------------------------*/
+void UTP_TIMERS_INIT(struct utp_timers* timers, int32_t capacity) {
+	timers->capacity = capacity > 1 ? capacity : 1;
+	timers->count 	 = 0;
+	timers->heap 	 = malloc(timers->capacity * sizeof(struct utp_timer));
+}
+
+void UTP_TIMERS_FREE(struct utp_timers* timers) {
+	free(timers->heap);
+	timers->heap  = NULL;
+	timers->count = timers->capacity = 0;
+}
+
+void UTP_TIMER_ADD(struct utp_timers* timers, int64_t deadline, uint8_t kind, uint32_t id, int64_t key, int64_t stamp) {
+	if (timers->count == timers->capacity) {
+		timers->capacity *= 2;
+		timers->heap = realloc(timers->heap, timers->capacity * sizeof(struct utp_timer));
+	}
+	// Sift up from the new leaf.
+	int32_t i = timers->count++;
+	while (i > 0 && timers->heap[(i - 1) / 2].deadline > deadline) {
+		timers->heap[i] = timers->heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	timers->heap[i] = (struct utp_timer) { deadline, id, key, stamp, kind };
+}
+
+int UTP_TIMER_POP(struct utp_timers* timers, int64_t now, struct utp_timer* timer) {
+	// Pops the earliest timer if it has expired.
+	if (!timers->count || timers->heap[0].deadline > now)
+		return 0;
+
+	*timer = timers->heap[0];
+	struct utp_timer last = timers->heap[--timers->count];
+
+	// Sift the last leaf down from the root.
+	int32_t i = 0, child;
+	while ((child = 2 * i + 1) < timers->count) {
+		if (child + 1 < timers->count && timers->heap[child + 1].deadline < timers->heap[child].deadline)
+			child++;
+		if (last.deadline <= timers->heap[child].deadline)
+			break;
+		timers->heap[i] = timers->heap[child];
+		i = child;
+	}
+	if (timers->count)
+		timers->heap[i] = last;
+	return 1;
+}
+
+struct timeval* UTP_TIMER_WAIT(struct utp_timers* timers, struct timeval* wait) {
+	if (!timers->count)
+		return NULL;
+	int64_t left = timers->heap[0].deadline - UTP_TIME();
+	left = left > 0 ? left : 0;
+	wait->tv_sec  = left / 1000000;
+	wait->tv_usec = left % 1000000;
+	return wait;
+}
+
+
+//////	Event loop
+/*--------------------------------------------------
+ * Waits until a watched descriptor is readable or
+ * the earliest timer is due, in one system call.
+ * epoll keeps the interest set in the kernel so
+ * nothing is rebuilt per wait. select() is the
+ * portable fallback. Descriptors epoll refuses
+ * (regular files) are always readable, as with
+ * select(), and make a wait return immediately.
+ *--------------------------------------------------*/
+const char* UTP_LOOP_NAMES[UTP_LOOP_COUNT] = { "select", "epoll" };
+
+void UTP_LOOP_INIT(struct utp_loop* loop, int backend) {
+	loop->backend 	 = (backend >= 0 && backend < UTP_LOOP_COUNT) ? backend : UTP_DEFAULT_LOOP;
+	loop->fd 	 = -1;
+	loop->count 	 = 0;
+	loop->readyCount = 0;
+#ifdef __linux__
+	if (loop->backend == UTP_LOOP_EPOLL && (loop->fd = epoll_create1(0)) < 0)
+		loop->backend = UTP_LOOP_SELECT;
+#else
+	loop->backend = UTP_LOOP_SELECT;
+#endif
+}
+
+void UTP_LOOP_FREE(struct utp_loop* loop) {
+	if (loop->fd >= 0)
+		close(loop->fd);
+	loop->fd = -1;
+	loop->count = 0;
+}
+
+int UTP_LOOP_WATCH(struct utp_loop* loop, int fd) {
+	// Returns 0 if the loop is full or the descriptor can't be watched.
+	if (loop->count == UTP_LOOP_FDS)
+		return 0;
+	int steady = 0;
+#ifdef __linux__
+	if (loop->backend == UTP_LOOP_EPOLL) {
+		struct epoll_event event = { .events = EPOLLIN, .data.fd = fd };
+		if (epoll_ctl(loop->fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			if (errno != EPERM)
+				return 0;
+			steady = 1;
+		}
+	}
+#endif
+	loop->steady[loop->count] = steady;
+	loop->fds[loop->count++]  = fd;
+	return 1;
+}
+
+int waitSelect(struct utp_loop* loop, struct timeval* wait) {
+	fd_set 	files;
+	int 	top = 0;
+	FD_ZERO(&files);
+	for (int i = 0; i < loop->count; i++) {
+		FD_SET(loop->fds[i], &files);
+		top = loop->fds[i] > top ? loop->fds[i] : top;
+	}
+	// select(n, ...) uses i < n so need to increment span by 1.
+	if (select(top + 1, &files, NULL, NULL, wait) <= 0)
+		return 0;
+	for (int i = 0; i < loop->count; i++)
+		if (FD_ISSET(loop->fds[i], &files))
+			loop->ready[loop->readyCount++] = loop->fds[i];
+	return loop->readyCount;
+}
+
+int waitEpoll(struct utp_loop* loop, struct timeval* wait, int steady) {
+#ifdef __linux__
+	// epoll counts in milliseconds, round up so a wait never ends before the deadline.
+	struct epoll_event events[UTP_LOOP_FDS];
+	int timeout = steady ? 0 : wait ? (int) (wait->tv_sec * 1000 + (wait->tv_usec + 999) / 1000) : -1;
+	int count 	= epoll_wait(loop->fd, events, UTP_LOOP_FDS, timeout);
+	for (int i = 0; i < count; i++)
+		loop->ready[loop->readyCount++] = events[i].data.fd;
+	for (int i = 0; i < loop->count; i++)
+		if (loop->steady[i])
+			loop->ready[loop->readyCount++] = loop->fds[i];
+#endif
+	return loop->readyCount;
+}
+
+int UTP_LOOP_WAIT(struct utp_loop* loop, struct utp_timers* timers) {
+	// Returns the number of readable descriptors, 0 when a timer is due.
+	struct timeval 	wait;
+	struct timeval* timeout = UTP_TIMER_WAIT(timers, &wait);
+	int 		steady 	= 0;
+	for (int i = 0; i < loop->count; i++)
+		steady |= loop->steady[i];
+
+	loop->readyCount = 0;
+	if (loop->backend == UTP_LOOP_EPOLL)
+		return waitEpoll(loop, timeout, steady);
+	return waitSelect(loop, timeout);
+}
+
+int UTP_LOOP_READY(struct utp_loop* loop, int fd) {
+	for (int i = 0; i < loop->readyCount; i++)
+		if (loop->ready[i] == fd)
+			return 1;
+	return 0;
+}
+
+int UTP_LOOP_BY_NAME(char* name, int fallback) {
+	for (int i = 0; name && i < UTP_LOOP_COUNT; i++)
+		if (strcmp(name, UTP_LOOP_NAMES[i]) == 0)
+			return i;
+	return fallback;
+}
+
+const char* UTP_GET_LOOP_NAME(int backend) {
+	return (backend >= 0 && backend < UTP_LOOP_COUNT) ? UTP_LOOP_NAMES[backend] : "unknown";
+}
+
+
+//////	Queues
+/*--------------------------------------------------
+ * SPSC queue
+ *--------------------------------------------------
+ * One thread pushes, one thread pops, no locks.
+ * head and tail only ever grow and sit on separate
+ * cache lines. The producer publishes an entry by
+ * storing the tail (release) after writing it, the
+ * consumer frees the slot by storing the head after
+ * reading it. Entries are copied into fixed slots:
+ * a 4 byte length followed by the data.
+ *
+ * Both sides store their own index before they
+ * load the other one (sequentially consistent), so
+ * a consumer that found the queue empty is always
+ * seen by the producer of the next entry, which
+ * then wakes it up.
+ *--------------------------------------------------*/
+int UTP_QUEUE_INIT(struct utp_queue* queue, int32_t capacity, int32_t slotSize) {
+	int32_t slots = 1;
+	while (slots < capacity)
+		slots <<= 1;
+	queue->slotSize = slotSize;
+	queue->mask 	= slots - 1;
+	queue->slots 	= calloc(slots, sizeof(int32_t) + slotSize);
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->tail, 0);
+	return queue->slots != NULL;
+}
+
+void UTP_QUEUE_FREE(struct utp_queue* queue) {
+	free(queue->slots);
+	queue->slots = NULL;
+}
+
+char* queueSlot(struct utp_queue* queue, int64_t index) {
+	return queue->slots + (index & queue->mask) * (sizeof(int32_t) + queue->slotSize);
+}
+
+/*--------------------------------------------------
+ * RETURN VALUE (push):
+ 	n: entries not yet popped ahead of this one,
+ 	   0 means the consumer may be waiting for it
+ 	-1: queue is full (or the entry is too large)
+ *--------------------------------------------------*/
+int32_t UTP_QUEUE_PUSH(struct utp_queue* queue, const void* data, int32_t size) {
+	int64_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	int64_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+	if (tail - head > queue->mask || size > queue->slotSize)
+		return -1;
+
+	char* slot = queueSlot(queue, tail);
+	memcpy(slot, &size, sizeof(int32_t));
+	memcpy(slot + sizeof(int32_t), data, size);
+	atomic_store(&queue->tail, tail + 1);
+
+	// The consumer may even have popped it already.
+	int64_t ahead = tail - atomic_load(&queue->head);
+	return ahead > 0 ? (int32_t) ahead : 0;
+}
+
+/*--------------------------------------------------
+ * RETURN VALUE (pop):
+ 	n: size of the entry copied to data
+ 	-1: queue is empty
+ *--------------------------------------------------*/
+int32_t UTP_QUEUE_POP(struct utp_queue* queue, void* data) {
+	int64_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	int64_t tail = atomic_load(&queue->tail);
+	if (head == tail)
+		return -1;
+
+	int32_t size;
+	char* 	slot = queueSlot(queue, head);
+	memcpy(&size, slot, sizeof(int32_t));
+	memcpy(data, slot + sizeof(int32_t), size);
+	atomic_store(&queue->head, head + 1);
+	return size;
+}
+
+
+//////	Frame pool
+/*--------------------------------------------------
+ * Frame pool
+ *--------------------------------------------------
+ * Frames of one size (a header and the largest
+ * payload) on cache line boundaries, allocated a
+ * chunk at a time and never moved, so a frame is
+ * referenced by its pointer until it's given back.
+ * Window rings and receive batches of a socket
+ * take their frames from the same pool, which lets
+ * a received frame be swapped into its window slot
+ * instead of copied.
+ *--------------------------------------------------*/
+void UTP_POOL_INIT(struct utp_pool* pool, int32_t frameSize, int32_t chunk) {
+	memset(pool, 0, sizeof(struct utp_pool));
+	pool->stride = (frameSize + UTP_CACHE_LINE - 1) & ~(UTP_CACHE_LINE - 1);
+	pool->chunk  = chunk > 0 ? chunk : 1;
+}
+
+void UTP_POOL_FREE(struct utp_pool* pool) {
+	for (int i = 0; i < pool->chunkCount; i++)
+		free(pool->chunks[i]);
+	free(pool->chunks);
+	free(pool->spare);
+	memset(pool, 0, sizeof(struct utp_pool));
+}
+
+int growPool(struct utp_pool* pool) {
+	// (1) allocate and clear the next chunk.
+	// (2) make room to keep track of it and all of its frames.
+	char* chunk = aligned_alloc(UTP_CACHE_LINE, (size_t) pool->stride * pool->chunk);
+	if (!chunk)
+		return 0;
+	memset(chunk, 0, (size_t) pool->stride * pool->chunk);
+
+	void** chunks = realloc(pool->chunks, (pool->chunkCount + 1) * sizeof(void*));
+	struct utp_pack** spare = chunks ? realloc(pool->spare, (pool->total + pool->chunk) * sizeof(struct utp_pack*)) : NULL;
+	if (chunks)
+		pool->chunks = chunks;
+	if (!spare) {
+		free(chunk);
+		return 0;
+	}
+	pool->spare = spare;
+	pool->chunks[pool->chunkCount++] = chunk;
+	pool->total += pool->chunk;
+	for (int i = pool->chunk - 1; i >= 0; i--)
+		pool->spare[pool->spareCount++] = (struct utp_pack*) (chunk + (size_t) i * pool->stride);
+	return 1;
+}
+
+/*--------------------------------------------------
+ * RETURN VALUE (take):
+ 	frame: cleared on first use, stale afterwards
+ 	NULL: out of memory
+ *--------------------------------------------------*/
+struct utp_pack* UTP_POOL_TAKE(struct utp_pool* pool) {
+	if (!pool->spareCount && !growPool(pool))
+		return NULL;
+	return pool->spare[--pool->spareCount];
+}
+
+void UTP_POOL_GIVE(struct utp_pool* pool, struct utp_pack* frame) {
+	if (frame)
+		pool->spare[pool->spareCount++] = frame;
+}
+
+
+//////	Streams
+/*--------------------------------------------------
+ * Message streams
+ *--------------------------------------------------
+ * A source stream refers to the caller's memory
+ * or file, frames are cut from it at the offset so
+ * nothing is ever shifted or staged. A file is read
+ * straight into the payload of the send window slot
+ * (pread), which is the only copy a frame needs:
+ * every frame carries its own header and checksum
+ * and stays in the window for resends, so sendfile
+ * or splice would have nothing to skip. The source
+ * must stay valid until it's no longer pending, the
+ * window keeps its own copy after that.
+ *
+ * A sink stream writes the in-order payloads through
+ * to a file, or grows its memory to hold the whole
+ * message (with room for a terminator).
+ *
+ * A CAT frame carries whole messages instead, each
+ * behind its length (UTP_RECORD_HEADER bytes), and
+ * is read one message at a time.
+ *--------------------------------------------------*/
+void UTP_STREAM_INIT(struct utp_stream* stream, int fd) {
+	memset(stream, 0, sizeof(struct utp_stream));
+	stream->fd = fd;
+}
+
+void UTP_STREAM_FREE(struct utp_stream* stream) {
+	if (stream->capacity)
+		free(stream->data);
+	UTP_STREAM_INIT(stream, -1);
+}
+
+int64_t UTP_STREAM_PENDING(struct utp_stream* stream) {
+	return stream->length - stream->offset;
+}
+
+/*--------------------------------------------------
+ * RETURN VALUE (write):
+ 	1: message queued for fragmentation
+ 	0: previous message still pending (or not a file)
+ *--------------------------------------------------*/
+int UTP_WRITE(struct utp_stream* stream, const void* data, int64_t length) {
+	if (UTP_STREAM_PENDING(stream))
+		return 0;
+	stream->data 	= (char*) data;
+	stream->fd 	= -1;
+	stream->length 	= length;
+	stream->offset 	= 0;
+	return 1;
+}
+
+int UTP_WRITE_FILE(struct utp_stream* stream, int fd) {
+	struct stat info;
+	if (UTP_STREAM_PENDING(stream) || fstat(fd, &info) < 0 || !S_ISREG(info.st_mode))
+		return 0;
+	stream->data 	= NULL;
+	stream->fd 	= fd;
+	stream->length 	= info.st_size;
+	stream->offset 	= 0;
+	return 1;
+}
+
+/*--------------------------------------------------
+ * RETURN VALUE (read):
+ 	1: frame completed the message (offset = length)
+ 	0: more of the message to follow
+ 	-1: file write or allocation failed
+ *--------------------------------------------------*/
+int appendStream(struct utp_stream* stream, const char* msg, int32_t size) {
+	int32_t length = size;
+
+	if (stream->fd >= 0) {
+		// Write through, a pipe or terminal may take partial writes.
+		while (size > 0) {
+			ssize_t written = write(stream->fd, msg, size);
+			if (written < 0 && errno == EINTR)
+				continue;
+			if (written <= 0)
+				return -1;
+			msg += written;
+			size -= written;
+		}
+	}
+	else {
+		// Double the memory until the payload and a terminator fit.
+		int64_t needed = stream->offset + size + 1;
+		if (needed > stream->capacity) {
+			int64_t capacity = stream->capacity ? stream->capacity : 256;
+			while (capacity < needed)
+				capacity <<= 1;
+			char* data = realloc(stream->data, capacity);
+			if (!data)
+				return -1;
+			stream->data 	 = data;
+			stream->capacity = capacity;
+		}
+		memcpy(stream->data + stream->offset, msg, size);
+		stream->data[stream->offset + size] = 0;
+	}
+	stream->offset += length;
+	stream->length 	= stream->offset;
+	return 0;
+}
+
+int UTP_READ(struct utp_stream* stream, struct utp_pack* frame) {
+	if (appendStream(stream, frame->msg, frame->size) < 0)
+		return -1;
+	return UTP_FLAG(frame, END) ? 1 : 0;
+}
+
+/*--------------------------------------------------
+ * RETURN VALUE (read record):
+ 	1: the message at offset is in the stream
+ 	0: no message left in the frame
+ 	-1: a length runs past the payload, or the
+ 	    write or allocation failed
+ *--------------------------------------------------*/
+int UTP_READ_RECORD(struct utp_stream* stream, struct utp_pack* frame, int32_t* offset) {
+	if (*offset + UTP_RECORD_HEADER > frame->size)
+		return 0;
+	int32_t length = (int32_t) readNetwork((unsigned char*) frame->msg + *offset, UTP_RECORD_HEADER);
+	if (*offset + UTP_RECORD_HEADER + length > frame->size) {
+		errno = EBADMSG;
+		return -1;
+	}
+	*offset += UTP_RECORD_HEADER + length;
+	return appendStream(stream, frame->msg + *offset - length, length) < 0 ? -1 : 1;
+}
+
+
+//////	Forward error correction
+/*--------------------------------------------------
+ * XOR parity (one loss per group)
+ *--------------------------------------------------
+ * With a negotiated span K, the sender follows K
+ * data frames with one FEC frame. Its seq is the
+ * first of the group, its payload is:
+ 	[1] frames covered (span)
+ 	[2] XOR of their payload sizes
+ 	[1] XOR of their END flags
+ 	[n] XOR of their payloads (zero padded)
+ * Data frames leave UTP_FEC_HEADER bytes of the
+ * payload unused, so parity fits the same frame.
+ * A receiver missing exactly one frame of a group
+ * adds the frames it holds to the parity, which
+ * leaves the missing one. Adding is the same XOR
+ * on both ends, the kernel is vectorized where the
+ * CPU allows it (AVX2, NEON).
+ *--------------------------------------------------*/
+void fecXorSoftware(unsigned char* dst, const unsigned char* src, size_t size) {
+	uint64_t a, b;
+	for (; size >= 8; size -= 8, dst += 8, src += 8) {
+		memcpy(&a, dst, 8);
+		memcpy(&b, src, 8);
+		a ^= b;
+		memcpy(dst, &a, 8);
+	}
+	while (size--)
+		*dst++ ^= *src++;
+}
 
-int UTP_GET_WINDOW_SIZE() {
-	return UTP_WINDOW;
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+void fecXorVector(unsigned char* dst, const unsigned char* src, size_t size) {
+	for (; size >= 32; size -= 32, dst += 32, src += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i*) dst);
+		__m256i b = _mm256_loadu_si256((const __m256i*) src);
+		_mm256_storeu_si256((__m256i*) dst, _mm256_xor_si256(a, b));
+	}
+	fecXorSoftware(dst, src, size);
 }
+#define FEC_VECTOR() __builtin_cpu_supports("avx2")
 
-int UTP_GET_PAYLOAD_SIZE() {
-	return UTP_PAYLOAD;
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+
+void fecXorVector(unsigned char* dst, const unsigned char* src, size_t size) {
+	for (; size >= 16; size -= 16, dst += 16, src += 16)
+		vst1q_u8(dst, veorq_u8(vld1q_u8(dst), vld1q_u8(src)));
+	fecXorSoftware(dst, src, size);
 }
+#define FEC_VECTOR() 1
+
+#else
+#define fecXorVector fecXorSoftware
+#define FEC_VECTOR() 0
+#endif
 
-int UTP_GET_FRAME_SIZE() {
-	return sizeof(struct utp_pack) + (UTP_PAYLOAD * sizeof(char));
+void (*fecXor)(unsigned char*, const unsigned char*, size_t) = NULL;
+pthread_once_t fecOnce = PTHREAD_ONCE_INIT;
+
+void fecProbe() {
+	fecXor = FEC_VECTOR() ? fecXorVector : fecXorSoftware;
 }
 
-int UTP_GET_BUFFER_SIZE(int numFrames) {
-	return UTP_GET_FRAME_SIZE() * numFrames;
+void UTP_FEC_START(struct utp_pack* parity, int64_t seq) {
+	UTP_PACK_PROPERTIES(parity, UTP_FEC_HEADER, seq, FEC);
+	memset(parity->msg, 0, UTP_FEC_HEADER);
 }
 
+void UTP_FEC_ADD(struct utp_pack* parity, struct utp_pack* data) {
+	// (1) a larger payload extends the parity, zero padded.
+	// (2) count the frame, fold its size, END and CAT flags and payload in.
+	unsigned char* head = (unsigned char*) parity->msg;
+	int32_t covered = parity->size - UTP_FEC_HEADER;
+	if (data->size > covered) {
+		memset(head + parity->size, 0, data->size - covered);
+		parity->size = UTP_FEC_HEADER + data->size;
+	}
+	head[0]++;
+	writeNetwork(head + 1, readNetwork(head + 1, 2) ^ (uint16_t) data->size, 2);
+	head[3] ^= data->flags & (END | CAT);
 
-//////	MD5 hash wrappers
-void UTP_MD5_PREPARE(char* md5) {
-	memset(md5, 0, MD5_DIGEST_LENGTH);
+	pthread_once(&fecOnce, fecProbe);
+	fecXor(head + UTP_FEC_HEADER, (const unsigned char*) data->msg, data->size);
 }
 
-void UTP_MD5_ADD(struct utp_pack* frame) {
-	char md5[MD5_DIGEST_LENGTH];
-	UTP_MD5_PREPARE(frame->md5);
-	MD5((unsigned char *) frame, UTP_GET_FRAME_SIZE(), md5);
-	memcpy(frame->md5, md5, MD5_DIGEST_LENGTH);
+int32_t UTP_FEC_SPAN(struct utp_pack* parity) {
+	return parity->size >= UTP_FEC_HEADER ? ((unsigned char*) parity->msg)[0] : 0;
 }
 
-int UTP_MD5_VERIFY(struct utp_pack* frame) {
-	// create a local receive hash.
-	char recv[MD5_DIGEST_LENGTH];
-	UTP_MD5_PREPARE(recv);
+/*--------------------------------------------------
+ * UTP_FEC_REBUILD
+ *--------------------------------------------------
+ * Unpacks the missing frame (seq) from a parity
+ * that all other frames of the group were added to.
+ *
+ * RETURN VALUE:
+ 	1: lost holds the rebuilt frame
+ 	0: the parity is inconsistent (nothing rebuilt)
+ *--------------------------------------------------*/
+int UTP_FEC_REBUILD(struct utp_pack* parity, struct utp_pack* lost, int64_t seq) {
+	unsigned char* head = (unsigned char*) parity->msg;
+	int32_t size = (int32_t) readNetwork(head + 1, 2);
+	if (parity->size < UTP_FEC_HEADER || size > parity->size - UTP_FEC_HEADER)
+		return 0;
+	UTP_PACK_PROPERTIES(lost, size, seq, MSG | (head[3] & (END | CAT)));
+	memcpy(lost->msg, head + UTP_FEC_HEADER, size);
+	lost->time = parity->time;
+	return 1;
+}
 
-	// (1) copy hash from frame.
-	// (2) calculate a local version of the hash.
-	memcpy(recv, frame->md5, MD5_DIGEST_LENGTH);
-	UTP_MD5_ADD(frame);
 
-	// compare the received hash to the local version.
-	return (memcmp(recv, frame->md5, MD5_DIGEST_LENGTH) == 0) ? 1 : 0;
+//////	Telemetry
+/*--------------------------------------------------
+ * Connection statistics
+ *--------------------------------------------------
+ * Counters and histograms are written only by the
+ * thread that owns the connection, with relaxed
+ * atomic stores, so the protocol never waits on a
+ * lock. Any thread may take a snapshot with
+ * UTP_STATS_READ (every field is a 64 bit word,
+ * untorn but not consistent across fields).
+ *
+ * Histogram buckets are exact below 2^UTP_HIST_BITS,
+ * above that each power of two is split into
+ * 2^UTP_HIST_BITS buckets. A percentile reports the
+ * highest value of its bucket.
+ *--------------------------------------------------*/
+void UTP_STAT_ADD(uint64_t* counter, uint64_t amount) {
+	__atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
 }
 
+int32_t histBucket(uint64_t value) {
+	if (value < (1 << UTP_HIST_BITS))
+		return (int32_t) value;
+	int32_t shift = 63 - __builtin_clzll(value) - UTP_HIST_BITS;
+	return ((shift + 1) << UTP_HIST_BITS) + (int32_t) (value >> shift) - (1 << UTP_HIST_BITS);
+}
 
-//////	Timer and timeout
-int64_t UTP_TIME() {
-	struct timeval t;
-	gettimeofday(&t, NULL);
-	return t.tv_sec * 1000000 + t.tv_usec;
+uint64_t histHighest(int32_t bucket) {
+	if (bucket < (1 << UTP_HIST_BITS))
+		return bucket;
+	int32_t  shift = (bucket >> UTP_HIST_BITS) - 1;
+	uint64_t base  = (bucket & ((1 << UTP_HIST_BITS) - 1)) + (1 << UTP_HIST_BITS);
+	return ((base + 1) << shift) - 1;
 }
 
-int64_t UTP_GET_TIMEOUT() {
-	return UTP_TIMEOUT;
+void UTP_HIST_RECORD(struct utp_histogram* hist, int64_t value) {
+	uint64_t v = value > 0 ? (uint64_t) value : 0;
+	v = v < ((uint64_t) 1 << UTP_HIST_RANGE) ? v : ((uint64_t) 1 << UTP_HIST_RANGE) - 1;
+	UTP_STAT_ADD(&hist->buckets[histBucket(v)], 1);
+	UTP_STAT_ADD(&hist->count, 1);
+	UTP_STAT_ADD(&hist->sum, v);
+	if (v > hist->max)
+		__atomic_store_n(&hist->max, v, __ATOMIC_RELAXED);
 }
 
-void UTP_SET_TIMEOUT(int64_t timeout) {
-	UTP_TIMEOUT = timeout;
+int64_t UTP_HIST_PERCENTILE(struct utp_histogram* hist, double percentile) {
+	// Returns -1 for an empty histogram.
+	uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+	if (!count)
+		return -1;
+	uint64_t rank = (uint64_t) (percentile / 100.0 * count + 0.5);
+	uint64_t seen = 0;
+	rank = rank ? rank : 1;
+	for (int32_t i = 0; i < UTP_HIST_BUCKETS; i++) {
+		seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+		if (seen >= rank) {
+			uint64_t high = histHighest(i), max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+			return (int64_t) (high < max ? high : max);
+		}
+	}
+	return (int64_t) __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
 }
 
-int UTP_TIMEOUT_EXPIRED(int64_t timestamp) {
-	int64_t now = UTP_TIME();
-	return (timestamp + UTP_TIMEOUT) < now ? 1 : 0;
+void UTP_STATS_READ(struct utp_conn* conn, struct utp_stats* out) {
+	uint64_t* from = (uint64_t*) &(conn->stats);
+	uint64_t* to   = (uint64_t*) out;
+	for (size_t i = 0; i < sizeof(struct utp_stats) / sizeof(uint64_t); i++)
+		to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+/*--------------------------------------------------
+ * UTP_STATS_FORMAT
+ *--------------------------------------------------
+ * Prints a snapshot as human readable lines.
+ *
+ * RETURN VALUE:
+ 	n: characters written (snprintf semantics)
+ *--------------------------------------------------*/
+int UTP_STATS_FORMAT(struct utp_stats* stats, char* out, int size) {
+	return snprintf(out, size,
+		"Frames sent/received: %lu/%lu (%lu/%lu bytes).\n"
+		"Resent: %lu, NAKs sent/received: %lu/%lu, corrupt: %lu, stalls: %lu, rebuilt: %lu.\n"
+		"RTT p50/p90/p99/max: %ld/%ld/%ld/%ld usec (%lu samples).\n"
+		"Delivery p50/p90/p99/max: %ld/%ld/%ld/%ld usec (%lu messages).\n",
+		stats->framesSent, stats->framesRecv, stats->bytesSent, stats->bytesRecv,
+		stats->resent, stats->naksSent, stats->naksRecv, stats->corrupt, stats->stalls, stats->rebuilt,
+		UTP_HIST_PERCENTILE(&stats->rtt, 50), UTP_HIST_PERCENTILE(&stats->rtt, 90),
+		UTP_HIST_PERCENTILE(&stats->rtt, 99), UTP_HIST_PERCENTILE(&stats->rtt, 100), stats->rtt.count,
+		UTP_HIST_PERCENTILE(&stats->delivery, 50), UTP_HIST_PERCENTILE(&stats->delivery, 90),
+		UTP_HIST_PERCENTILE(&stats->delivery, 99), UTP_HIST_PERCENTILE(&stats->delivery, 100), stats->delivery.count);
+}
+
+
+//////	Round trip estimation
+/*--------------------------------------------------
+ * Jacobson/Karels estimator (RFC 6298)
+ *--------------------------------------------------
+ * The context timeout is only the initial RTO of
+ * a connection. Each RTT sample updates the smoothed
+ * RTT and its variation, which give the new RTO.
+ * A retransmit timeout doubles the RTO until the next
+ * valid sample. Callers must not sample frames that
+ * were retransmitted (Karn's rule) unless the sample
+ * comes from a timestamp echo.
+ *--------------------------------------------------*/
+int64_t rtoClamp(int64_t rto) {
+	return rto < UTP_RTO_MIN ? UTP_RTO_MIN : (rto > UTP_RTO_MAX ? UTP_RTO_MAX : rto);
+}
+
+void UTP_RTT_SAMPLE(struct utp_conn* conn, int64_t rtt) {
+	if (rtt <= 0)
+		return;
+	UTP_HIST_RECORD(&conn->stats.rtt, rtt);
+
+	// First sample seeds the estimator.
+	if (!conn->srtt) {
+		conn->srtt   = rtt;
+		conn->rttvar = rtt / 2;
+	}
+	else {
+		int64_t delta = conn->srtt - rtt;
+		conn->rttvar  = (3 * conn->rttvar + (delta < 0 ? -delta : delta)) / 4;
+		conn->srtt    = (7 * conn->srtt + rtt) / 8;
+	}
+	int64_t spread = 4 * conn->rttvar;
+	conn->rto = rtoClamp(conn->srtt + (spread > UTP_RTO_GRANULARITY ? spread : UTP_RTO_GRANULARITY));
+}
+
+void UTP_RTO_BACKOFF(struct utp_conn* conn) {
+	conn->rto = rtoClamp(conn->rto * 2);
+}
+
+int64_t UTP_GET_RTO(struct utp_conn* conn) {
+	return conn->rto;
+}
+
+int UTP_RTO_EXPIRED(struct utp_conn* conn, int64_t timestamp) {
+	return (timestamp + conn->rto) <= UTP_TIME() ? 1 : 0;
 }
 
 
@@ -138,13 +1511,48 @@ uint8_t UTP_TYPE(uint8_t flags) {
  * This function can be used to prepare a message
  * without a payload, such as an ACK, FIN etc,
  * but also functions as a general preparation call
- * to reset the payload buffer and set up parameters.
+ * to set up parameters. Only frame->size bytes of
+ * the payload are sent, so the rest is left as is.
  *--------------------------------------------------*/
 void UTP_PACK_PROPERTIES(struct utp_pack* frame, int16_t size, int64_t seq, uint8_t flags) {
 	frame->flags 	= flags;
 	frame->size  	= size;
 	frame->seq 	= seq;
-	memset(frame->msg, 0, UTP_PAYLOAD);
+	frame->echo 	= 0;
+}
+
+/*--------------------------------------------------
+ * UTP_PACK_ACK
+ *--------------------------------------------------
+ * Turns a received frame into its acknowledgement,
+ * keeping the sequence number and the timestamp
+ * so the peer gets it echoed back.
+ *--------------------------------------------------*/
+void UTP_PACK_ACK(struct utp_pack* frame, uint8_t flags) {
+	frame->flags 	= flags;
+	frame->size  	= 0;
+}
+
+/*--------------------------------------------------
+ * UTP_PACK_WINDOW
+ *--------------------------------------------------
+ * A SEL ACK starts with the receive window in
+ * frames, counted from its sequence number (the
+ * next one expected). The bitmap follows.
+ *
+ * RETURN VALUE (parse):
+ 	n: advertised window
+ 	-1: frame carries no window
+ *--------------------------------------------------*/
+void UTP_PACK_WINDOW(struct utp_pack* frame, int32_t window) {
+	writeNetwork((unsigned char*) frame->msg, (uint32_t) window, UTP_ACK_WINDOW);
+	frame->size = frame->size > UTP_ACK_WINDOW ? frame->size : UTP_ACK_WINDOW;
+}
+
+int32_t UTP_PARSE_WINDOW(struct utp_pack* frame) {
+	if (!UTP_FLAG(frame, SEL) || frame->size < UTP_ACK_WINDOW)
+		return -1;
+	return (int32_t) readNetwork((unsigned char*) frame->msg, UTP_ACK_WINDOW);
 }
 
 /*--------------------------------------------------
@@ -160,74 +1568,260 @@ void UTP_PACK_PROPERTIES(struct utp_pack* frame, int16_t size, int64_t seq, uint
  * PROPERTIES:
 	frame->seq 	: connection sequence number (seq)
 	frame->flags: SYN-related flags (flags)
- 	frame->size : maximum frame size (psize)
-	frame->msg 	: window size converted to char array (wsize)
+ 	frame->size : handshake payload size
+	frame->msg 	: "psize wsize checksum ackfreq fec" as char array
+
+ * Terms that were added later (ackfreq, fec) are optional
+ * when parsing, so peers that don't send them fall
+ * back to the defaults.
  *--------------------------------------------------*/
-void UTP_PACK_HANDSHAKE(struct utp_pack* frame, int64_t seq, uint8_t flags, int16_t psize, int16_t wsize) {
+void UTP_PACK_HANDSHAKE(struct utp_pack* frame, int64_t seq, uint8_t flags, struct utp_terms* terms) {
 	UTP_PACK_PROPERTIES(frame, UTP_HANDSHAKE_SIZE, seq, flags);
-	frame->size = psize;
-	sprintf(frame->msg, "%d", wsize);
+	snprintf(frame->msg, UTP_HANDSHAKE_SIZE, "%d %d %d %d %d",
+		terms->psize, terms->wsize, terms->checksum, terms->ackfreq, terms->fec);
+}
+
+int UTP_PARSE_HANDSHAKE(struct utp_pack* frame, struct utp_terms* terms) {
+	// Terminate the payload to keep sscanf inside the frame.
+	frame->msg[UTP_HANDSHAKE_SIZE - 1] = 0;
+	terms->ackfreq = UTP_DEFAULT_ACKFREQ;
+	terms->fec 	   = 0;
+	return sscanf(frame->msg, "%d %d %d %d %d",
+		&terms->psize, &terms->wsize, &terms->checksum, &terms->ackfreq, &terms->fec) >= 3;
+}
+
+
+/*--------------------------------------------------
+ * UTP_PACK_PROBE
+ *--------------------------------------------------
+ * A path MTU probe is padding only and carries the
+ * next sequence number without taking it. The peer
+ * answers with the payload size it received, again
+ * under the probe's sequence number.
+ *--------------------------------------------------*/
+void UTP_PACK_PROBE(struct utp_pack* frame, int32_t size, int64_t seq) {
+	UTP_PACK_PROPERTIES(frame, size, seq, PRB | REQ);
+	memset(frame->msg, 0, size);
+}
+
+void UTP_PACK_PROBE_ANSWER(struct utp_pack* frame) {
+	writeNetwork((unsigned char*) frame->msg, (uint16_t) frame->size, 2);
+	UTP_PACK_PROPERTIES(frame, 2, frame->seq, PRB);
+}
+
+int32_t UTP_PARSE_PROBE(struct utp_pack* frame) {
+	return frame->size >= 2 ? (int32_t) readNetwork((unsigned char*) frame->msg, 2) : 0;
 }
 
 
 /*--------------------------------------------------
- * UTP_PACK_MESSAGE
+ * UTP_PACK_STREAM
  *--------------------------------------------------
  * This function prepares a frame as a data message
- * by copying a data stream into the payload buffer,
- * and calculating payload size and flags depending
- * on the number of bytes read from the data stream.
+ * by copying the next payload of a stream into the
+ * payload buffer and advancing the stream offset.
+ * END is flagged on the frame that reaches the end
+ * of the stream. A file that shrank or can't be
+ * read ends the message early.
+ *
+ * UTP_PACK_MESSAGE does the same for a buffer that
+ * fits in one frame or is fragmented by the caller.
+ *
+ * RETURN VALUE:
+ 	n: payload bytes packed
  *--------------------------------------------------*/
-void UTP_PACK_MESSAGE(struct utp_pack* frame, char* stream, int64_t seq, uint8_t flags) {
+int32_t UTP_PACK_STREAM(struct utp_conn* conn, struct utp_pack* frame, struct utp_stream* stream, int64_t seq, uint8_t flags) {
 	// (1) Handle payload overflow.
-	// (2) Append END as flag if message fits in single frame.
-	int msgLength 	= strlen(stream);
-	int overflow 	= (msgLength > UTP_PAYLOAD) ? 1 : 0;
-	int psize 	= overflow ? UTP_PAYLOAD : msgLength;
-	int modflag 	= overflow ? UTP_TYPE(flags) : (END | flags);
+	// (2) Copy from memory or read the file at the offset.
+	// (3) Append END as flag if the rest of the stream fits in this frame.
+	int64_t pending = UTP_STREAM_PENDING(stream);
+	int32_t limit 	= UTP_GET_DATA_SIZE(conn);
+	int32_t psize 	= pending > limit ? limit : (int32_t) pending;
+
+	int32_t size = psize;
+	if (stream->fd >= 0)
+		size = pread(stream->fd, frame->msg, psize, stream->offset);
+	else
+		memcpy(frame->msg, stream->data + stream->offset, psize);
+	if (size < psize) {
+		size = size > 0 ? size : 0;
+		stream->length = stream->offset + size;
+	}
+	stream->offset += size;
+
+	int modflag = UTP_STREAM_PENDING(stream) ? UTP_TYPE(flags) : (END | flags);
+	UTP_PACK_PROPERTIES(frame, size, seq, modflag);
+	return size;
+}
+
+int32_t UTP_PACK_MESSAGE(struct utp_conn* conn, struct utp_pack* frame, const char* data, int32_t length, int64_t seq, uint8_t flags) {
+	struct utp_stream stream;
+	UTP_STREAM_INIT(&stream, -1);
+	UTP_WRITE(&stream, data, length);
+	return UTP_PACK_STREAM(conn, frame, &stream, seq, flags);
+}
 
-	UTP_PACK_PROPERTIES(frame, psize, seq, modflag);
-	memcpy(frame->msg, stream, psize);
+int32_t UTP_PACK_RECORD(char* batch, int32_t used, const char* data, int32_t length) {
+	// Appends a message behind its length, the batch goes out as one CAT frame.
+	writeNetwork((unsigned char*) batch + used, (uint16_t) length, UTP_RECORD_HEADER);
+	memcpy(batch + used + UTP_RECORD_HEADER, data, length);
+	return used + UTP_RECORD_HEADER + length;
 }
 
 
 //////	Message handling
+int acceptFrame(struct utp_conn* conn, struct utp_pack* frame, unsigned char* data, int32_t received) {
+	// (1) decode the header and check the datagram length against it.
+	// (2) verify the checksum over header and payload.
+	// (3) drop frames of other connections sharing the socket.
+	int32_t length 	 = UTP_WIRE_DECODE(conn, frame, data, received);
+	if (!length || received != length + frame->size)
+		return 0;
+	int 	type 	 = wireChecksum(conn, data[0] & 0x0F);
+	if (!UTP_CHECKSUM_VERIFY(type, data, received, data + length - UTP_GET_CHECKSUM_LENGTH(type))) {
+		UTP_STAT_ADD(&conn->stats.corrupt, 1);
+		return 0;
+	}
+	if (conn->id && frame->id != conn->id)
+		return 0;
+	UTP_STAT_ADD(&conn->stats.framesRecv, 1);
+	UTP_STAT_ADD(&conn->stats.bytesRecv, frame->size);
+	if (UTP_TYPE(frame->flags) == NAK)
+		UTP_STAT_ADD(&conn->stats.naksRecv, 1);
+
+	// Header was of another size (handshake, no timestamp), realign the payload.
+	if (data + length != (unsigned char*) frame->msg)
+		memmove(frame->msg, data + length, frame->size);
+
+	// Track the highest peer sequence to extend 32 bit sequence numbers.
+	if (!wireEchoes(frame->flags) && frame->seq > conn->seqPeer)
+		conn->seqPeer = frame->seq;
+	return 1;
+}
+
 /*--------------------------------------------------
  * UTP_RECV
  *--------------------------------------------------
  * RETURN VALUE:
  	1: successful read from socket, checksum verified
  	0: successful read from socket, checksum failed
+ 	0: datagram length does not match frame->size
  	0: timeout
  *--------------------------------------------------*/
 int UTP_RECV(struct utp_conn* conn, struct utp_pack* frame, int timeout) {
 	fd_set  		fdrd = getSelectSet(conn->sock);
 	struct timeval	 	time = getSelectTimeout(timeout);
-	struct sockaddr* 	addr = (struct sockaddr *) &(conn->remote);
-	int32_t 		size = (int32_t) UTP_GET_FRAME_SIZE();
-	int32_t			alen = sizeof(conn->remote);
+	struct sockaddr_in 	from;
+	int32_t			alen = sizeof(from);
+
+	// Receive at the front of the header space, handshake headers are the longest.
+	unsigned char* 		data = frame->wire;
+	int32_t 		size = UTP_WIRE_HEADER_MAX + payloadCapacity(conn);
 
+	// The socket may be shared, only a verified frame tells where the peer is.
 	if (select(conn->sock + 1, &fdrd, NULL, NULL, &time)) {
-		recvfrom(conn->sock, frame, size, 0, addr, &alen);
-		return UTP_MD5_VERIFY(frame);
+		int32_t received = recvfrom(conn->sock, data, size, 0, (struct sockaddr *) &from, &alen);
+		if (!acceptFrame(conn, frame, data, received))
+			return 0;
+		conn->remote = from;
+		return 1;
 	}
 	return 0;
 }
 
+/*--------------------------------------------------
+ * UTP_RECV_BATCH
+ *--------------------------------------------------
+ * Drains up to count datagrams already queued on
+ * the socket with one recvmmsg call, never blocks.
+ * Verified frames are moved to the front of frames
+ * (the pointers are swapped, not the frames).
+ *--------------------------------------------------
+ * RETURN VALUE:
+ 	n: frames[0..n) were received and verified
+ 	0: nothing queued, or nothing passed verification
+ *--------------------------------------------------*/
+int UTP_RECV_BATCH(struct utp_conn* conn, struct utp_pack** frames, int count) {
+	struct mmsghdr 		msgs[UTP_BATCH_MAX];
+	struct iovec 		iovs[2 * UTP_BATCH_MAX];
+	struct sockaddr_in 	from[UTP_BATCH_MAX];
+	unsigned char 		spill[UTP_BATCH_MAX][UTP_WIRE_HEADER_MAX];
+	int32_t 		head = UTP_GET_HEADER_SIZE(conn);
+	int32_t 		room = head + payloadCapacity(conn);
+	int 			valid = 0;
+
+	// Receive where a data frame header in the current format ends at the payload,
+	// the tail of a longer (handshake) header spills into a second buffer.
+	count = count < UTP_BATCH_MAX ? count : UTP_BATCH_MAX;
+	memset(msgs, 0, count * sizeof(struct mmsghdr));
+	for (int i = 0; i < count; i++) {
+		iovs[2*i].iov_base   = (unsigned char*) frames[i]->msg - head;
+		iovs[2*i].iov_len    = room;
+		iovs[2*i+1].iov_base = spill[i];
+		iovs[2*i+1].iov_len  = UTP_WIRE_HEADER_MAX - head;
+		msgs[i].msg_hdr.msg_name    = &from[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+		msgs[i].msg_hdr.msg_iov     = &iovs[2*i];
+		msgs[i].msg_hdr.msg_iovlen  = 2;
+	}
+
+	int received = recvmmsg(conn->sock, msgs, count, MSG_DONTWAIT, NULL);
+	for (int i = 0; i < received; i++) {
+		unsigned char* data = iovs[2*i].iov_base;
+		int32_t length = msgs[i].msg_len;
+
+		// Join a spilled datagram at the front of the header space.
+		if (length > room) {
+			memmove(frames[i]->wire, data, room);
+			memcpy(frames[i]->wire + room, spill[i], length - room);
+			data = frames[i]->wire;
+		}
+		if (!acceptFrame(conn, frames[i], data, length))
+			continue;
+		conn->remote = from[i];
+
+		struct utp_pack* swap = frames[valid];
+		frames[valid++] = frames[i];
+		frames[i] = swap;
+	}
+	return valid;
+}
+
+int32_t encodeForSend(struct utp_conn* conn, struct utp_pack* frame, unsigned char** data) {
+	// (1) stamp and encode the header in front of the payload.
+	// (2) checksum header and payload as they will appear on the wire.
+	frame->time = UTP_TIME();
+	int32_t head = UTP_WIRE_ENCODE(conn, frame);
+	int32_t size = head + frame->size;
+	int 	type = wireChecksum(conn, wireOptions(conn));
+
+	*data = (unsigned char*) frame->msg - head;
+	UTP_CHECKSUM_ADD(type, *data, size, *data + head - UTP_GET_CHECKSUM_LENGTH(type));
+
+	UTP_STAT_ADD(&conn->stats.framesSent, 1);
+	UTP_STAT_ADD(&conn->stats.bytesSent, frame->size);
+	if (UTP_FLAG(frame, RES))
+		UTP_STAT_ADD(&conn->stats.resent, 1);
+	if (UTP_TYPE(frame->flags) == NAK)
+		UTP_STAT_ADD(&conn->stats.naksSent, 1);
+	return size;
+}
+
 
 ////////////////////////////////
 //     CLEAN SEND FUNCTION    //
 ////////////////////////////////
 #ifndef UTP_ERROR
 
-int UTP_SEND(struct utp_conn* conn, struct utp_pack* frame) {
-	struct sockaddr* 	addr = (struct sockaddr *) &(conn->remote);
-	int32_t 		size = (int32_t) UTP_GET_FRAME_SIZE();
-	int32_t			alen = sizeof(conn->remote);
+int transmitFrame(struct utp_conn* conn, struct utp_pack* frame, unsigned char* data, int32_t size) {
+	return 1;
+}
 
-	frame->time = UTP_TIME();
-	UTP_MD5_ADD(frame);
-	return sendto(conn->sock, frame, size, 0, addr, alen);
+int64_t UTP_IMPAIR_FLUSH(struct utp_context* ctx) {
+	return 0;
+}
+
+void UTP_IMPAIR_FREE(struct utp_context* ctx) {
 }
 
 ////////////////////////////////
@@ -235,33 +1829,192 @@ int UTP_SEND(struct utp_conn* conn, struct utp_pack* frame) {
 ////////////////////////////////
 #else
 
-int bonkers = 0;
+/*--------------------------------------------------
+ * Impairment model
+ *--------------------------------------------------
+ * Every decision draws from the context's seeded
+ * generator, so a seed (-seed) and the same frame
+ * sequence give the same losses. On top of the
+ * flat -error chance:
+ 	-loss:    Gilbert-Elliott loss, a burst starts so
+ 	          that the average matches the rate and
+ 	          lasts -burst frames on average
+ 	-corrupt: breaks the checksum
+ 	-delay, -jitter, -reorder:
+ 	          data frames are held on a delay line
+ 	          that the event loop releases when due
+ 	          (UTP_IMPAIR_FLUSH), jitter and held
+ 	          back frames reorder them
+ * Handshake and teardown frames are never held,
+ * they are sent from loops that don't flush.
+ *--------------------------------------------------*/
+struct utp_held {
+	int32_t sock;
+	int32_t size;
+	struct sockaddr_in to;
+	unsigned char data[];
+};
+
+double impairRandom(struct utp_context* ctx) {
+	// xorshift64*, uniform in [0, 1)
+	uint64_t x 	= ctx->seed ? ctx->seed : 1;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	ctx->seed 	= x;
+	return (double) ((x * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
 
-int UTP_SEND(struct utp_conn* conn, struct utp_pack* frame) {
-	struct sockaddr* 	addr = (struct sockaddr *) &(conn->remote);
-	int32_t 		size = (int32_t) UTP_GET_FRAME_SIZE();
-	int32_t			alen = sizeof(conn->remote);
+int impairLoss(struct utp_impair* impair, double chance) {
+	// Gilbert-Elliott: enter a burst with p, leave it with 1 / burst.
+	if (impair->loss <= 0)
+		return 0;
+	double burst = impair->burst > 1 ? impair->burst : 1;
+	double enter = impair->loss >= 1 ? 1 : impair->loss / (burst * (1 - impair->loss));
+	impair->bad  = impair->bad ? chance >= 1 / burst : chance < enter;
+	return impair->bad;
+}
 
-	frame->time = UTP_TIME();
-	UTP_MD5_ADD(frame);
+int64_t impairDelay(struct utp_context* ctx) {
+	struct utp_impair* impair = &(ctx->impair);
+	int64_t hold = impair->delay + (int64_t) (impairRandom(ctx) * impair->jitter);
+	if (impair->reorder > 0 && impairRandom(ctx) < impair->reorder)
+		hold += UTP_IMPAIR_REORDER;
+	return hold;
+}
+
+void impairHold(struct utp_conn* conn, unsigned char* data, int32_t size, int64_t due) {
+	struct utp_timers* line = &(conn->ctx->impair.line);
+	struct utp_held*   held = malloc(sizeof(struct utp_held) + size);
+	if (!held)
+		return;
+	if (!line->capacity)
+		UTP_TIMERS_INIT(line, UTP_BATCH_MAX);
+	held->sock = conn->sock;
+	held->size = size;
+	held->to   = conn->remote;
+	memcpy(held->data, data, size);
+	UTP_TIMER_ADD(line, due, UTP_TIMER_IMPAIR, 0, (int64_t) (intptr_t) held, 0);
+}
+
+int transmitFrame(struct utp_conn* conn, struct utp_pack* frame, unsigned char* data, int32_t size) {
+	// Returns 1 if the datagram goes out now, 0 if the link lost or holds it.
+	int32_t 		length = UTP_GET_CHECKSUM_LENGTH(wireChecksum(conn, wireOptions(conn)));
+	unsigned char* 		sum  = (unsigned char*) frame->msg - length;
+	struct utp_context* 	ctx  = conn->ctx;
+	struct utp_impair* 	impair = &(ctx->impair);
 
 	// break something
-	if ((rand() % 100) + (!bonkers) < bonkers) {
+	// the random state is in the context, threads don't share it
+	if (impairRandom(ctx) * 100 < ctx->bonkers) {
 		// break checksum (cause resend)
-		if ((rand() % 2)) {
-			frame->md5[(rand() % MD5_DIGEST_LENGTH)] += (rand() % 10);
-			return sendto(conn->sock, frame, size, 0, addr, alen);
+		if (impairRandom(ctx) < 0.5 && length) {
+			sum[(int32_t) (impairRandom(ctx) * length)] += 1 + (int) (impairRandom(ctx) * 9);
+			return 1;
 		}
 		// skip the sendto call (cause request)
+		return 0;
 	}
-	else {
-		return sendto(conn->sock, frame, size, 0, addr, alen);
+	if (impairLoss(impair, impairRandom(ctx)))
+		return 0;
+	if (impair->corrupt > 0 && impairRandom(ctx) < impair->corrupt && length)
+		sum[(int32_t) (impairRandom(ctx) * length)] ^= 1 + (int) (impairRandom(ctx) * 255);
+
+	// Hold data frames on the delay line.
+	int dataPhase = conn->compact && conn->state == UTP_STATE_OPEN && !(frame->flags & (SYN | FIN));
+	if (dataPhase && (impair->delay || impair->jitter || impair->reorder > 0)) {
+		impairHold(conn, data, size, UTP_TIME() + impairDelay(ctx));
+		return 0;
 	}
-	return 0;
+	return 1;
+}
+
+int64_t UTP_IMPAIR_FLUSH(struct utp_context* ctx) {
+	// Sends the held datagrams that are due, returns when the next one is (0 if none).
+	struct utp_timers* line = &(ctx->impair.line);
+	struct utp_timer   held;
+	while (UTP_TIMER_POP(line, UTP_TIME(), &held)) {
+		struct utp_held* copy = (struct utp_held*) (intptr_t) held.key;
+		sendto(copy->sock, copy->data, copy->size, 0, (struct sockaddr*) &(copy->to), sizeof(copy->to));
+		free(copy);
+	}
+	return line->count ? line->heap[0].deadline : 0;
+}
+
+void UTP_IMPAIR_FREE(struct utp_context* ctx) {
+	struct utp_timers* line = &(ctx->impair.line);
+	for (int32_t i = 0; i < line->count; i++)
+		free((void*) (intptr_t) line->heap[i].key);
+	if (line->capacity)
+		UTP_TIMERS_FREE(line);
+	memset(line, 0, sizeof(*line));
 }
 
 #endif
 
+int UTP_SEND(struct utp_conn* conn, struct utp_pack* frame) {
+	struct sockaddr* 	addr = (struct sockaddr *) &(conn->remote);
+	int32_t			alen = sizeof(conn->remote);
+	unsigned char* 		data;
+	int32_t 		size = encodeForSend(conn, frame, &data);
+
+	if (!transmitFrame(conn, frame, data, size))
+		return 0;
+
+	// Data sent before the path MTU fell back may fragment, probes never do.
+	int fragment = conn->pmtu.enabled && frame->size > conn->pmtu.size && UTP_TYPE(frame->flags) != PRB;
+	if (fragment)
+		setFragmentation(conn->sock, 1);
+	int sent = sendto(conn->sock, data, size, 0, addr, alen);
+	if (fragment)
+		setFragmentation(conn->sock, 0);
+	return sent;
+}
+
+/*--------------------------------------------------
+ * UTP_SEND_BATCH
+ *--------------------------------------------------
+ * Encodes and sends count frames with as few
+ * sendmmsg calls as possible (UTP_BATCH_MAX each).
+ *--------------------------------------------------
+ * RETURN VALUE:
+ 	n: number of datagrams handed to the kernel
+ *--------------------------------------------------*/
+int UTP_SEND_BATCH(struct utp_conn* conn, struct utp_pack** frames, int count) {
+	struct mmsghdr 		msgs[UTP_BATCH_MAX];
+	struct iovec 		iovs[UTP_BATCH_MAX];
+	int 			sent = 0;
+
+	for (int i = 0; i < count;) {
+		// (1) encode a chunk, leaving out the frames the link drops.
+		// (2) hand the chunk to the kernel, which may take only part of it.
+		int queued = 0;
+		for (; i < count && queued < UTP_BATCH_MAX; i++) {
+			unsigned char* 	data;
+			int32_t 	size = encodeForSend(conn, frames[i], &data);
+			if (!transmitFrame(conn, frames[i], data, size))
+				continue;
+
+			memset(&msgs[queued], 0, sizeof(struct mmsghdr));
+			iovs[queued].iov_base = data;
+			iovs[queued].iov_len  = size;
+			msgs[queued].msg_hdr.msg_name    = &(conn->remote);
+			msgs[queued].msg_hdr.msg_namelen = sizeof(conn->remote);
+			msgs[queued].msg_hdr.msg_iov     = &iovs[queued];
+			msgs[queued].msg_hdr.msg_iovlen  = 1;
+			queued++;
+		}
+		for (int done = 0; done < queued;) {
+			int n = sendmmsg(conn->sock, msgs + done, queued - done, 0);
+			if (n <= 0)
+				return sent;
+			done += n;
+			sent += n;
+		}
+	}
+	return sent;
+}
+
 
 /*******************************************************/
 /* Connect/start and teardown functions using the API  */
@@ -269,12 +2022,12 @@ int UTP_SEND(struct utp_conn* conn, struct utp_pack* frame) {
 //////	Teardown
 int UTP_CLOSE_RECV(struct utp_conn* conn, struct utp_pack* frame) {
 	int countdown = UTP_TEARDOWN_MAX;
-	memset(frame, 0, UTP_GET_FRAME_SIZE());
+	memset(frame, 0, UTP_GET_FRAME_SIZE(conn));
 
 	while(!UTP_FLAG_EXACT(frame, ACK)) {
 		UTP_PACK_PROPERTIES(frame, 0, frame->seq, FIN | ACK);
 		UTP_SEND(conn, frame);
-		UTP_RECV(conn, frame, UTP_GET_TIMEOUT());
+		UTP_RECV(conn, frame, UTP_GET_TIMEOUT(conn));
 		if (countdown-- < 0)
 			return 0;
 	}
@@ -283,13 +2036,13 @@ int UTP_CLOSE_RECV(struct utp_conn* conn, struct utp_pack* frame) {
 
 int UTP_CLOSE_SEND(struct utp_conn* conn, struct utp_pack* frame) {
 	int countdown = UTP_TEARDOWN_MAX;
-	memset(frame, 0, UTP_GET_FRAME_SIZE());
+	memset(frame, 0, UTP_GET_FRAME_SIZE(conn));
 
 	// Send FIN until a FIN|ACK is received.
 	while(!UTP_FLAG_EXACT(frame, FIN | ACK)) {
 		UTP_PACK_PROPERTIES(frame, 0, conn->seqSend++, FIN);
 		UTP_SEND(conn, frame);
-		UTP_RECV(conn, frame, UTP_TIMEOUT);
+		UTP_RECV(conn, frame, UTP_GET_TIMEOUT(conn));
 		if (countdown-- < 0)
 			return 0;
 	}
@@ -301,7 +2054,7 @@ int UTP_CLOSE_SEND(struct utp_conn* conn, struct utp_pack* frame) {
 		UTP_SEND(conn, frame);
 		if (countdown-- < 0)
 			return 0;
-	} while(UTP_RECV(conn, frame, UTP_TIMEOUT) && UTP_FLAG_EXACT(frame, FIN | ACK));
+	} while(UTP_RECV(conn, frame, UTP_GET_TIMEOUT(conn)) && UTP_FLAG_EXACT(frame, FIN | ACK));
 
 	return 1;
 }
@@ -316,83 +2069,219 @@ int cmdParse(char* param, int fallback, int offset, int argc, char* argv[]) {
 	return fallback;
 }
 
+char* cmdParseString(char* param, char* fallback, int offset, int argc, char* argv[]) {
+	for(int i = offset; i + 1 < argc; i++)
+		if (strcmp(argv[i], param) == 0)
+			return argv[i+1];
+	return fallback;
+}
+
+double cmdParseDouble(char* param, double fallback, int offset, int argc, char* argv[]) {
+	char* value = cmdParseString(param, NULL, offset, argc, argv);
+	return value ? atof(value) : fallback;
+}
+
 
-void printHandshake() {
+void printHandshake(struct utp_conn* conn) {
 	// Print handshake parameters (negotiated values)
 	printf("Handshake parameters:\n");
-	printf("Window size: %d frames.\n", ((int) UTP_GET_WINDOW_SIZE()));
-	printf("Frame size: %d bytes.\n", ((int) UTP_GET_FRAME_SIZE()));
-	printf("Payload size: %d bytes.\n", ((int) UTP_GET_PAYLOAD_SIZE()));
+	printf("Window size: %d frames.\n", ((int) UTP_GET_WINDOW_SIZE(conn)));
+	printf("Frame size: %d bytes.\n", ((int) (UTP_GET_HEADER_SIZE(conn) + UTP_GET_PAYLOAD_SIZE(conn))));
+	printf("Payload size: %d bytes.\n", ((int) UTP_GET_PAYLOAD_SIZE(conn)));
+	printf("Header size: %d bytes.\n", ((int) UTP_GET_HEADER_SIZE(conn)));
+	printf("Checksum: %s.\n", UTP_GET_CHECKSUM_NAME(UTP_GET_CHECKSUM(conn)));
+	printf("ACK frequency: %d frames.\n", ((int) UTP_GET_ACK_FREQUENCY(conn)));
+	if (conn->pmtu.enabled)
+		printf("Path MTU probing: from %d bytes.\n", conn->pmtu.size);
+	if (UTP_GET_FEC(conn))
+		printf("Forward error correction: 1 parity per %d frames.\n", UTP_GET_FEC(conn));
 }
 
-void createInconsistency(int argc, char* argv[], int offset) {
+//////	Context
+/*--------------------------------------------------
+ * UTP_CONTEXT_INIT
+ *--------------------------------------------------
+ * Options that are not negotiated: timeout, error
+ * simulation, event loop and server workers. Each
+ * thread needs its own copy, since error injection
+ * advances the random state on every send. Rates of
+ * the impairment model are given in percent.
+ *--------------------------------------------------*/
+void UTP_CONTEXT_INIT(struct utp_context* ctx, int argc, char* argv[]) {
+	ctx->timeout = UTP_DEFAULT_TIMEOUT;
+	ctx->bonkers = 0;
+	ctx->seed    = (uint64_t) (UTP_TIME() ^ getpid());
+	ctx->loop    = UTP_LOOP_BY_NAME(cmdParseString("-loop", NULL, 2, argc, argv), UTP_DEFAULT_LOOP);
+	ctx->workers = cmdParse("-workers", UTP_DEFAULT_WORKERS, 2, argc, argv);
+	ctx->pmtu    = cmdParse("-pmtu", 0, 2, argc, argv);
+	ctx->memory  = (int64_t) cmdParse("-memory", UTP_DEFAULT_MEMORY, 2, argc, argv) << 20;
+	ctx->stats   = (int64_t) cmdParse("-stats", 0, 2, argc, argv) * 1000000;
+	ctx->coalesce = cmdParse("-coalesce", 0, 2, argc, argv);
+	if (ctx->workers < 1) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		ctx->workers = cores > 0 ? (int32_t) cores : 1;
+	}
 #ifdef UTP_ERROR
 	printf("-----------------------------\n");
 	// Seed chance to mess with package on send
-	bonkers	= cmdParse("-error", bonkers, offset, argc, argv);
-	bonkers = bonkers > 99 ? 99 : bonkers;
-	printf("%d%% chance to go bonkers.\n", bonkers);
+	ctx->bonkers = cmdParse("-error", ctx->bonkers, 2, argc, argv);
+	ctx->bonkers = ctx->bonkers > 99 ? 99 : ctx->bonkers;
+	printf("%d%% chance to go bonkers.\n", ctx->bonkers);
+
+	// Impairment model, reproducible once seeded
+	struct utp_impair* impair = &(ctx->impair);
+	memset(impair, 0, sizeof(*impair));
+	ctx->seed 	 = (uint64_t) cmdParseDouble("-seed", (double) ctx->seed, 2, argc, argv);
+	impair->loss 	 = cmdParseDouble("-loss", 0, 2, argc, argv) / 100;
+	impair->burst 	 = cmdParseDouble("-burst", 1, 2, argc, argv);
+	impair->corrupt  = cmdParseDouble("-corrupt", 0, 2, argc, argv) / 100;
+	impair->reorder  = cmdParseDouble("-reorder", 0, 2, argc, argv) / 100;
+	impair->delay 	 = cmdParse("-delay", 0, 2, argc, argv);
+	impair->jitter 	 = cmdParse("-jitter", 0, 2, argc, argv);
+	if (impair->loss > 0 || impair->corrupt > 0 || impair->reorder > 0 || impair->delay || impair->jitter) {
+		printf("Impairment: %.2f%% loss (bursts of %.1f), %.2f%% corrupt, %.2f%% reordered.\n",
+			impair->loss * 100, impair->burst, impair->corrupt * 100, impair->reorder * 100);
+		printf("Delay: %ld usec, jitter %ld usec, seed %lu.\n", impair->delay, impair->jitter, ctx->seed);
+	}
 
 	// Set up default timeout value (slow/fast selective repeat)
-	UTP_SET_TIMEOUT(cmdParse("-timer", UTP_DEFAULT_TIMEOUT, 3, argc, argv));
-	printf("Local timeout in usec: %ld\n", UTP_GET_TIMEOUT());
+	UTP_SET_TIMEOUT(ctx, cmdParse("-timer", UTP_DEFAULT_TIMEOUT, 2, argc, argv));
+	printf("Local timeout in usec: %ld\n", ctx->timeout);
 	printf("-----------------------------\n");
 #endif
 }
 
 
-int UTP_OPEN_RECV(struct utp_conn *conn, int argc, char* argv[]) {
-	int port  = cmdParse("-port",  UTP_DEFAULT_PORT,  2, argc, argv);
-	int wsize = cmdParse("-wsize", UTP_DEFAULT_WSIZE, 2, argc, argv);
-	int psize = cmdParse("-psize", UTP_DEFAULT_PSIZE, 2, argc, argv);
+void parseTerms(struct utp_terms* terms, int offset, int argc, char* argv[]) {
+	// Local offer, taken from the command line (probing the path offers large payloads)
+	int psize 	= cmdParse("-pmtu", 0, offset, argc, argv) ? UTP_PMTU_PSIZE : UTP_DEFAULT_PSIZE;
+	terms->psize 	= cmdParse("-psize",   psize,   	    offset, argc, argv);
+	terms->wsize 	= cmdParse("-wsize",   UTP_DEFAULT_WSIZE,   offset, argc, argv);
+	terms->ackfreq 	= cmdParse("-ackfreq", UTP_DEFAULT_ACKFREQ, offset, argc, argv);
+	terms->fec 	= cmdParse("-fec",     0, 		    offset, argc, argv);
+	terms->checksum = UTP_CHECKSUM_BY_NAME(cmdParseString("-checksum", NULL, offset, argc, argv), UTP_DEFAULT_CHECKSUM);
+}
+
+void agreeTerms(struct utp_conn* conn, struct utp_terms* local, struct utp_terms* peer) {
+	// Sizes from the local and peer offers become the connection's terms.
+	UTP_SET_WINDOW_SIZE(conn, local->wsize, peer->wsize);
+	UTP_SET_PAYLOAD_SIZE(conn, local->psize, peer->psize);
+	UTP_SET_ACK_FREQUENCY(conn, local->ackfreq, peer->ackfreq);
+	UTP_SET_FEC(conn, local->fec, peer->fec);
+	UTP_FORCE_CHECKSUM(conn, UTP_AGREE_CHECKSUM(local->checksum, peer->checksum));
+}
+
+void applyTerms(struct utp_conn* conn) {
+	// Handshake is done, switch to the agreed checksum engine and compact headers.
+	// The RTO starts out at the static timeout until RTT samples arrive.
+	conn->seqPeer = conn->seqRecv;
+	conn->srtt 	  = 0;
+	conn->rttvar  = 0;
+	conn->rto 	  = UTP_GET_TIMEOUT(conn);
+	conn->state   = UTP_STATE_OPEN;
+	conn->rwnd 	  = conn->terms.wsize;
+	UTP_WIRE_COMPACT(conn, 1);
+	UTP_PMTU_INIT(conn, conn->ctx->pmtu);
+}
+
+uint32_t createConnectionId() {
+	// Random enough to keep concurrent clients of a server apart, never 0.
+	uint64_t seed = (uint64_t) UTP_TIME() ^ ((uint64_t) getpid() << 32);
+	seed ^= seed >> 33;
+	seed *= 0xFF51AFD7ED558CCDULL;
+	seed ^= seed >> 33;
+	return (uint32_t) seed ? (uint32_t) seed : 1;
+}
 
-	memset(&(conn->remote), 0, sizeof(conn->remote));
 
-	// Create potential to simulate unstable connection
-	createInconsistency(argc, argv, 2);
+void setupCongestion(struct utp_conn* conn, int offset, int argc, char* argv[]) {
+	// Local sender policy, nothing to negotiate.
+	int algorithm = UTP_CC_BY_NAME(cmdParseString("-cc", NULL, offset, argc, argv), UTP_DEFAULT_CC);
+	int pacing 	  = cmdParse("-pacing", UTP_DEFAULT_PACING, offset, argc, argv);
+	UTP_CC_INIT(conn, algorithm, pacing);
+	printf("Congestion control: %s", UTP_GET_CC_NAME(conn->cc.algorithm));
+	printf(conn->cc.pacing ? ", paced at %d%%.\n" : ".\n", conn->cc.pacing);
+}
+
+int bindSocket(struct sockaddr_in* local, int port, int shared) {
+	// Returns a UDP socket bound to port on all interfaces, -1 on failure.
+	// Shared sockets join a SO_REUSEPORT group, the kernel spreads peers over them.
+	int sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	int on 	 = 1;
+	if (shared)
+		setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	memset(local, 0, sizeof(*local));
+	local->sin_family 	= AF_INET;
+	local->sin_port 	= htons(port);
+	local->sin_addr.s_addr 	= htonl(INADDR_ANY);
+
+	if (bind(sock, (struct sockaddr *) local, sizeof(*local)) < 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+
+/*--------------------------------------------------
+ * Handshake
+ *--------------------------------------------------
+ * Each side repeats its handshake frame with the
+ * same sequence number, so that the data of either
+ * side starts right after it no matter which of the
+ * repeats got through: the client's data follows
+ * its final ACK (SYN seq + 1), the server's data
+ * follows its SYN|ACK.
+ *--------------------------------------------------*/
+int UTP_OPEN_RECV(struct utp_conn *conn, struct utp_context* ctx, int argc, char* argv[]) {
+	int port = cmdParse("-port", UTP_DEFAULT_PORT, 2, argc, argv);
+	struct utp_terms terms, peer;
+	parseTerms(&terms, 2, argc, argv);
 
-	conn->local.sin_family 		= AF_INET;
-	conn->local.sin_port 		= htons(port);
-	conn->local.sin_addr.s_addr 	= htonl(INADDR_ANY);
+	connInit(conn);
+	conn->ctx = ctx;
+	memset(&(conn->remote), 0, sizeof(conn->remote));
 
 	conn->seqSend	= UTP_TIME();
-	conn->sock 	= socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	conn->sock 	= bindSocket(&(conn->local), port, 0);
 
-	if (bind(conn->sock,
-		(struct sockaddr *) &(conn->local),
-		sizeof(conn->local)) < 0 ) {
+	if (conn->sock < 0) {
 		printf("Failed to bind socket.\n");
 		return 1;
 	}
 
-	struct utp_pack* frame = malloc(sizeof(*frame) + UTP_HANDSHAKE_SIZE * sizeof(char));
+	// Handshake frame must hold the negotiated payload as well as the terms.
+	struct utp_pack* frame = calloc(1, sizeof(*frame) + (terms.psize > UTP_HANDSHAKE_SIZE ? terms.psize : UTP_HANDSHAKE_SIZE));
 
 
 	printf("Waiting for connection...\n");
-	// Wait for a SYN from connecting client
-	while(!UTP_FLAG_EXACT(frame, SYN))
-		UTP_RECV(conn, frame, UTP_TIMEOUT);
+	// Wait for a SYN with valid terms from connecting client
+	while(!UTP_FLAG_EXACT(frame, SYN) || !UTP_PARSE_HANDSHAKE(frame, &peer))
+		UTP_RECV(conn, frame, UTP_GET_TIMEOUT(conn));
 
-	// Set up parameters
-	UTP_SET_WINDOW_SIZE(wsize, atoi(frame->msg));
-	UTP_SET_PAYLOAD_SIZE(psize, frame->size);
+	// Set up parameters, the client's data starts after its final ACK.
+	conn->id 	= frame->id;
+	conn->seqRecv 	= frame->seq + 1;
+	conn->seqPeer 	= conn->seqRecv;
+	conn->seqOpen 	= conn->seqSend++;
+	agreeTerms(conn, &terms, &peer);
 
 
 	printf("SYN received.\n");
 	printf("Peer address: %s\n", inet_ntoa(conn->remote.sin_addr));
-	printHandshake();
-	
 	printf("Sending SYNACK to client.\n");
 
-	// Return with a SYNACK and the frame/window size.
+	// Return with a SYNACK and the agreed terms.
 	while(!UTP_FLAG_EXACT(frame, ACK)) {
-		UTP_PACK_HANDSHAKE(frame, conn->seqSend++, (SYN|ACK), UTP_PAYLOAD, UTP_WINDOW);
+		UTP_PACK_HANDSHAKE(frame, conn->seqOpen, (SYN|ACK), &(conn->terms));
 		UTP_SEND(conn, frame);
-		UTP_RECV(conn, frame, UTP_TIMEOUT);
+		UTP_RECV(conn, frame, UTP_GET_TIMEOUT(conn));
 	}
 
-	printf("Final ACK received. Initial sequence: %05hhu\n", ((uint8_t) frame->seq));
-	conn->seqRecv = frame->seq;
+	printf("Final ACK received. Initial sequence: %05hhu\n", ((uint8_t) conn->seqRecv));
+	applyTerms(conn);
+	printHandshake(conn);
+	setupCongestion(conn, 2, argc, argv);
 
 	free(frame);
 	return 0;
@@ -400,69 +2289,346 @@ int UTP_OPEN_RECV(struct utp_conn *conn, int argc, char* argv[]) {
 
 
 
-int UTP_OPEN_SEND(struct utp_conn *conn, int argc, char* argv[]) {
-	int port  = cmdParse("-port",  UTP_DEFAULT_PORT,  3, argc, argv);
-	int wsize = cmdParse("-wsize", UTP_DEFAULT_WSIZE, 3, argc, argv);
-	int psize = cmdParse("-psize", UTP_DEFAULT_PSIZE, 3, argc, argv);
+int UTP_OPEN_SEND(struct utp_conn *conn, struct utp_context* ctx, int argc, char* argv[]) {
+	int port = cmdParse("-port", UTP_DEFAULT_PORT, 3, argc, argv);
+	struct utp_terms terms, peer;
+	parseTerms(&terms, 3, argc, argv);
 
+	connInit(conn);
+	conn->ctx = ctx;
 	memset(&(conn->remote), 0, sizeof(conn->remote));
 
-	// Create potential to simulate unstable connection
-	createInconsistency(argc, argv, 3);
-
 	conn->remote.sin_family 	= AF_INET;
 	conn->remote.sin_port 		= htons(port);
 	conn->remote.sin_addr.s_addr 	= inet_addr(argv[2]);
 
+	conn->id 	= createConnectionId();
 	conn->seqSend	= UTP_TIME();
 	conn->sock 	= socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
 
 	// Set up initial hanshake frame
-	struct utp_pack* frame = malloc(sizeof(*frame) + UTP_HANDSHAKE_SIZE * sizeof(char));
+	struct utp_pack* frame = calloc(1, sizeof(*frame) + (terms.psize > UTP_HANDSHAKE_SIZE ? terms.psize : UTP_HANDSHAKE_SIZE));
 	
 	// Send SYN to server.
 	printf("Connecting to peer...\n");
 	printf("SYN sent to %s...\n", argv[2]);
 	printf("Waiting for SYNACK...\n");
 
-	while (!UTP_FLAG_EXACT(frame, (SYN|ACK))) {
-		UTP_PACK_HANDSHAKE(frame, conn->seqSend++, SYN, psize, wsize);
-		frame->size = psize;
+	int64_t seqSyn = conn->seqSend++;
+	while (!UTP_FLAG_EXACT(frame, (SYN|ACK)) || !UTP_PARSE_HANDSHAKE(frame, &peer)) {
+		UTP_PACK_HANDSHAKE(frame, seqSyn, SYN, &terms);
 		UTP_SEND(conn, frame);
-		UTP_RECV(conn, frame, UTP_TIMEOUT);
+		UTP_RECV(conn, frame, UTP_GET_TIMEOUT(conn));
 	}
 
 	printf("SYNACK received. Initial sequence: %05hhu\n", ((uint8_t) frame->seq));
 
 	// SYNACK received, should contain handshake parameters
-	UTP_SET_WINDOW_SIZE(wsize, atoi(frame->msg));
-	UTP_SET_PAYLOAD_SIZE(psize, frame->size);
-
-	printHandshake();
+	agreeTerms(conn, &terms, &peer);
+	conn->seqRecv = frame->seq;
+	conn->seqOpen = conn->seqSend++;
 
 	do { // Send final ACK while SYN|ACK is still flagged on recv frame.
-		conn->seqRecv = frame->seq;
-		UTP_PACK_HANDSHAKE(frame, conn->seqSend++, ACK, UTP_PAYLOAD, UTP_WINDOW);
+		UTP_PACK_PROPERTIES(frame, 0, conn->seqOpen, ACK);
 		UTP_SEND(conn, frame);
-	} while(UTP_RECV(conn, frame, UTP_TIMEOUT) && UTP_FLAG(frame, (SYN|ACK)));
+	} while(UTP_RECV(conn, frame, UTP_GET_TIMEOUT(conn)) && UTP_FLAG(frame, (SYN|ACK)));
 
 	printf("Sending final ACK...\n");
+	applyTerms(conn);
+	printHandshake(conn);
+	setupCongestion(conn, 3, argc, argv);
 
 	free(frame);
 	return 0;
 }
 
+int UTP_OPEN_REPEAT(struct utp_conn* conn, struct utp_pack* frame) {
+	// The peer repeated its SYN|ACK after we connected, the final ACK was lost.
+	if (!UTP_FLAG_EXACT(frame, (SYN|ACK)))
+		return 0;
+	UTP_PACK_PROPERTIES(frame, 0, conn->seqOpen, ACK);
+	return UTP_SEND(conn, frame);
+}
+
+
+//////	Connection table
+/*--------------------------------------------------
+ * Connection table
+ *--------------------------------------------------
+ * Open addressing with linear probing, the table
+ * doubles at half load. Removal shifts the rest of
+ * the probe run back, so no tombstones are needed.
+ *--------------------------------------------------*/
+uint32_t tableSlot(struct utp_table* table, uint32_t id) {
+	// Fibonacci hashing spreads close IDs over the table.
+	return (uint32_t) (id * 2654435761u) & (table->capacity - 1);
+}
+
+void UTP_TABLE_INIT(struct utp_table* table, int32_t capacity) {
+	table->capacity = 16;
+	while (table->capacity < 2 * capacity)
+		table->capacity <<= 1;
+	table->count = 0;
+	table->slots = calloc(table->capacity, sizeof(struct utp_conn*));
+}
+
+void UTP_TABLE_FREE(struct utp_table* table) {
+	free(table->slots);
+	table->slots = NULL;
+	table->count = table->capacity = 0;
+}
+
+void tableGrow(struct utp_table* table) {
+	struct utp_conn** slots = table->slots;
+	int32_t capacity = table->capacity;
+
+	table->capacity *= 2;
+	table->count 	 = 0;
+	table->slots 	 = calloc(table->capacity, sizeof(struct utp_conn*));
+	for (int32_t i = 0; i < capacity; i++)
+		if (slots[i])
+			UTP_TABLE_ADD(table, slots[i]);
+	free(slots);
+}
+
+int UTP_TABLE_ADD(struct utp_table* table, struct utp_conn* conn) {
+	// Returns 0 if the ID is taken.
+	if (2 * (table->count + 1) > table->capacity)
+		tableGrow(table);
+
+	uint32_t i = tableSlot(table, conn->id);
+	while (table->slots[i]) {
+		if (table->slots[i]->id == conn->id)
+			return 0;
+		i = (i + 1) & (table->capacity - 1);
+	}
+	table->slots[i] = conn;
+	table->count++;
+	return 1;
+}
+
+struct utp_conn* UTP_TABLE_FIND(struct utp_table* table, uint32_t id) {
+	uint32_t i = tableSlot(table, id);
+	while (table->slots[i]) {
+		if (table->slots[i]->id == id)
+			return table->slots[i];
+		i = (i + 1) & (table->capacity - 1);
+	}
+	return NULL;
+}
+
+void UTP_TABLE_REMOVE(struct utp_table* table, uint32_t id) {
+	uint32_t mask = table->capacity - 1;
+	uint32_t i = tableSlot(table, id);
+	while (table->slots[i] && table->slots[i]->id != id)
+		i = (i + 1) & mask;
+	if (!table->slots[i])
+		return;
+
+	// (1) empty the slot.
+	// (2) move back entries of the run that could not reach their home past the hole.
+	table->slots[i] = NULL;
+	table->count--;
+	for (uint32_t j = (i + 1) & mask; table->slots[j]; j = (j + 1) & mask) {
+		uint32_t home = tableSlot(table, table->slots[j]->id);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			table->slots[i] = table->slots[j];
+			table->slots[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+
+//////	Server
+/*--------------------------------------------------
+ * Server
+ *--------------------------------------------------
+ * One socket serves every peer. Frames are routed
+ * by connection ID, a SYN with an unknown ID opens
+ * a connection. The handshake is event driven: the
+ * SYN|ACK is sent on accept and repeated for
+ * repeated SYNs, and the final ACK or any data frame
+ * of the client completes it. Connections are owned
+ * by the caller, the server only indexes them.
+ *--------------------------------------------------*/
+int UTP_SERVER_OPEN(struct utp_server* server, struct utp_context* ctx, int argc, char* argv[]) {
+	// Every worker opens its own server, the kernel does not balance peers
+	// evenly, so the peer limit applies to each of them.
+	int port = cmdParse("-port", UTP_DEFAULT_PORT, 2, argc, argv);
+	parseTerms(&(server->terms), 2, argc, argv);
+
+	server->ctx 	= ctx;
+	server->peers 	= cmdParse("-peers", UTP_DEFAULT_PEERS, 2, argc, argv);
+	server->cc 	= UTP_CC_BY_NAME(cmdParseString("-cc", NULL, 2, argc, argv), UTP_DEFAULT_CC);
+	server->pacing 	= cmdParse("-pacing", UTP_DEFAULT_PACING, 2, argc, argv);
+
+	server->sock = bindSocket(&(server->local), port, ctx->workers > 1);
+	if (server->sock < 0) {
+		printf("Failed to bind socket.\n");
+		return 1;
+	}
+	UTP_TABLE_INIT(&(server->table), server->peers);
+	connInit(&(server->pending));
+	server->pending.ctx  = ctx;
+	server->pending.sock = server->sock;
+	return 0;
+}
+
+void UTP_SERVER_CLOSE(struct utp_server* server) {
+	UTP_TABLE_FREE(&(server->table));
+	close(server->sock);
+}
+
+int UTP_SERVER_REPEAT(struct utp_conn* conn, struct utp_pack* frame) {
+	// (Re)send the SYN|ACK of a connection that is still in its handshake.
+	UTP_PACK_HANDSHAKE(frame, conn->seqOpen, (SYN|ACK), &(conn->terms));
+	return UTP_SEND(conn, frame);
+}
+
+int openFrame(struct utp_conn* conn, struct utp_pack* frame) {
+	// Handshake in progress, returns 1 if the frame is data for the caller.
+	// (1) a repeated SYN lost our SYN|ACK, repeat it.
+	// (2) the final ACK, or data sent after it, completes the handshake.
+	if (UTP_FLAG(frame, SYN)) {
+		UTP_SERVER_REPEAT(conn, frame);
+		return 0;
+	}
+	applyTerms(conn);
+	return !UTP_FLAG_EXACT(frame, ACK);
+}
+
+/*--------------------------------------------------
+ * UTP_SERVER_RECV
+ *--------------------------------------------------
+ * Drains up to count datagrams queued on the server
+ * socket. Verified frames are moved to the front of
+ * frames along with their connection and sender.
+ * conns[i] is NULL for a SYN of an unknown peer.
+ *--------------------------------------------------
+ * RETURN VALUE:
+ 	n: frames[0..n) are for the caller
+ 	0: nothing queued, or nothing for the caller
+ *--------------------------------------------------*/
+int UTP_SERVER_RECV(struct utp_server* server, struct utp_pack** frames, struct utp_conn** conns, struct sockaddr_in* from, int count) {
+	struct mmsghdr 		msgs[UTP_BATCH_MAX];
+	struct iovec 		iovs[UTP_BATCH_MAX];
+	struct sockaddr_in 	addr[UTP_BATCH_MAX];
+	struct utp_terms 	terms;
+	int32_t 		capacity = server->terms.psize > UTP_HANDSHAKE_SIZE ? server->terms.psize : UTP_HANDSHAKE_SIZE;
+	int 			valid = 0;
+
+	// Header sizes differ between peers, receive at the front of the header space.
+	count = count < UTP_BATCH_MAX ? count : UTP_BATCH_MAX;
+	memset(msgs, 0, count * sizeof(struct mmsghdr));
+	for (int i = 0; i < count; i++) {
+		iovs[i].iov_base = frames[i]->wire;
+		iovs[i].iov_len  = UTP_WIRE_HEADER_MAX + capacity;
+		msgs[i].msg_hdr.msg_name    = &addr[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+		msgs[i].msg_hdr.msg_iov     = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen  = 1;
+	}
+
+	int received = recvmmsg(server->sock, msgs, count, MSG_DONTWAIT, NULL);
+	for (int i = 0; i < received; i++) {
+		unsigned char* 	 data = iovs[i].iov_base;
+		uint32_t 	 id   = UTP_WIRE_PEEK_ID(data, msgs[i].msg_len);
+		struct utp_conn* conn = id ? UTP_TABLE_FIND(&(server->table), id) : NULL;
+
+		// Unknown peer, only a SYN with valid terms is of interest.
+		if (!conn) {
+			if (!id || !acceptFrame(&(server->pending), frames[i], data, msgs[i].msg_len) ||
+				!UTP_FLAG_EXACT(frames[i], SYN) || !UTP_PARSE_HANDSHAKE(frames[i], &terms))
+				continue;
+		}
+		else {
+			if (!acceptFrame(conn, frames[i], data, msgs[i].msg_len))
+				continue;
+			conn->remote = addr[i];
+			if (conn->state == UTP_STATE_SYN && !openFrame(conn, frames[i]))
+				continue;
+		}
+
+		struct utp_pack* swap = frames[valid];
+		frames[valid] 	= frames[i];
+		frames[i] 	= swap;
+		conns[valid] 	= conn;
+		from[valid++] 	= addr[i];
+	}
+	return valid;
+}
+
+int UTP_SERVER_ACCEPT(struct utp_server* server, struct utp_conn* conn, struct utp_pack* frame, struct sockaddr_in* from) {
+	// Opens a connection for a SYN of an unknown peer, returns 0 if it is refused.
+	struct utp_terms peer;
+	if (server->table.count >= server->peers || !UTP_PARSE_HANDSHAKE(frame, &peer))
+		return 0;
+
+	// (1) the client's data starts after its final ACK, ours after the SYN|ACK.
+	// (2) agree on terms, the RTO starts at the static timeout.
+	connInit(conn);
+	conn->ctx 	= server->ctx;
+	conn->sock 	= server->sock;
+	conn->local 	= server->local;
+	conn->remote 	= *from;
+	conn->id 	= frame->id;
+	conn->seqRecv 	= frame->seq + 1;
+	conn->seqSend 	= UTP_TIME();
+	conn->seqOpen 	= conn->seqSend++;
+	agreeTerms(conn, &(server->terms), &peer);
+	applyTerms(conn);
+	UTP_WIRE_COMPACT(conn, 0);
+	conn->state 	= UTP_STATE_SYN;
+	UTP_CC_INIT(conn, server->cc, server->pacing);
+
+	if (!UTP_TABLE_ADD(&(server->table), conn))
+		return 0;
+	UTP_SERVER_REPEAT(conn, frame);
+	return 1;
+}
+
+struct utp_conn* UTP_SERVER_FIND(struct utp_server* server, uint32_t id) {
+	return UTP_TABLE_FIND(&(server->table), id);
+}
+
+void UTP_SERVER_DROP(struct utp_server* server, struct utp_conn* conn) {
+	UTP_TABLE_REMOVE(&(server->table), conn->id);
+}
+
 
 
 void UTP_HELP() {
 	printf("UTP Interface Simulation Help:\n");
 	printf("./program server [-flags]\n");
 	printf("./program client <address> [-flags]\n");
+	printf("./program bench [address] [-flags]: Sweep comma separated -wsize, -psize and -timer lists\n");
 	printf("-wsize <num>: Window size\n");
 	printf("-psize <num>: Payload size\n");
 	printf("-port <num>: Port number\n");
+	printf("-checksum <md5|crc32c|xxh64|none>: Checksum engine\n");
+	printf("-ackfreq <num>: Frames per cumulative ACK\n");
+	printf("-fec <num>: One XOR parity frame per num data frames (both peers)\n");
+	printf("-cc <none|newreno|cubic>: Congestion control\n");
+	printf("-pacing <num>: Pacing gain in percent (0 = off)\n");
+	printf("-loop <epoll|select>: Event loop backend\n");
+	printf("-peers <num>: Serve up to num peers on one port, per worker (server)\n");
+	printf("-workers <num>: Server threads sharing the port (0 = one per core)\n");
+	printf("-pmtu <0|1>: Probe the path MTU, grow the payload up to -psize\n");
+	printf("-memory <MB>: Window buffer budget, per worker\n");
+	printf("-stats <sec>: Dump connection statistics every sec seconds and at teardown\n");
+	printf("-coalesce <usec>: Pack small messages into shared frames, none waits longer\n");
+	printf("-send <file>: Send a file, close when it's acknowledged (single peer)\n");
+	printf("-recv <file>: Write received messages to a file (single peer)\n");
+	printf("-workload <bulk|rr>: Benchmark workload (client, bench)\n");
+	printf("-bytes <num>, -count <num>, -size <num>: Bulk size, requests and request size\n");
+	printf("-bench <sink|echo>: Discard or echo the messages of a benchmark (server)\n");
 #ifdef UTP_ERROR
 	printf("-error <num>: Error sim percent\n");
+	printf("-loss <pct>, -burst <frames>: Gilbert-Elliott loss rate and mean burst length\n");
+	printf("-corrupt <pct>, -reorder <pct>: Broken checksums, frames held behind later ones\n");
+	printf("-delay <usec>, -jitter <usec>: Added one-way delay and its spread\n");
+	printf("-seed <num>: Seed of the impairment model (reproducible runs)\n");
 	printf("-timer <num>: Timeout in usec\n");
 #endif
 }
@@ -7,18 +7,31 @@
 #ifndef UTP
 #define UTP
 #define UTP_ERROR 	// Remove this to run clean
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 	// sendmmsg(), recvmmsg()
+#endif
 
 // System headers
 #include <sys/time.h> 	// Sequence number generation
 #include <string.h>	// String comparisons
 #include <stdlib.h>	// Heap allocation
 #include <stdio.h> 	// printf(), fgets()
+#include <unistd.h> 	// close()
+#include <errno.h>
+#include <pthread.h> 	// pthread_once()
+#include <stdatomic.h> 	// Lock-free queues
+#include <sys/stat.h> 	// File stream length
 
 // IP & transport header
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/epoll.h> 	// Event loop backend
+#endif
 
 // Checksum (sudo apt-get install libssl-dev)
 #include <openssl/md5.h>
+#include <stddef.h>
 
 // Bit flags to define type of message
 #define MSG (uint8_t) 0  // 0000 0000
@@ -26,34 +39,218 @@
 #define ACK (uint8_t) 2  // 0000 0010
 #define SYN (uint8_t) 4  // 0000 0100
 #define FIN (uint8_t) 8  // 0000 1000
+#define PRB (uint8_t) 3  // 0000 0011 (path MTU probe, NAK and ACK never combine)
+#define FEC (uint8_t) 5  // 0000 0101 (parity frame, NAK and SYN never combine)
 // Upper flags to parse extra info
 #define END (uint8_t) 16 // 0001 0000
 #define REQ (uint8_t) 32 // 0010 0000
 #define RES (uint8_t) 64 // 0100 0000
+#define SEL (uint8_t) 128// 1000 0000 (selective ACK)
+#define CAT SEL 	 // 1000 0000 (on data: whole messages behind their lengths)
 
 // Default parameters
 #define UTP_DEFAULT_PORT 	5555
 #define UTP_DEFAULT_WSIZE	16
 #define UTP_DEFAULT_PSIZE	32
-#define UTP_DEFAULT_TIMEOUT 	60000
-#define UTP_HANDSHAKE_SIZE 	16
+#define UTP_DEFAULT_TIMEOUT 	60000		// Initial RTO
+#define UTP_RTO_MIN 		2000		// RTO bounds (usec)
+#define UTP_RTO_MAX 		2000000
+#define UTP_RTO_GRANULARITY 	1000		// Timer granularity (RFC 6298 G)
+#define UTP_DUPTHRESH		3		// Frames acknowledged beyond a gap before it is resent
+#define UTP_DEFAULT_ACKFREQ	1		// ACK every frame (no delay)
+#define UTP_DEFAULT_ACK_DELAY	10000		// Max delay of a coalesced ACK
+#define UTP_HANDSHAKE_SIZE 	32
 #define UTP_TEARDOWN_MAX 	16
+#define UTP_BATCH_MAX 		64		// Datagrams per sendmmsg/recvmmsg call
+#define UTP_DEFAULT_PEERS	1		// Concurrent peers of a server
+#define UTP_DEFAULT_WORKERS	1		// Server threads sharing the port (0 = one per core)
+#define UTP_WINDOW_MAX		4096		// Largest window a receiver advertises (frames)
+#define UTP_DEFAULT_MEMORY	64		// Window buffer budget of a thread (MB)
+#define UTP_ACK_WINDOW		4		// SEL ACK payload: advertised window, then the bitmap
+#define UTP_FEC_HEADER		4		// Parity payload: span, sizes and END/CAT flags, then the XOR
+#define UTP_FEC_MAX		64		// Largest group of data frames behind one parity frame
+#define UTP_RECORD_HEADER	2		// Length in front of each message of a CAT frame
+
+// Path MTU search (DPLPMTUD, RFC 8899)
+#define UTP_IP_UDP_HEADER	28		// IPv4 and UDP headers of a datagram
+#define UTP_PMTU_BASE		1200		// Datagram any path carries (BASE_PLPMTU)
+#define UTP_PMTU_PSIZE		8192		// Payload offered when probing without -psize
+#define UTP_PMTU_STEP		16		// Search is done when the bounds are this close
+#define UTP_PMTU_PROBES		3		// Unanswered probes before a size fails (MAX_PROBES)
+#define UTP_PMTU_RAISE		600000000	// Search again for a larger path MTU (usec)
+#define UTP_PMTU_BLACKHOLE	3		// Timeouts in a row before falling back to the floor
+
+// Checksum engines (negotiated in handshake)
+#define UTP_CHECKSUM_MD5	0
+#define UTP_CHECKSUM_CRC32C	1
+#define UTP_CHECKSUM_XXH64	2
+#define UTP_CHECKSUM_NONE	3
+#define UTP_CHECKSUM_COUNT	4
+#define UTP_CHECKSUM_LENGTH	MD5_DIGEST_LENGTH	// Widest digest
+#define UTP_HANDSHAKE_CHECKSUM	UTP_CHECKSUM_MD5	// Used until terms are agreed
+#define UTP_DEFAULT_CHECKSUM	UTP_CHECKSUM_CRC32C
+
+/*--------------------------------------------------
+ * Wire header (version 1, network byte order)
+ *--------------------------------------------------
+ 	[1] version (upper nibble) | options (lower nibble)
+ 	[1] flags
+ 	[2] payload size
+ 	[4] connection ID (UTP_WIRE_CONNID only)
+ 	[4] sequence number, low 32 bits (8 with UTP_WIRE_LONGSEQ)
+ 	[4] timestamp or timestamp echo (UTP_WIRE_TIME only)
+ 	[n] checksum, length given by the negotiated engine
+ *--------------------------------------------------
+ * Long sequence headers belong to the handshake and
+ * are always covered by UTP_HANDSHAKE_CHECKSUM.
+ *--------------------------------------------------*/
+#define UTP_WIRE_VERSION	1
+#define UTP_WIRE_TIME		(uint8_t) 1	// Timestamp field present
+#define UTP_WIRE_LONGSEQ	(uint8_t) 2	// Full 64 bit sequence (handshake)
+#define UTP_WIRE_CONNID		(uint8_t) 4	// Connection ID present
+#define UTP_WIRE_HEADER_MAX	(4 + 4 + 8 + 4 + UTP_CHECKSUM_LENGTH)
+
+// Connection states
+#define UTP_STATE_SYN		1		// SYN|ACK sent, waiting for the final ACK
+#define UTP_STATE_OPEN		2		// Handshake done
+#define UTP_STATE_FIN		3		// FIN|ACK sent, waiting for the final ACK
 
 // Frame structure (package)
 struct utp_pack {
 	int16_t size;				// Payload size
 	int64_t seq;				// Sequence number
-	int64_t time;				// Timestamp
+	int64_t time;				// Local send/receive timestamp
+	int64_t echo;				// Timestamp carried on the wire
 	uint8_t flags;				// Flags bit field
-	char 	md5[MD5_DIGEST_LENGTH]; 	// Checksum
+	uint32_t id;				// Connection ID carried on the wire (0 if none)
+	unsigned char wire[UTP_WIRE_HEADER_MAX];// Encoded header, ends at payload
 	char	msg[];				// Dynamic payload
 };
 
+// Congestion state
+struct utp_cwnd {
+	int32_t algorithm;			// Congestion controller
+	double	cwnd;				// Congestion window (frames)
+	double	ssthresh;			// Slow start threshold (frames)
+	int64_t recover;			// Losses below this seq belong to the last reduction
+	double	wmax;				// CUBIC: window before the last reduction
+	int64_t epoch;				// CUBIC: start of the current growth epoch
+	int32_t pacing;				// Pacing gain in percent (0 = off)
+	int64_t paceNext;			// Earliest send time of the next paced frame
+};
+
+// Path MTU search of the sender
+struct utp_pmtu {
+	int32_t enabled;			// Probing on (-pmtu)
+	int32_t size;				// Payload of new data frames
+	int32_t floor;				// Payload that fits the base datagram
+	int32_t ceiling;			// Negotiated payload, what frame buffers hold
+	int32_t failed;				// Smallest payload without an answer (0 if none)
+	int32_t probe;				// Payload of the probe in flight (0 if none)
+	int32_t attempts;			// Unanswered probes of that payload
+	int32_t timeouts;			// Retransmit timeouts since the last ACK
+	int64_t sent;				// Send time of the probe in flight
+	int64_t next;				// Earliest time of the next search
+};
+
+// Handshake terms (local offer, peer offer or agreed values)
+struct utp_terms {
+	int32_t psize;				// Payload size
+	int32_t wsize;				// Window size
+	int32_t checksum;			// Checksum engine
+	int32_t ackfreq;			// Frames per cumulative ACK
+	int32_t fec;				// Data frames per parity frame (0 = off)
+};
+
+// Timer (min-heap entry)
+struct utp_timer {
+	int64_t deadline;			// Expiry (UTP_TIME)
+	uint32_t id;				// Connection ID of the owner
+	int64_t key;				// Owner defined, e.g. a sequence number
+	int64_t stamp;				// Owner defined tag to detect stale timers
+	uint8_t kind;				// Timer kind
+};
+
+// Timer min-heap ordered by deadline
+struct utp_timers {
+	struct utp_timer* heap;
+	int32_t count;
+	int32_t capacity;
+};
+
+// Seeded link impairment of the sender (UTP_ERROR builds), reproducible for a given seed
+#define UTP_IMPAIR_REORDER	1000		// Extra hold of a reordered datagram (usec)
+struct utp_impair {
+	double 	loss;				// Average loss rate (0..1)
+	double 	burst;				// Mean loss burst length (Gilbert-Elliott, 1 = independent)
+	double 	corrupt;			// Chance to break the checksum
+	double 	reorder;			// Chance to hold a datagram back behind later ones
+	int64_t delay;				// Added one-way delay (usec)
+	int64_t jitter;				// Uniform spread on top of the delay (usec)
+	int 	bad;				// In a loss burst
+	struct utp_timers line;			// Held datagrams by due time (key is the copy)
+};
+
+// Process options, shared by the connections of one thread
+struct utp_context {
+	int64_t timeout;			// Static timeout, initial RTO (usec)
+	int32_t bonkers;			// Chance in percent to break a sent frame
+	uint64_t seed;				// Error injection state (xorshift64*, -seed)
+	struct utp_impair impair;		// Loss, corruption, reordering and delay
+	int32_t loop;				// Event loop backend
+	int32_t workers;			// Server threads (SO_REUSEPORT)
+	int32_t pmtu;				// Probe the path MTU (sender)
+	int64_t memory;				// Window buffer budget (bytes)
+	int64_t stats;				// Statistics dump interval (usec, 0 = off)
+	int64_t coalesce;			// Longest a small message waits for others (usec, 0 = off)
+};
+
+// Log-linear latency histogram (HDR style, usec), 2^UTP_HIST_BITS buckets per power of two
+#define UTP_HIST_BITS		3		// 12.5% resolution
+#define UTP_HIST_RANGE		32		// Values up to 2^32 - 1, larger ones are clamped
+#define UTP_HIST_BUCKETS	((UTP_HIST_RANGE - UTP_HIST_BITS + 1) << UTP_HIST_BITS)
+struct utp_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[UTP_HIST_BUCKETS];
+};
+
+// Connection statistics, only 64 bit words (written by the owning thread, read by any)
+struct utp_stats {
+	uint64_t framesSent;			// Frames handed to the link (resends included)
+	uint64_t bytesSent;			// Payload bytes of those frames
+	uint64_t framesRecv;			// Frames accepted (checksum verified)
+	uint64_t bytesRecv;
+	uint64_t resent;			// Retransmissions (RES)
+	uint64_t naksSent;			// Requests of missing frames (NAK|REQ)
+	uint64_t naksRecv;
+	uint64_t corrupt;			// Checksum failures
+	uint64_t stalls;			// Times sending stopped at a full window
+	uint64_t rebuilt;			// Frames rebuilt from parity
+	struct utp_histogram rtt;		// Round trip samples
+	struct utp_histogram delivery;		// First frame of a message to its delivery
+};
+
 // Connection tracker
 struct utp_conn {
+	struct utp_context* ctx;		// Options of the owning thread
 	int32_t sock;				// Store socket ID
+	uint32_t id;				// Connection ID (0 until known)
+	int32_t state;				// UTP_STATE_*
+	int32_t compact;			// Compact data headers (after handshake)
+	struct utp_terms terms;			// Negotiated terms
 	int64_t seqSend;			// Init sequence
 	int64_t seqRecv;			// Init sequence
+	int64_t seqOpen;			// Sequence of the own last handshake frame
+	int64_t seqPeer;			// Highest peer sequence (wire decoding)
+	int64_t srtt;				// Smoothed round trip time (usec)
+	int64_t rttvar;				// Round trip time variation
+	int64_t rto;				// Retransmission timeout
+	struct utp_cwnd cc;			// Congestion control
+	struct utp_pmtu pmtu;			// Path MTU search
+	int32_t rwnd;				// Receive window the peer advertised (frames)
+	struct utp_stats stats;			// Telemetry
 	struct sockaddr_in local;		// Local address
 	struct sockaddr_in remote;		// Remote address
 };
@@ -66,35 +263,250 @@ struct utp_tracker {
 	int64_t recvNext;			// Offset from init seq
 };
 
-// Window buffers
+// Ring of pool frames, indexed by seq modulo capacity (a power of two)
+struct utp_ring {
+	struct utp_pack** slots;
+	int32_t mask;				// Capacity - 1
+};
+
+// Window buffers, they grow while the window does
 struct utp_window {
-	struct utp_pack* send;			// Store sent frames
-	struct utp_pack* recv;			// Store recv frames
-	struct utp_pack* acks;			// Store acks for sent frames
+	struct utp_ring send;			// Store sent frames
+	struct utp_ring recv;			// Store recv frames
+	uint64_t* 	acks;			// Bitmap of acknowledged sent frames (send slots)
+};
+
+// Connection table, open addressing keyed by connection ID
+struct utp_table {
+	struct utp_conn** slots;
+	int32_t count;
+	int32_t capacity;			// Power of two
+};
+
+// Server, one socket shared by all peers
+struct utp_server {
+	struct utp_context* ctx;		// Options of the owning thread
+	int32_t sock;				// Listening socket (SO_REUSEPORT with workers)
+	struct sockaddr_in local;		// Local address
+	struct utp_terms terms;			// Local offer
+	int32_t peers;				// Connection limit
+	int32_t cc;				// Congestion controller of new connections
+	int32_t pacing;				// Pacing gain of new connections
+	struct utp_table table;			// Connections by ID
+	struct utp_conn pending;		// Decodes frames of unknown connections
+};
+
+// Congestion controllers
+#define UTP_CC_NONE		0		// Fixed window (negotiated size)
+#define UTP_CC_NEWRENO		1
+#define UTP_CC_CUBIC		2
+#define UTP_CC_COUNT		3
+#define UTP_CC_INITIAL		4		// Initial congestion window (frames)
+#define UTP_DEFAULT_CC		UTP_CC_NEWRENO
+#define UTP_DEFAULT_PACING	0		// Pacing gain in percent (0 = off)
+
+// Event loop backends
+#define UTP_LOOP_SELECT		0
+#define UTP_LOOP_EPOLL		1
+#define UTP_LOOP_COUNT		2
+#define UTP_LOOP_FDS		8		// Descriptors per event loop
+#ifdef __linux__
+#define UTP_DEFAULT_LOOP	UTP_LOOP_EPOLL
+#else
+#define UTP_DEFAULT_LOOP	UTP_LOOP_SELECT
+#endif
+
+// Timer kinds
+#define UTP_TIMER_RESEND	1		// Retransmit an unacknowledged frame
+#define UTP_TIMER_REQUEST	2		// Request frames missing in a gap
+#define UTP_TIMER_ACK		3		// Send a delayed ACK
+#define UTP_TIMER_PACE		4		// Release the next paced frame
+#define UTP_TIMER_HANDSHAKE	5		// Repeat SYN|ACK or give up on a peer
+#define UTP_TIMER_CLOSE		6		// Repeat FIN|ACK or forget a peer
+#define UTP_TIMER_PROBE		7		// Give up on a path MTU probe
+#define UTP_TIMER_STATS		8		// Dump the statistics of a connection
+#define UTP_TIMER_IMPAIR	9		// Release datagrams held by the impairment model
+#define UTP_TIMER_COALESCE	10		// Send the small messages held back for a frame
+
+// Event loop, readable descriptors are listed in ready after a wait
+struct utp_loop {
+	int 	backend;			// UTP_LOOP_*
+	int 	fd;				// epoll instance (-1 with select)
+	int 	count;				// Watched descriptors
+	int 	fds[UTP_LOOP_FDS];
+	int 	steady[UTP_LOOP_FDS];		// Always readable (regular files)
+	int 	readyCount;
+	int 	ready[UTP_LOOP_FDS];
+};
+
+// Bounded single-producer/single-consumer queue of fixed size slots
+#define UTP_CACHE_LINE		64
+struct utp_queue {
+	char* 	slots;				// Length prefix and data of each entry
+	int32_t slotSize;			// Largest entry in bytes
+	int32_t mask;				// Capacity - 1 (power of two)
+	_Alignas(UTP_CACHE_LINE) _Atomic int64_t head;	// Next entry to pop (consumer)
+	_Alignas(UTP_CACHE_LINE) _Atomic int64_t tail;	// Next entry to push (producer)
+	char 	pad[UTP_CACHE_LINE - sizeof(int64_t)];
+};
+
+// Cache line aligned frames of one size, handed out by pointer
+struct utp_pool {
+	int32_t stride;				// Frame size rounded up to a cache line
+	int32_t chunk;				// Frames allocated at a time
+	int32_t total;				// Frames allocated
+	struct utp_pack** spare;		// Frames to hand out (stack of total)
+	int32_t spareCount;
+	void** 	chunks;				// Allocations, released with the pool
+	int32_t chunkCount;
+};
+
+// Byte stream of one message, fragmented or reassembled at an offset
+struct utp_stream {
+	char* 	data;				// Memory of the message (unused for a file)
+	int 	fd;				// File of the message (-1 for memory)
+	int64_t length;				// Bytes in the message (source)
+	int64_t offset;				// Next byte to fragment (source) or to append (sink)
+	int64_t capacity;			// Allocated sink memory (0 if not owned)
+};
+
+// Checksum engine
+struct utp_checksum {
+	const char* name;			// Name used on command line
+	int32_t	length;				// Digest length in bytes
+	void	(*digest)(const unsigned char* data, size_t size, unsigned char* out);
+};
+
+// Congestion controller
+struct utp_congestion {
+	const char* name;			// Name used on command line
+	void	(*ack)(struct utp_cwnd* cc, int32_t acked, int64_t srtt);
+	void	(*loss)(struct utp_cwnd* cc);
 };
 
 /*******************************************************/
 //////	Payload & window size setting/getting
-void 	UTP_FORCE_WINDOW_SIZE(int size);
-void 	UTP_FORCE_PAYLOAD_SIZE(int size);
+void 	UTP_FORCE_WINDOW_SIZE(struct utp_conn* conn, int size);
+void 	UTP_FORCE_PAYLOAD_SIZE(struct utp_conn* conn, int size);
+
+void 	UTP_SET_WINDOW_SIZE(struct utp_conn* conn, int recvSize, int sendSize);
+void 	UTP_SET_PAYLOAD_SIZE(struct utp_conn* conn, int recvSize, int sendSize);
 
-void 	UTP_SET_WINDOW_SIZE(int recvSize, int sendSize);
-void 	UTP_SET_PAYLOAD_SIZE(int recvSize, int sendSize);
+void 	UTP_SET_ACK_FREQUENCY(struct utp_conn* conn, int recvFreq, int sendFreq);
+int 	UTP_GET_ACK_FREQUENCY(struct utp_conn* conn);
+void 	UTP_SET_FEC(struct utp_conn* conn, int recvSpan, int sendSpan);
+int 	UTP_GET_FEC(struct utp_conn* conn);
+int64_t UTP_GET_ACK_DELAY(struct utp_conn* conn);
 
-int 	UTP_GET_WINDOW_SIZE();
-int 	UTP_GET_FRAME_SIZE();
-int 	UTP_GET_PAYLOAD_SIZE();
+int 	UTP_GET_WINDOW_SIZE(struct utp_conn* conn);
+int 	UTP_GET_HEADER_SIZE(struct utp_conn* conn);
+int 	UTP_GET_FRAME_SIZE(struct utp_conn* conn);
+int 	UTP_GET_PAYLOAD_SIZE(struct utp_conn* conn);
+int32_t UTP_GET_DATA_SIZE(struct utp_conn* conn);
 
-//////	MD5 hash wrappers
-void 	UTP_MD5_PREPARE(char* md5);
-void 	UTP_MD5_ADD(struct utp_pack* frame);
-int 	UTP_MD5_VERIFY(struct utp_pack* frame);
+//////	Checksum engine
+void 	UTP_FORCE_CHECKSUM(struct utp_conn* conn, int type);
+int 	UTP_AGREE_CHECKSUM(int recvType, int sendType);
+int 	UTP_GET_CHECKSUM(struct utp_conn* conn);
+int 	UTP_GET_CHECKSUM_LENGTH(int type);
+const char* UTP_GET_CHECKSUM_NAME(int type);
+int 	UTP_CHECKSUM_BY_NAME(char* name, int fallback);
+
+void 	UTP_CHECKSUM_PREPARE(int type, unsigned char* sum);
+void 	UTP_CHECKSUM_ADD(int type, unsigned char* data, int32_t length, unsigned char* sum);
+int 	UTP_CHECKSUM_VERIFY(int type, unsigned char* data, int32_t length, unsigned char* sum);
+
+//////	Wire format
+void 	UTP_WIRE_COMPACT(struct utp_conn* conn, int enable);
+int32_t UTP_WIRE_ENCODE(struct utp_conn* conn, struct utp_pack* frame);
+int32_t UTP_WIRE_DECODE(struct utp_conn* conn, struct utp_pack* frame, unsigned char* data, int32_t length);
+uint32_t UTP_WIRE_PEEK_ID(unsigned char* data, int32_t length);
+
+//////	Context
+void 	UTP_CONTEXT_INIT(struct utp_context* ctx, int argc, char* argv[]);
+
+//////	Link impairment
+int64_t UTP_IMPAIR_FLUSH(struct utp_context* ctx);
+void 	UTP_IMPAIR_FREE(struct utp_context* ctx);
 
 //////	Timer and timeout
 int64_t UTP_TIME();
-int64_t UTP_GET_TIMEOUT();
-void 	UTP_SET_TIMEOUT(int64_t timeout);
-int 	UTP_TIMEOUT_EXPIRED(int64_t timestamp);
+int64_t UTP_GET_TIMEOUT(struct utp_conn* conn);
+void 	UTP_SET_TIMEOUT(struct utp_context* ctx, int64_t timeout);
+int 	UTP_TIMEOUT_EXPIRED(struct utp_conn* conn, int64_t timestamp);
+
+//////	Congestion control
+void 	UTP_CC_INIT(struct utp_conn* conn, int algorithm, int pacing);
+int 	UTP_CC_BY_NAME(char* name, int fallback);
+const char* UTP_GET_CC_NAME(int algorithm);
+void 	UTP_CC_ACK(struct utp_conn* conn, int32_t acked);
+void 	UTP_CC_LOSS(struct utp_conn* conn, int64_t seq, int timeout);
+int32_t UTP_CC_WINDOW(struct utp_conn* conn);
+int64_t UTP_CC_PACE(struct utp_conn* conn, int64_t now);
+
+//////	Path MTU
+void 	UTP_PMTU_INIT(struct utp_conn* conn, int enable);
+int32_t UTP_PMTU_PROBE(struct utp_conn* conn, int64_t now);
+int 	UTP_PMTU_CONFIRM(struct utp_conn* conn, int32_t size);
+void 	UTP_PMTU_LOST(struct utp_conn* conn, int64_t sent, int tooBig);
+void 	UTP_PMTU_ACK(struct utp_conn* conn);
+int 	UTP_PMTU_TIMEOUT(struct utp_conn* conn);
+
+//////	Timers
+void 	UTP_TIMERS_INIT(struct utp_timers* timers, int32_t capacity);
+void 	UTP_TIMERS_FREE(struct utp_timers* timers);
+void 	UTP_TIMER_ADD(struct utp_timers* timers, int64_t deadline, uint8_t kind, uint32_t id, int64_t key, int64_t stamp);
+int 	UTP_TIMER_POP(struct utp_timers* timers, int64_t now, struct utp_timer* timer);
+struct timeval* UTP_TIMER_WAIT(struct utp_timers* timers, struct timeval* wait);
+
+//////	Event loop
+void 	UTP_LOOP_INIT(struct utp_loop* loop, int backend);
+void 	UTP_LOOP_FREE(struct utp_loop* loop);
+int 	UTP_LOOP_WATCH(struct utp_loop* loop, int fd);
+int 	UTP_LOOP_WAIT(struct utp_loop* loop, struct utp_timers* timers);
+int 	UTP_LOOP_READY(struct utp_loop* loop, int fd);
+int 	UTP_LOOP_BY_NAME(char* name, int fallback);
+const char* UTP_GET_LOOP_NAME(int backend);
+
+//////	Queues
+int 	UTP_QUEUE_INIT(struct utp_queue* queue, int32_t capacity, int32_t slotSize);
+void 	UTP_QUEUE_FREE(struct utp_queue* queue);
+int32_t UTP_QUEUE_PUSH(struct utp_queue* queue, const void* data, int32_t size);
+int32_t UTP_QUEUE_POP(struct utp_queue* queue, void* data);
+
+//////	Frame pool
+void 	UTP_POOL_INIT(struct utp_pool* pool, int32_t frameSize, int32_t chunk);
+void 	UTP_POOL_FREE(struct utp_pool* pool);
+struct utp_pack* UTP_POOL_TAKE(struct utp_pool* pool);
+void 	UTP_POOL_GIVE(struct utp_pool* pool, struct utp_pack* frame);
+
+//////	Streams
+void 	UTP_STREAM_INIT(struct utp_stream* stream, int fd);
+void 	UTP_STREAM_FREE(struct utp_stream* stream);
+int64_t UTP_STREAM_PENDING(struct utp_stream* stream);
+int 	UTP_WRITE(struct utp_stream* stream, const void* data, int64_t length);
+int 	UTP_WRITE_FILE(struct utp_stream* stream, int fd);
+int 	UTP_READ(struct utp_stream* stream, struct utp_pack* frame);
+int 	UTP_READ_RECORD(struct utp_stream* stream, struct utp_pack* frame, int32_t* offset);
+
+//////	Forward error correction
+void 	UTP_FEC_START(struct utp_pack* parity, int64_t seq);
+void 	UTP_FEC_ADD(struct utp_pack* parity, struct utp_pack* data);
+int32_t UTP_FEC_SPAN(struct utp_pack* parity);
+int 	UTP_FEC_REBUILD(struct utp_pack* parity, struct utp_pack* lost, int64_t seq);
+
+//////	Telemetry
+void 	UTP_STAT_ADD(uint64_t* counter, uint64_t amount);
+void 	UTP_HIST_RECORD(struct utp_histogram* hist, int64_t value);
+int64_t UTP_HIST_PERCENTILE(struct utp_histogram* hist, double percentile);
+void 	UTP_STATS_READ(struct utp_conn* conn, struct utp_stats* out);
+int 	UTP_STATS_FORMAT(struct utp_stats* stats, char* out, int size);
+
+//////	Round trip estimation
+void 	UTP_RTT_SAMPLE(struct utp_conn* conn, int64_t rtt);
+void 	UTP_RTO_BACKOFF(struct utp_conn* conn);
+int64_t UTP_GET_RTO(struct utp_conn* conn);
+int 	UTP_RTO_EXPIRED(struct utp_conn* conn, int64_t timestamp);
 
 //////	Flags
 int 	UTP_FLAG(struct utp_pack* frame, uint8_t option);
@@ -104,19 +516,47 @@ uint8_t UTP_TYPE(uint8_t flags);
 
 //////	Pack preparation
 void 	UTP_PACK_PROPERTIES(struct utp_pack* frame, int16_t size, int64_t seq, uint8_t flags);
-void 	UTP_PACK_HANDSHAKE(struct utp_pack* frame, int64_t seq, uint8_t flags, int16_t psize, int16_t wsize);
-void 	UTP_PACK_MESSAGE(struct utp_pack* frame, char* msg, int64_t seq, uint8_t flags);
+void 	UTP_PACK_HANDSHAKE(struct utp_pack* frame, int64_t seq, uint8_t flags, struct utp_terms* terms);
+int 	UTP_PARSE_HANDSHAKE(struct utp_pack* frame, struct utp_terms* terms);
+void 	UTP_PACK_PROBE(struct utp_pack* frame, int32_t size, int64_t seq);
+void 	UTP_PACK_PROBE_ANSWER(struct utp_pack* frame);
+int32_t UTP_PARSE_PROBE(struct utp_pack* frame);
+void 	UTP_PACK_ACK(struct utp_pack* frame, uint8_t flags);
+void 	UTP_PACK_WINDOW(struct utp_pack* frame, int32_t window);
+int32_t UTP_PARSE_WINDOW(struct utp_pack* frame);
+int32_t UTP_PACK_MESSAGE(struct utp_conn* conn, struct utp_pack* frame, const char* data, int32_t length, int64_t seq, uint8_t flags);
+int32_t UTP_PACK_STREAM(struct utp_conn* conn, struct utp_pack* frame, struct utp_stream* stream, int64_t seq, uint8_t flags);
+int32_t UTP_PACK_RECORD(char* batch, int32_t used, const char* data, int32_t length);
 
 //////	Message handling
 int 	UTP_RECV(struct utp_conn* conn, struct utp_pack* frame, int timeout);
 int 	UTP_SEND(struct utp_conn* conn, struct utp_pack* frame);
+int 	UTP_RECV_BATCH(struct utp_conn* conn, struct utp_pack** frames, int count);
+int 	UTP_SEND_BATCH(struct utp_conn* conn, struct utp_pack** frames, int count);
 
 /*******************************************************/
 //////	Connect/start
-int 	UTP_OPEN_RECV(struct utp_conn *conn, int argc, char* argv[]);
-int 	UTP_OPEN_SEND(struct utp_conn *conn, int argc, char* argv[]);
+int 	UTP_OPEN_RECV(struct utp_conn *conn, struct utp_context* ctx, int argc, char* argv[]);
+int 	UTP_OPEN_SEND(struct utp_conn *conn, struct utp_context* ctx, int argc, char* argv[]);
+int 	UTP_OPEN_REPEAT(struct utp_conn* conn, struct utp_pack* frame);
 void 	UTP_HELP();
 
+//////	Connection table
+void 	UTP_TABLE_INIT(struct utp_table* table, int32_t capacity);
+void 	UTP_TABLE_FREE(struct utp_table* table);
+int 	UTP_TABLE_ADD(struct utp_table* table, struct utp_conn* conn);
+struct utp_conn* UTP_TABLE_FIND(struct utp_table* table, uint32_t id);
+void 	UTP_TABLE_REMOVE(struct utp_table* table, uint32_t id);
+
+//////	Server (many peers on one socket)
+int 	UTP_SERVER_OPEN(struct utp_server* server, struct utp_context* ctx, int argc, char* argv[]);
+void 	UTP_SERVER_CLOSE(struct utp_server* server);
+int 	UTP_SERVER_RECV(struct utp_server* server, struct utp_pack** frames, struct utp_conn** conns, struct sockaddr_in* from, int count);
+int 	UTP_SERVER_ACCEPT(struct utp_server* server, struct utp_conn* conn, struct utp_pack* frame, struct sockaddr_in* from);
+int 	UTP_SERVER_REPEAT(struct utp_conn* conn, struct utp_pack* frame);
+struct utp_conn* UTP_SERVER_FIND(struct utp_server* server, uint32_t id);
+void 	UTP_SERVER_DROP(struct utp_server* server, struct utp_conn* conn);
+
 //////	Teardown
 int 	UTP_CLOSE_RECV(struct utp_conn* conn, struct utp_pack* frame);
 int 	UTP_CLOSE_SEND(struct utp_conn* conn, struct utp_pack* frame);